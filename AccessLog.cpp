@@ -0,0 +1,142 @@
+#include "AccessLog.hpp"
+#include "ProjLogger.hpp"
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <chrono>
+#include <ctime>
+#include <cstdio>
+#include <algorithm>
+
+static uint64_t nowMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+PeerAddress PeerAddress::of(int fd) {
+	PeerAddress peer;
+	sockaddr_storage addr{};
+	socklen_t len = sizeof(addr);
+	if (getpeername(fd, (sockaddr*)&addr, &len) < 0) {
+		return peer;
+	}
+	if (addr.ss_family == AF_INET) {
+		auto in = (const sockaddr_in*)&addr;
+		peer.family = AF_INET;
+		peer.port = ntohs(in->sin_port);
+		memcpy(peer.addr, &in->sin_addr, sizeof(in->sin_addr));
+	}
+	else if (addr.ss_family == AF_INET6) {
+		auto in6 = (const sockaddr_in6*)&addr;
+		peer.family = AF_INET6;
+		peer.port = ntohs(in6->sin6_port);
+		memcpy(peer.addr, &in6->sin6_addr, sizeof(in6->sin6_addr));
+	}
+	return peer;
+}
+
+void PeerAddress::copyTo(AccessRecord& record) const {
+	record.family = family;
+	record.port = port;
+	memcpy(record.addr, addr, sizeof(addr));
+}
+
+AccessLog::AccessLog(const std::string& _path, size_t segmentSize)
+	: path{ _path }, capacity{ (segmentSize > sizeof(AccessLogHeader)) ? (segmentSize - sizeof(AccessLogHeader)) / sizeof(AccessRecord) : 1 }
+{
+	struct stat st;
+	if ((stat(path.c_str(), &st) == 0) && (rename(path.c_str(), rotatedName().c_str()) < 0)) {
+		Log.error("Can't rotate access log {}: {}", path, strerror(errno));
+	}
+	openSegment();
+}
+
+AccessLog::~AccessLog() {
+	closeSegment();
+}
+
+void AccessLog::write(std::span<const AccessRecord> records) {
+	std::lock_guard<std::mutex> lck(mtx);
+	while (!records.empty() && map) {
+		if (used == capacity) {
+			// segment is full - it becomes a separate file, and the next one is started at path
+			closeSegment();
+			if (rename(path.c_str(), rotatedName().c_str()) < 0) {
+				Log.error("Can't rotate access log {}: {}", path, strerror(errno));
+			}
+			if (!openSegment()) {
+				return;
+			}
+		}
+		size_t n = std::min(records.size(), capacity - used);
+		memcpy(map + sizeof(AccessLogHeader) + used * sizeof(AccessRecord), records.data(), n * sizeof(AccessRecord));
+		used += n;
+		records = records.subspan(n);
+	}
+}
+
+// new file is preallocated to the whole segment and mapped, zero tail marks end of records
+bool AccessLog::openSegment() {
+	size_t size = sizeof(AccessLogHeader) + capacity * sizeof(AccessRecord);
+	fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		Log.error("Can't create access log {}: {}", path, strerror(errno));
+		return false;
+	}
+	if (ftruncate(fd, size) < 0) {
+		Log.error("Can't allocate access log {}: {}", path, strerror(errno));
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (p == MAP_FAILED) {
+		Log.error("Can't map access log {}: {}", path, strerror(errno));
+		close(fd);
+		fd = -1;
+		return false;
+	}
+	map = (uint8_t*)p;
+	used = 0;
+	AccessLogHeader header{};
+	memcpy(header.magic, AccessLogHeader::Magic, sizeof(header.magic));
+	header.version = AccessLogHeader::Version;
+	header.recordSize = sizeof(AccessRecord);
+	header.created = nowMicros();
+	memcpy(map, &header, sizeof(header));
+	mapped.store(true, std::memory_order_release);
+	return true;
+}
+
+// unused preallocated tail is cut off
+void AccessLog::closeSegment() {
+	if (!map) {
+		return;
+	}
+	mapped.store(false, std::memory_order_release);
+	munmap(map, sizeof(AccessLogHeader) + capacity * sizeof(AccessRecord));
+	map = nullptr;
+	if (ftruncate(fd, sizeof(AccessLogHeader) + used * sizeof(AccessRecord)) < 0) {
+		Log.error("Can't truncate access log {}: {}", path, strerror(errno));
+	}
+	close(fd);
+	fd = -1;
+}
+
+// "<path>.20261017-120000", with counter if such file exists
+std::string AccessLog::rotatedName() const {
+	time_t t = time(nullptr);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char stamp[32];
+	strftime(stamp, sizeof(stamp), "%Y%m%d-%H%M%S", &tm);
+	std::string name = path + "." + stamp;
+	struct stat st;
+	for (size_t i = 1; stat(name.c_str(), &st) == 0; ++i) {
+		name = path + "." + stamp + "-" + std::to_string(i);
+	}
+	return name;
+}
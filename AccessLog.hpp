@@ -0,0 +1,88 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <span>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+// one request in binary access log, layout is fixed so log may be read by other tools
+struct AccessRecord {
+	static constexpr size_t UrlCapacity = 74;
+	// microseconds since epoch, when request headers were received
+	uint64_t time;
+	// size of response head and body as far as it is known when reply is ready, streamed bodies are not counted
+	uint64_t bytes;
+	// microseconds from request headers till reply is ready
+	uint32_t latency;
+	uint16_t status;
+	uint16_t worker;
+	// AF_INET or AF_INET6, 0 - unknown
+	uint8_t family;
+	uint8_t reserved;
+	// host order
+	uint16_t port;
+	// network order, ipv4 takes first 4 bytes
+	uint8_t addr[16];
+	// not terminated if all 8 chars are used
+	char method[8];
+	// length of whole url, only first UrlCapacity bytes are kept
+	uint16_t urlSize;
+	char url[UrlCapacity];
+};
+static_assert(sizeof(AccessRecord) == 128 && std::is_trivially_copyable_v<AccessRecord>);
+
+// client of connection, taken once per connection
+struct PeerAddress {
+	uint8_t family = 0;
+	uint16_t port = 0;
+	uint8_t addr[16] = {};
+	static PeerAddress of(int fd);
+	void copyTo(AccessRecord& record) const;
+};
+
+// starts every log file, records follow it
+struct AccessLogHeader {
+	static constexpr char Magic[8] = { 'A', 'C', 'C', 'E', 'S', 'S', 'L', 'G' };
+	static constexpr uint32_t Version = 1;
+	char magic[8];
+	uint32_t version;
+	uint32_t recordSize;
+	// microseconds since epoch
+	uint64_t created;
+	char reserved[104];
+};
+static_assert(sizeof(AccessLogHeader) == sizeof(AccessRecord));
+
+// binary access log written through memory mapping, so appending records costs no syscalls
+// file is preallocated by segments, when segment is full file is cut to its records and renamed to "<path>.<date-time>"
+// records after the last one are zero, so reader stops at record with zero time if process has crashed
+// workers collect records locally and pass them here by batches, one lock per batch
+class AccessLog {
+public:
+	static constexpr size_t DefaultSegmentSize = 64 * 1024 * 1024;
+	// existing file at path is rotated first
+	AccessLog(const std::string& path, size_t segmentSize = DefaultSegmentSize);
+	AccessLog(const AccessLog&) = delete;
+	AccessLog& operator=(const AccessLog&) = delete;
+	~AccessLog();
+	// false - file can't be created or mapped, records are dropped
+	inline bool enabled() const { return mapped.load(std::memory_order_acquire); }
+	void write(std::span<const AccessRecord> records);
+private:
+	bool openSegment();
+	void closeSegment();
+	std::string rotatedName() const;
+
+	std::string path;
+	// records per segment
+	size_t capacity;
+	size_t used = 0;
+	int fd = -1;
+	uint8_t* map = nullptr;
+	// map is not null, may be read without lock
+	std::atomic<bool> mapped = false;
+	std::mutex mtx;
+};
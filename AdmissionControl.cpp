@@ -0,0 +1,96 @@
+#include "AdmissionControl.hpp"
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <algorithm>
+#include <string.h>
+
+AdmissionControl::AdmissionControl(size_t maxFds) {
+	if (maxFds == 0) {
+		rlimit lim;
+		maxFds = ((getrlimit(RLIMIT_NOFILE, &lim) == 0) && (lim.rlim_cur != RLIM_INFINITY)) ? lim.rlim_cur : MaxTableSize;
+	}
+	size = std::min(maxFds, MaxTableSize);
+	peers = std::make_unique<PeerKey[]>(size);
+}
+
+bool AdmissionControl::peerKey(int fd, PeerKey& key) {
+	sockaddr_storage addr{};
+	socklen_t len = sizeof(addr);
+	if (getpeername(fd, (sockaddr*)&addr, &len) < 0) {
+		return false;
+	}
+	uint8_t bytes[16] = {};
+	if (addr.ss_family == AF_INET) {
+		const auto& in = (const sockaddr_in&)addr;
+		if (in.sin_addr.s_addr == 0) {
+			return false;
+		}
+		bytes[10] = 0xff;
+		bytes[11] = 0xff;
+		memcpy(bytes + 12, &in.sin_addr, 4);
+	}
+	else if (addr.ss_family == AF_INET6) {
+		const auto& in6 = (const sockaddr_in6&)addr;
+		if (IN6_IS_ADDR_UNSPECIFIED(&in6.sin6_addr)) {
+			return false;
+		}
+		memcpy(bytes, &in6.sin6_addr, sizeof(bytes));
+	}
+	else {
+		return false;
+	}
+	memcpy(&key.hi, bytes, 8);
+	memcpy(&key.lo, bytes + 8, 8);
+	return true;
+}
+
+bool AdmissionControl::admit(int fd) {
+	size_t count = _connections.fetch_add(1, std::memory_order_relaxed) + 1;
+	if ((_limits.maxConnections > 0) && (count > _limits.maxConnections)) {
+		_connections.fetch_sub(1, std::memory_order_relaxed);
+		return false;
+	}
+	if ((_limits.maxConnectionsPerIp == 0) || (fd < 0) || ((size_t)fd >= size)) {
+		return true;
+	}
+	PeerKey peer;
+	if (!peerKey(fd, peer)) {
+		// peer is unknown, only global limit applies
+		peers[fd] = {};
+		return true;
+	}
+	auto& sh = shard(peer);
+	{
+		std::lock_guard<std::mutex> lck(sh.mtx);
+		auto& perIp = sh.connections[peer];
+		if (perIp >= _limits.maxConnectionsPerIp) {
+			_connections.fetch_sub(1, std::memory_order_relaxed);
+			return false;
+		}
+		++perIp;
+	}
+	peers[fd] = peer;
+	return true;
+}
+
+void AdmissionControl::release(int fd) {
+	_connections.fetch_sub(1, std::memory_order_relaxed);
+	if ((fd < 0) || ((size_t)fd >= size) || peers[fd].empty()) {
+		return;
+	}
+	PeerKey peer = peers[fd];
+	peers[fd] = {};
+	auto& sh = shard(peer);
+	std::lock_guard<std::mutex> lck(sh.mtx);
+	if (auto iter = sh.connections.find(peer); (iter != sh.connections.end()) && (--iter->second == 0)) {
+		sh.connections.erase(iter);
+	}
+}
+
+bool AdmissionControl::canAccept() const {
+	if ((_limits.maxConnections > 0) && (connections() >= _limits.maxConnections)) {
+		return false;
+	}
+	return (_limits.memoryBudget == 0) || (memoryUsed() < (int64_t)_limits.memoryBudget);
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <mutex>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include <cstddef>
+#include <functional>
+
+// limits protecting server from overload, zero disables limit
+struct AdmissionLimits {
+	size_t maxConnections = 0;
+	size_t maxConnectionsPerIp = 0;
+	// estimated memory of connection buffers, accepting is paused while it is exceeded
+	size_t memoryBudget = 0;
+	// socket events waiting for worker, requests get 503 right away above it
+	size_t maxQueueDepth = 0;
+};
+
+// decides whether accepted connections are kept, shared by acceptors and workers
+class AdmissionControl {
+public:
+	// maxFds == 0 - table size is taken from RLIMIT_NOFILE
+	AdmissionControl(size_t maxFds = 0);
+	// must be called before serving
+	inline void setLimits(const AdmissionLimits& limits) { _limits = limits; }
+	inline const AdmissionLimits& limits() const { return _limits; }
+	// called for every accepted fd, false - connection is over limits and must be closed
+	bool admit(int fd);
+	// must be called for admitted fd before it is closed
+	void release(int fd);
+	// connections charge memory they hold, delta may be negative
+	inline void charge(int64_t delta) { memory.fetch_add(delta, std::memory_order_relaxed); }
+	// acceptor stops listening while it is false
+	bool canAccept() const;
+	inline size_t connections() const { return _connections.load(std::memory_order_relaxed); }
+	inline int64_t memoryUsed() const { return memory.load(std::memory_order_relaxed); }
+private:
+	static constexpr size_t MaxTableSize = 1 << 20;
+	static constexpr size_t ShardsCount = 16;
+	// peer address as ipv6 one, ipv4 is mapped (::ffff:a.b.c.d), so dual-stack listener counts both forms together
+	struct PeerKey {
+		uint64_t hi = 0;
+		uint64_t lo = 0;
+		inline bool empty() const { return (hi == 0) && (lo == 0); }
+		bool operator==(const PeerKey&) const = default;
+	};
+	struct PeerKeyHash {
+		inline size_t operator()(const PeerKey& key) const { return std::hash<uint64_t>{}(key.hi ^ (key.lo * 0x9E3779B97F4A7C15ull)); }
+	};
+	struct alignas(64) Shard {
+		std::mutex mtx;
+		std::unordered_map<PeerKey, size_t, PeerKeyHash> connections;
+	};
+	// false if peer is unknown or not an ip one
+	static bool peerKey(int fd, PeerKey& key);
+	inline Shard& shard(const PeerKey& key) { return shards[PeerKeyHash{}(key) % ShardsCount]; }
+	AdmissionLimits _limits;
+	alignas(64) std::atomic<size_t> _connections = 0;
+	alignas(64) std::atomic<int64_t> memory = 0;
+	Shard shards[ShardsCount];
+	// peer address by fd, so release() knows which counter to decrement, empty - not counted
+	std::unique_ptr<PeerKey[]> peers;
+	size_t size = 0;
+};
@@ -0,0 +1,203 @@
+#include "AssetCache.hpp"
+#include "ProjLogger.hpp"
+#include <filesystem>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <unistd.h>
+#include <string.h>
+
+static constexpr uint32_t WatchMask = IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE | IN_DELETE | IN_DELETE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_MOVE_SELF;
+
+size_t AssetCache::Asset::memSize() const {
+	size_t size = path.size() + etag.size() + lastModified.size();
+	for (size_t i = 0; i < (size_t)Encoding::Count; ++i) {
+		if (encoded[i]) size += encoded[i]->size();
+		if (notModified[i]) size += notModified[i]->size();
+	}
+	return size;
+}
+
+AssetCache::AssetCache(size_t _memoryBudget)
+	: memoryBudget{ _memoryBudget }
+{
+	;
+}
+
+AssetCache::~AssetCache() {
+	watcher.request_stop();
+	if (watcher.joinable()) {
+		watcher.join();
+	}
+}
+
+void AssetCache::setRoot(const std::string& root) {
+	// nothing is cached or returned from here till new watcher runs
+	watching = false;
+	watcher.request_stop();
+	if (watcher.joinable()) {
+		watcher.join();
+	}
+	watches.clear();
+	clear();
+
+	int inotifyFd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotifyFd < 0) {
+		Log.error("Error while creating inotify: {}, asset cache is disabled", strerror(errno));
+		return;
+	}
+	std::error_code ec;
+	auto canonicalRoot = std::filesystem::canonical(root, ec);
+	if (ec) {
+		Log.error("Asset cache can't watch root {}: {}", root, ec.message());
+		close(inotifyFd);
+		return;
+	}
+	addWatch(inotifyFd, canonicalRoot.string());
+	watcher = std::jthread([this, inotifyFd](std::stop_token stop) { watch(stop, inotifyFd); });
+	// entries could have been inserted from files read under previous root
+	clear();
+	watching = true;
+}
+
+std::shared_ptr<const AssetCache::Asset> AssetCache::find(const std::string& key) {
+	std::lock_guard<std::mutex> lck(mtx);
+	if (!watching) {
+		// can't track changes - not caching at all
+		return nullptr;
+	}
+	auto iter = entries.find(key);
+	if (iter == entries.end()) {
+		return nullptr;
+	}
+	lru.splice(lru.begin(), lru, iter->second);
+	return iter->second->asset;
+}
+
+void AssetCache::insert(const std::string& key, std::shared_ptr<const Asset> asset, uint64_t generation) {
+	std::lock_guard<std::mutex> lck(mtx);
+	if (!watching || (generation != _generation.load()) || (asset->memSize() > memoryBudget)) {
+		return;
+	}
+	if (auto iter = entries.find(key); iter != entries.end()) {
+		memoryUsed -= iter->second->asset->memSize();
+		lru.erase(iter->second);
+		entries.erase(iter);
+	}
+	memoryUsed += asset->memSize();
+	lru.push_front({ key, std::move(asset) });
+	entries[key] = lru.begin();
+	evict();
+}
+
+// drops every entry built from path or from anything under it
+void AssetCache::invalidate(const std::string& path) {
+	std::lock_guard<std::mutex> lck(mtx);
+	++_generation;
+	for (auto iter = lru.begin(); iter != lru.end();) {
+		const auto& assetPath = iter->asset->path;
+		if ((assetPath == path) || (assetPath.starts_with(path) && (assetPath.size() > path.size()) && (assetPath[path.size()] == '/'))) {
+			Log.debug("Asset cache: invalidating {}", assetPath);
+			memoryUsed -= iter->asset->memSize();
+			entries.erase(iter->key);
+			iter = lru.erase(iter);
+		}
+		else {
+			++iter;
+		}
+	}
+}
+
+void AssetCache::clear() {
+	std::lock_guard<std::mutex> lck(mtx);
+	++_generation;
+	lru.clear();
+	entries.clear();
+	memoryUsed = 0;
+}
+
+std::string_view AssetCache::encodingName(Encoding enc) {
+	switch (enc) {
+	case Encoding::Gzip: return "gzip";
+	case Encoding::Brotli: return "br";
+	default: return "identity";
+	}
+}
+
+std::string_view AssetCache::encodingExt(Encoding enc) {
+	switch (enc) {
+	case Encoding::Gzip: return ".gz";
+	case Encoding::Brotli: return ".br";
+	default: return "";
+	}
+}
+
+void AssetCache::evict() {
+	while ((memoryUsed > memoryBudget) && !lru.empty()) {
+		auto& entry = lru.back();
+		memoryUsed -= entry.asset->memSize();
+		entries.erase(entry.key);
+		lru.pop_back();
+	}
+}
+
+void AssetCache::addWatch(int inotifyFd, const std::string& dir) {
+	int wd = inotify_add_watch(inotifyFd, dir.c_str(), WatchMask);
+	if (wd < 0) {
+		Log.error("Asset cache can't watch {}: {}", dir, strerror(errno));
+		return;
+	}
+	watches[wd] = dir;
+	std::error_code ec;
+	for (const auto& entry : std::filesystem::directory_iterator(dir, ec)) {
+		if (entry.is_directory(ec) && !entry.is_symlink(ec)) {
+			addWatch(inotifyFd, entry.path().string());
+		}
+	}
+}
+
+void AssetCache::watch(std::stop_token stop, int inotifyFd) {
+	alignas(inotify_event) char buf[16 * 1024];
+	pollfd pfd{ inotifyFd, POLLIN, 0 };
+	while (!stop.stop_requested()) {
+		// waking up from time to time to check for stop
+		if (poll(&pfd, 1, 1000) <= 0) {
+			continue;
+		}
+		ssize_t len = 0;
+		while ((len = read(inotifyFd, buf, sizeof(buf))) > 0) {
+			for (char* ptr = buf; ptr < buf + len;) {
+				auto* event = (inotify_event*)ptr;
+				ptr += sizeof(inotify_event) + event->len;
+				if (event->mask & IN_Q_OVERFLOW) {
+					// events are lost - nothing can be trusted
+					clear();
+					continue;
+				}
+				auto iter = watches.find(event->wd);
+				if (iter == watches.end()) {
+					continue;
+				}
+				if (event->mask & IN_IGNORED) {
+					watches.erase(iter);
+					continue;
+				}
+				std::string path = iter->second;
+				if (event->len > 0) {
+					path += '/';
+					path += event->name;
+				}
+				if ((event->mask & IN_ISDIR) && (event->mask & (IN_CREATE | IN_MOVED_TO))) {
+					addWatch(inotifyFd, path);
+				}
+				invalidate(path);
+				// precompressed variant has changed - whole asset is stale
+				for (auto enc : { Encoding::Gzip, Encoding::Brotli }) {
+					if (path.ends_with(encodingExt(enc))) {
+						invalidate(path.substr(0, path.size() - encodingExt(enc).size()));
+					}
+				}
+			}
+		}
+	}
+	close(inotifyFd);
+}
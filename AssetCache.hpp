@@ -0,0 +1,76 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include <mutex>
+#include <list>
+#include <thread>
+#include <unordered_map>
+#include <atomic>
+#include <ctime>
+
+// in-memory cache of static files with fully encoded responses
+// entries are evicted by LRU when memory budget is exceeded, and invalidated by inotify events under root
+class AssetCache {
+public:
+	enum class Encoding {
+		Identity,
+		Gzip,
+		Brotli,
+		Count
+	};
+
+	struct Asset {
+		// canonical path of source file
+		std::string path;
+		// encoded header lines + body for every available encoding, precompressed ones are taken from ".gz"/".br" siblings
+		// status line is not included, it is sent from shared ones
+		std::shared_ptr<const std::string> encoded[(size_t)Encoding::Count];
+		// header lines of bodyless 304 responses for the same encodings
+		std::shared_ptr<const std::string> notModified[(size_t)Encoding::Count];
+		// validators of source file, etag is without quotes and encoding suffix
+		std::string etag;
+		std::string lastModified;
+		time_t mtime = 0;
+		size_t memSize() const;
+	};
+
+	AssetCache(size_t memoryBudget);
+	AssetCache(const AssetCache&) = delete;
+	AssetCache& operator=(const AssetCache&) = delete;
+	~AssetCache();
+	// (re)starts watching root for changes
+	void setRoot(const std::string& root);
+	std::shared_ptr<const Asset> find(const std::string& key);
+	// generation must be taken before reading file, so entry built from stale data is not inserted
+	void insert(const std::string& key, std::shared_ptr<const Asset> asset, uint64_t generation);
+	inline uint64_t generation() const { return _generation.load(); }
+	void invalidate(const std::string& path);
+	void clear();
+	static std::string_view encodingName(Encoding enc);
+	static std::string_view encodingExt(Encoding enc);
+	// maximum size of single file to be cached
+	static constexpr size_t MaxAssetSize = 512 * 1024;
+private:
+	struct Entry {
+		std::string key;
+		std::shared_ptr<const Asset> asset;
+	};
+	void watch(std::stop_token stop, int inotifyFd);
+	void addWatch(int inotifyFd, const std::string& dir);
+	void evict();
+
+	size_t memoryBudget;
+	size_t memoryUsed = 0;
+	std::mutex mtx;
+	// front is most recently used
+	std::list<Entry> lru;
+	std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+	std::atomic<uint64_t> _generation = 0;
+
+	// watch descriptor to watched directory
+	std::unordered_map<int, std::string> watches;
+	// set while watcher runs, read by workers instead of touching watcher which setRoot replaces
+	std::atomic<bool> watching = false;
+	std::jthread watcher;
+};
@@ -0,0 +1,165 @@
+#include "AsyncLogger.hpp"
+#include <algorithm>
+#include <ctime>
+
+static std::string_view levelName(LogLevel level) {
+	switch (level) {
+	case LogLevel::Debug: return "DEBUG";
+	case LogLevel::Info: return "INFO";
+	case LogLevel::Warning: return "WARNING";
+	case LogLevel::Error: return "ERROR";
+	default: return "";
+	}
+}
+
+static int64_t nowMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+AsyncLogger& AsyncLogger::get() {
+	static AsyncLogger logger;
+	return logger;
+}
+
+AsyncLogger::~AsyncLogger() {
+	stop();
+}
+
+void AsyncLogger::start(Options options) {
+	stop();
+	minLevel = options.level;
+	overflow = options.overflow;
+	flushInterval = options.flushInterval;
+	file = stdout;
+	if (!options.path.empty()) {
+		if (FILE* f = fopen(options.path.c_str(), "a"); f) {
+			file = f;
+		}
+		else {
+			fprintf(stderr, "Can't open log file %s, logging to stdout\n", options.path.c_str());
+		}
+	}
+	running = true;
+	thread = std::jthread([this](std::stop_token stop) { run(stop); });
+}
+
+void AsyncLogger::stop() {
+	if (!thread.joinable()) {
+		return;
+	}
+	running = false;
+	thread.request_stop();
+	wake.release();
+	thread.join();
+	if (file && (file != stdout)) {
+		fclose(file);
+	}
+	file = nullptr;
+}
+
+void AsyncLogger::push(const Record& record) {
+	auto& local = localRing();
+	Record stamped = record;
+	stamped.time = nowMicros();
+	stamped.thread = local.index;
+	while (!local.ring.push(stamped)) {
+		if ((overflow == Overflow::Drop) || !running) {
+			droppedTotal.fetch_add(1, std::memory_order_relaxed);
+			droppedRecent.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		wake.release();
+		std::this_thread::yield();
+	}
+	// errors are written right away, others when ring gets half full or on next flush
+	if ((record.level == LogLevel::Error) || (local.ring.size() == RingSize / 2)) {
+		wake.release();
+	}
+}
+
+AsyncLogger::ThreadRing& AsyncLogger::localRing() {
+	// marks ring finished when thread exits, background thread drops it after draining
+	struct Holder {
+		std::shared_ptr<ThreadRing> ring;
+		~Holder() {
+			if (ring) {
+				ring->finished = true;
+			}
+		}
+	};
+	thread_local Holder holder;
+	if (!holder.ring) {
+		holder.ring = std::make_shared<ThreadRing>();
+		std::lock_guard<std::mutex> lck(ringsMtx);
+		holder.ring->index = nextThread++;
+		rings.push_back(holder.ring);
+	}
+	return *holder.ring;
+}
+
+void AsyncLogger::run(std::stop_token stop) {
+	std::vector<Record> batch;
+	std::string out;
+	while (true) {
+		bool stopping = stop.stop_requested();
+		collect(batch);
+		write(batch, out);
+		if (stopping) {
+			break;
+		}
+		if (batch.empty()) {
+			wake.try_acquire_for(flushInterval);
+		}
+		batch.clear();
+	}
+}
+
+void AsyncLogger::collect(std::vector<Record>& batch) {
+	std::vector<std::shared_ptr<ThreadRing>> current;
+	{
+		std::lock_guard<std::mutex> lck(ringsMtx);
+		// finished flag is read before draining, so nothing pushed before it is lost
+		std::erase_if(rings, [](const auto& ring) { return ring->finished && (ring->ring.size() == 0); });
+		current = rings;
+	}
+	Record record;
+	for (const auto& ring : current) {
+		while (ring->ring.pop(record)) {
+			batch.push_back(record);
+		}
+	}
+	// rings are drained one after another, so messages of different threads are put in order of time
+	std::stable_sort(batch.begin(), batch.end(), [](const Record& a, const Record& b) { return a.time < b.time; });
+}
+
+// "2026-10-17 12:00:00.123456 [INFO] [3] message"
+void AsyncLogger::write(const std::vector<Record>& batch, std::string& out) {
+	out.clear();
+	// date and time are rendered once per second
+	int64_t second = -1;
+	char stamp[32] = {};
+	for (const auto& record : batch) {
+		if (record.time / 1000000 != second) {
+			second = record.time / 1000000;
+			time_t t = (time_t)second;
+			struct tm tm;
+			localtime_r(&t, &tm);
+			strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &tm);
+		}
+		std::format_to(std::back_inserter(out), "{}.{:06} [{}] [{}] ", stamp, record.time % 1000000, levelName(record.level), record.thread);
+		try {
+			record.format(out, std::string_view(record.fmt, record.fmtSize), record.payload);
+		}
+		catch (const std::format_error& e) {
+			out += e.what();
+		}
+		out += '\n';
+	}
+	if (size_t lost = droppedRecent.exchange(0, std::memory_order_relaxed); lost > 0) {
+		std::format_to(std::back_inserter(out), "[WARNING] {} log messages dropped, logging is faster than output\n", lost);
+	}
+	if (!out.empty() && file) {
+		fwrite(out.data(), 1, out.size(), file);
+		fflush(file);
+	}
+}
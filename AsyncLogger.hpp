@@ -0,0 +1,198 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <format>
+#include <tuple>
+#include <algorithm>
+#include <iterator>
+#include <memory>
+#include <vector>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <semaphore>
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include "SpscRing.hpp"
+
+enum class LogLevel : uint8_t {
+	Debug,
+	Info,
+	Warning,
+	Error
+};
+
+// logger with per-thread lock-free rings drained by background thread into file or stdout
+// level is checked before anything else, arguments are copied in binary form and formatted only by background thread
+// format string must be a literal, so only pointer to it is kept
+class AsyncLogger {
+public:
+	// what producer does when its ring is full
+	enum class Overflow : uint8_t {
+		// message is lost, number of lost ones is reported later
+		Drop,
+		// producer waits for background thread
+		Block
+	};
+	struct Options {
+		LogLevel level = LogLevel::Info;
+		Overflow overflow = Overflow::Drop;
+		// empty - stdout
+		std::string path;
+		// background thread wakes up so often while there is nothing urgent
+		std::chrono::milliseconds flushInterval{ 10 };
+	};
+	// encoded arguments of one message, text arguments are truncated to fit
+	struct Record {
+		static constexpr size_t PayloadSize = 200;
+		using FormatFn = void (*)(std::string& out, std::string_view fmt, const char* payload);
+		int64_t time;
+		const char* fmt;
+		uint32_t fmtSize;
+		uint32_t thread;
+		FormatFn format;
+		LogLevel level;
+		char payload[PayloadSize];
+	};
+	static constexpr size_t RingSize = 1024;
+
+	static AsyncLogger& get();
+	AsyncLogger(const AsyncLogger&) = delete;
+	AsyncLogger& operator=(const AsyncLogger&) = delete;
+	~AsyncLogger();
+	// messages logged before are kept in rings as far as they fit
+	void start(Options options);
+	// writes everything logged so far and stops background thread
+	void stop();
+	inline bool enabled(LogLevel level) const { return level >= minLevel.load(std::memory_order_relaxed); }
+	inline void setLevel(LogLevel level) { minLevel.store(level, std::memory_order_relaxed); }
+	inline size_t dropped() const { return droppedTotal.load(std::memory_order_relaxed); }
+
+	template<typename... Args>
+	void log(LogLevel level, std::format_string<Args...> fmt, Args&&... args) {
+		if (!enabled(level)) {
+			return;
+		}
+		Record record;
+		record.level = level;
+		record.fmt = fmt.get().data();
+		record.fmtSize = (uint32_t)fmt.get().size();
+		record.format = &formatRecord<std::remove_cvref_t<Args>...>;
+		char* p = record.payload;
+		// bytes of fixed-size arguments not written yet, text ones get what is left
+		size_t reserved = (fixedSize<std::remove_cvref_t<Args>>() + ... + 0);
+		static_assert((fixedSize<std::remove_cvref_t<Args>>() + ... + 0) <= Record::PayloadSize, "too many arguments");
+		(encode(p, record.payload + Record::PayloadSize, reserved, args), ...);
+		push(record);
+	}
+	template<typename... Args>
+	inline void debug(std::format_string<Args...> fmt, Args&&... args) { log(LogLevel::Debug, fmt, std::forward<Args>(args)...); }
+	template<typename... Args>
+	inline void info(std::format_string<Args...> fmt, Args&&... args) { log(LogLevel::Info, fmt, std::forward<Args>(args)...); }
+	template<typename... Args>
+	inline void warning(std::format_string<Args...> fmt, Args&&... args) { log(LogLevel::Warning, fmt, std::forward<Args>(args)...); }
+	template<typename... Args>
+	inline void error(std::format_string<Args...> fmt, Args&&... args) { log(LogLevel::Error, fmt, std::forward<Args>(args)...); }
+private:
+	using RingT = SpscRing<Record, RingSize>;
+	struct ThreadRing {
+		RingT ring;
+		uint32_t index = 0;
+		// owner thread has exited, ring is removed once drained
+		std::atomic<bool> finished = false;
+	};
+
+	AsyncLogger() = default;
+
+	template<typename T>
+	static constexpr bool IsText = std::is_convertible_v<const T&, std::string_view>;
+	// numbers are copied as is, anything else is formatted on caller's thread and passed as text
+	template<typename T>
+	static constexpr bool IsRaw = !IsText<T> && (std::is_arithmetic_v<T> || std::is_same_v<T, const void*> || std::is_same_v<T, void*>);
+	template<typename T>
+	using Stored = std::conditional_t<IsRaw<T>, T, std::string_view>;
+
+	// texts have 2-byte length before them
+	template<typename T>
+	static constexpr size_t fixedSize() { return IsRaw<T> ? sizeof(T) : sizeof(uint16_t); }
+
+	template<typename T>
+	static void encode(char*& p, char* end, size_t& reserved, const T& value) {
+		using D = std::remove_cvref_t<T>;
+		reserved -= fixedSize<D>();
+		if constexpr (IsRaw<D>) {
+			memcpy(p, &value, sizeof(D));
+			p += sizeof(D);
+		}
+		else if constexpr (IsText<D>) {
+			encodeText(p, end, reserved, textOf(value));
+		}
+		else {
+			encodeText(p, end, reserved, std::format("{}", value));
+		}
+	}
+	template<typename T>
+	static std::string_view textOf(const T& value) {
+		if constexpr (std::is_pointer_v<T>) {
+			return value ? std::string_view(value) : std::string_view("(null)");
+		}
+		else {
+			return std::string_view(value);
+		}
+	}
+	static void encodeText(char*& p, char* end, size_t reserved, std::string_view text) {
+		size_t avail = (size_t)(end - p) - sizeof(uint16_t) - reserved;
+		uint16_t size = (uint16_t)std::min(text.size(), avail);
+		memcpy(p, &size, sizeof(size));
+		memcpy(p + sizeof(size), text.data(), size);
+		p += sizeof(size) + size;
+	}
+
+	template<typename T>
+	static Stored<T> decode(const char*& p) {
+		if constexpr (IsRaw<T>) {
+			T value;
+			memcpy(&value, p, sizeof(T));
+			p += sizeof(T);
+			return value;
+		}
+		else {
+			uint16_t size;
+			memcpy(&size, p, sizeof(size));
+			std::string_view text(p + sizeof(size), size);
+			p += sizeof(size) + size;
+			return text;
+		}
+	}
+	template<typename... Args>
+	static void formatRecord(std::string& out, std::string_view fmt, const char* payload) {
+		// braced init keeps order of decoding
+		std::tuple<Stored<Args>...> values{ decode<Args>(payload)... };
+		std::apply([&out, fmt](const auto&... value) {
+			std::vformat_to(std::back_inserter(out), fmt, std::make_format_args(value...));
+			}, values);
+	}
+
+	void push(const Record& record);
+	ThreadRing& localRing();
+	void run(std::stop_token stop);
+	// takes records of all rings, drained rings of finished threads are removed
+	void collect(std::vector<Record>& batch);
+	void write(const std::vector<Record>& batch, std::string& out);
+
+	std::atomic<LogLevel> minLevel = LogLevel::Info;
+	Overflow overflow = Overflow::Drop;
+	std::chrono::milliseconds flushInterval{ 10 };
+	FILE* file = nullptr;
+	std::atomic<bool> running = false;
+	std::mutex ringsMtx;
+	std::vector<std::shared_ptr<ThreadRing>> rings;
+	uint32_t nextThread = 0;
+	std::atomic<size_t> droppedTotal = 0;
+	// dropped since last report
+	std::atomic<size_t> droppedRecent = 0;
+	std::counting_semaphore<> wake{ 0 };
+	std::jthread thread;
+};
@@ -0,0 +1,53 @@
+#include "BodySink.hpp"
+#include "ProjLogger.hpp"
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+
+TempFileSink::TempFileSink(CompleteFn onComplete, const std::string& dir)
+	: complete{ std::move(onComplete) }
+{
+	fd = open(dir.c_str(), O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+	if (fd < 0) {
+		// filesystem without O_TMPFILE support
+		std::string path = dir + "/upload.XXXXXX";
+		fd = mkostemp(path.data(), O_CLOEXEC);
+		if (fd >= 0) {
+			unlink(path.c_str());
+		}
+	}
+	if (fd < 0) {
+		Log.error("Can't create temporary file in {}: {}", dir, strerror(errno));
+	}
+}
+
+TempFileSink::~TempFileSink() {
+	if (fd >= 0) close(fd);
+}
+
+BodySink::Status TempFileSink::onData(std::string_view chunk) {
+	if (fd < 0) {
+		return Status::Abort;
+	}
+	while (!chunk.empty()) {
+		ssize_t nbytes = write(fd, chunk.data(), chunk.size());
+		if (nbytes < 0) {
+			if (errno == EINTR) continue;
+			Log.error("Error while writing temporary file: {}", strerror(errno));
+			return Status::Abort;
+		}
+		chunk.remove_prefix(nbytes);
+		size += nbytes;
+	}
+	return Status::Continue;
+}
+
+Reply TempFileSink::onComplete(EventBroker::OnEventCb cbMsgFn) {
+	if (fd < 0) {
+		ReplyHead head(500);
+		head.add(Header::ContentLength, (size_t)0);
+		return Reply(std::move(head));
+	}
+	lseek(fd, 0, SEEK_SET);
+	return complete(fd, size, cbMsgFn);
+}
@@ -0,0 +1,46 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <functional>
+#include <cstdint>
+#include "EventBroker.hpp"
+#include "Reply.hpp"
+
+// consumer of request body for streaming routes, gets body by pieces as they are read from socket
+// created by route handler when request headers are received
+class BodySink {
+public:
+	enum class Status {
+		Continue,
+		// stops reading from socket until resume() is called, for sinks passing data to slower consumers
+		Pause,
+		// request is rejected with 400
+		Abort
+	};
+	virtual ~BodySink() = default;
+	// chunk is valid only during the call
+	virtual Status onData(std::string_view chunk) = 0;
+	// whole body is received
+	virtual Reply onComplete(EventBroker::OnEventCb cbMsgFn) = 0;
+	// bytes sink can take right now, socket is read no further than that
+	// 0 works as Pause - nothing is read until resume() is called
+	virtual size_t freeSpace() const { return SIZE_MAX; }
+	// set by connection before the first onData, may be called from any thread
+	std::function<void()> resume;
+};
+
+// spills body into anonymous temporary file, so big uploads (e.g. multipart) don't stay in memory
+// file is removed as soon as it is closed
+class TempFileSink : public BodySink {
+public:
+	// fd is positioned at the beginning of body and is closed after handler returns
+	using CompleteFn = std::function<Reply(int fd, size_t size, EventBroker::OnEventCb cbMsgFn)>;
+	TempFileSink(CompleteFn onComplete, const std::string& dir = "/tmp");
+	~TempFileSink();
+	Status onData(std::string_view chunk) override;
+	Reply onComplete(EventBroker::OnEventCb cbMsgFn) override;
+private:
+	CompleteFn complete;
+	int fd = -1;
+	size_t size = 0;
+};
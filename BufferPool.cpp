@@ -0,0 +1,110 @@
+#include "BufferPool.hpp"
+#include <string.h>
+#include <algorithm>
+
+BufferPool::~BufferPool() {
+	for (auto segment : freeList) {
+		delete[] segment;
+	}
+}
+
+uint8_t* BufferPool::acquire() {
+	if (freeList.empty()) {
+		return new uint8_t[SegmentSize];
+	}
+	// the most recently used one is likely still in cache
+	auto segment = freeList.back();
+	freeList.pop_back();
+	return segment;
+}
+
+void BufferPool::release(uint8_t* segment) {
+	if (freeList.size() >= MaxFree) {
+		delete[] segment;
+		return;
+	}
+	freeList.push_back(segment);
+}
+
+BufferPool& BufferPool::local() {
+	thread_local BufferPool pool;
+	return pool;
+}
+
+InputBuffer::InputBuffer(InputBuffer&& other) noexcept
+	: storage{ other.storage }, _capacity{ other._capacity }, begin{ other.begin }, end{ other.end }
+{
+	other.storage = nullptr;
+	other._capacity = other.begin = other.end = 0;
+}
+
+InputBuffer& InputBuffer::operator=(InputBuffer&& other) noexcept {
+	if (this != &other) {
+		release();
+		storage = other.storage;
+		_capacity = other._capacity;
+		begin = other.begin;
+		end = other.end;
+		other.storage = nullptr;
+		other._capacity = other.begin = other.end = 0;
+	}
+	return *this;
+}
+
+InputBuffer::~InputBuffer() {
+	release();
+}
+
+void InputBuffer::clear(size_t n) {
+	begin += std::min(n, size());
+	if (begin == end) {
+		release();
+	}
+}
+
+std::span<uint8_t> InputBuffer::tail(size_t min) {
+	if (!storage) {
+		_capacity = std::max(min, BufferPool::SegmentSize);
+		storage = (_capacity == BufferPool::SegmentSize) ? BufferPool::local().acquire() : new uint8_t[_capacity];
+	}
+	else if (_capacity - end < min) {
+		size_t used = size();
+		if (used + min <= _capacity) {
+			// enough room after moving data to the front
+			memmove(storage, storage + begin, used);
+		}
+		else {
+			size_t capacity = std::max(_capacity * 2, used + min);
+			auto grown = new uint8_t[capacity];
+			memcpy(grown, storage + begin, used);
+			release();
+			storage = grown;
+			_capacity = capacity;
+		}
+		begin = 0;
+		end = used;
+	}
+	return { storage + end, _capacity - end };
+}
+
+void InputBuffer::append(std::span<const uint8_t> data) {
+	if (data.empty()) {
+		return;
+	}
+	auto space = tail(data.size());
+	memcpy(space.data(), data.data(), data.size());
+	commit(data.size());
+}
+
+void InputBuffer::release() {
+	if (storage) {
+		if (_capacity == BufferPool::SegmentSize) {
+			BufferPool::local().release(storage);
+		}
+		else {
+			delete[] storage;
+		}
+	}
+	storage = nullptr;
+	_capacity = begin = end = 0;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include <vector>
+#include <span>
+#include <cstdint>
+#include <cstddef>
+
+// fixed-size segments reused by connections of one thread, so steady traffic doesn't go to allocator
+// segments are plain blocks, so segment taken from one thread's pool may be given back to another's
+class BufferPool {
+public:
+	static constexpr size_t SegmentSize = 16 * 1024;
+	// free segments kept for reuse, the rest goes back to allocator
+	static constexpr size_t MaxFree = 1024;
+	BufferPool() = default;
+	BufferPool(const BufferPool&) = delete;
+	BufferPool& operator=(const BufferPool&) = delete;
+	~BufferPool();
+	uint8_t* acquire();
+	void release(uint8_t* segment);
+	inline size_t freeCount() const { return freeList.size(); }
+	// pool of calling thread, socket workers get their own one this way
+	static BufferPool& local();
+private:
+	std::vector<uint8_t*> freeList;
+};
+
+// contiguous input buffer borrowing storage from pool of current thread
+// storage is given back as soon as everything is consumed, so idle connection holds no buffer memory
+// data bigger than segment is moved to heap block, which is freed when drained as well
+class InputBuffer {
+public:
+	InputBuffer() = default;
+	InputBuffer(const InputBuffer&) = delete;
+	InputBuffer& operator=(const InputBuffer&) = delete;
+	InputBuffer(InputBuffer&& other) noexcept;
+	InputBuffer& operator=(InputBuffer&& other) noexcept;
+	~InputBuffer();
+	inline std::span<uint8_t> get() { return { storage + begin, end - begin }; }
+	inline size_t size() const { return end - begin; }
+	inline bool empty() const { return begin == end; }
+	// memory held by buffer
+	inline size_t capacity() const { return _capacity; }
+	// drops n bytes from the front, relative positions of the rest stay the same
+	void clear(size_t n);
+	// writable space of at least min bytes after data, has to be followed by commit()
+	std::span<uint8_t> tail(size_t min);
+	inline void commit(size_t n) { end += n; }
+	void append(std::span<const uint8_t> data);
+	void release();
+private:
+	uint8_t* storage = nullptr;
+	size_t _capacity = 0;
+	size_t begin = 0;
+	size_t end = 0;
+};
@@ -1,19 +1,96 @@
 #include "EventBroker.hpp"
+#include <algorithm>
 
 void EventBroker::registerProducerAndHandler(size_t producerId, OnEventCb eventHandler) {
-	std::unique_lock<std::shared_mutex> lck(mtx);
-	producerIdToEventHandlerMap[producerId] = eventHandler;
+	auto& sh = shard(producerId);
+	std::unique_lock<std::shared_mutex> lck(sh.mtx);
+	sh.producerIdToEventHandlerMap[producerId] = std::move(eventHandler);
 }
 
 void EventBroker::unregister(size_t producerId) {
-	std::unique_lock<std::shared_mutex> lck(mtx);
-	producerIdToEventHandlerMap.erase(producerId);
+	auto& sh = shard(producerId);
+	std::unique_lock<std::shared_mutex> lck(sh.mtx);
+	sh.producerIdToEventHandlerMap.erase(producerId);
 }
 
 void EventBroker::emitEvent(size_t producerId, std::variant<util::web::http::HttpResponse, std::string> msg) {
-	std::shared_lock<std::shared_mutex> lck(mtx);
-	if (auto iter = producerIdToEventHandlerMap.find(producerId); iter != producerIdToEventHandlerMap.end()) {
-		iter->second(producerId, msg);
+	OnEventCb handler;
+	{
+		auto& sh = shard(producerId);
+		std::shared_lock<std::shared_mutex> lck(sh.mtx);
+		if (auto iter = sh.producerIdToEventHandlerMap.find(producerId); iter != sh.producerIdToEventHandlerMap.end()) {
+			handler = iter->second;
+		}
+	}
+	// not holding lock while handler runs, so it may unregister itself
+	if (handler) {
+		handler(producerId, std::move(msg));
+	}
+}
+
+void EventBroker::registerWorker(size_t workerIdx, WorkerPostFn post) {
+	std::unique_lock<std::shared_mutex> lck(workersMtx);
+	if (workers.size() <= workerIdx) {
+		workers.resize(workerIdx + 1);
+	}
+	workers[workerIdx] = std::move(post);
+}
+
+void EventBroker::subscribe(const std::string& topic, size_t workerIdx) {
+	auto& sh = shard(topic);
+	std::unique_lock<std::shared_mutex> lck(sh.mtx);
+	auto& topicWorkers = sh.topicWorkers[topic];
+	if (std::find(topicWorkers.begin(), topicWorkers.end(), workerIdx) == topicWorkers.end()) {
+		topicWorkers.push_back(workerIdx);
+	}
+}
+
+void EventBroker::unsubscribe(const std::string& topic, size_t workerIdx) {
+	auto& sh = shard(topic);
+	std::unique_lock<std::shared_mutex> lck(sh.mtx);
+	if (auto iter = sh.topicWorkers.find(topic); iter != sh.topicWorkers.end()) {
+		std::erase(iter->second, workerIdx);
+		if (iter->second.empty()) {
+			sh.topicWorkers.erase(iter);
+		}
+	}
+}
+
+void EventBroker::publish(const std::string& topic, std::string payload) {
+	publish(topic, std::make_shared<const std::string>(std::move(payload)));
+}
+
+void EventBroker::publish(const std::string& topic, Payload payload) {
+	// small copy of worker indices, so posting is done without holding shard lock
+	size_t targets[64];
+	size_t count = 0;
+	std::vector<size_t> moreTargets;
+	{
+		auto& sh = shard(topic);
+		std::shared_lock<std::shared_mutex> lck(sh.mtx);
+		auto iter = sh.topicWorkers.find(topic);
+		if (iter == sh.topicWorkers.end()) {
+			return;
+		}
+		if (iter->second.size() <= std::size(targets)) {
+			count = iter->second.size();
+			std::copy(iter->second.begin(), iter->second.end(), targets);
+		}
+		else {
+			moreTargets = iter->second;
+		}
+	}
+	std::shared_lock<std::shared_mutex> lck(workersMtx);
+	auto post = [this, &topic, &payload](size_t workerIdx) {
+		if ((workerIdx < workers.size()) && workers[workerIdx]) {
+			workers[workerIdx](topic, payload);
+		}
+		};
+	for (size_t i = 0; i < count; ++i) {
+		post(targets[i]);
+	}
+	for (size_t workerIdx : moreTargets) {
+		post(workerIdx);
 	}
 }
 
@@ -24,4 +101,4 @@ EventBroker& EventBroker::get() {
 
 EventBroker::EventBroker() {
 	;
-}
\ No newline at end of file
+}
@@ -5,18 +5,46 @@
 #include <mutex>
 #include <shared_mutex>
 #include <functional>
+#include <memory>
+#include <vector>
 #include "Http.hpp"
 
+// delivers messages from producers to connections
+// producers - one-to-one callbacks by producer id, topics - one-to-many broadcast to subscribed connections
+// state is split into shards by key, so unrelated producers and topics don't contend on the same lock
 class EventBroker {
 public:
 	using OnEventCb = std::function<void(size_t, std::variant<util::web::http::HttpResponse, std::string>)>;
+	// encoded message shared by all subscribers without copying
+	using Payload = std::shared_ptr<const std::string>;
+	// called from publisher's thread, worker has to deliver payload to its subscribers of topic on its own thread
+	using WorkerPostFn = std::function<void(const std::string& topic, const Payload& payload)>;
 	void registerProducerAndHandler(size_t producerId, OnEventCb eventHandler);
 	void unregister(size_t producerId);
 
 	void emitEvent(size_t producerId, std::variant<util::web::http::HttpResponse, std::string> msg);
+
+	// must be called before serving, for every socket worker
+	void registerWorker(size_t workerIdx, WorkerPostFn post);
+	// worker reports that it has got first subscriber of topic, or has lost the last one
+	void subscribe(const std::string& topic, size_t workerIdx);
+	void unsubscribe(const std::string& topic, size_t workerIdx);
+	// payload is sent as is to every subscriber, cost is one post per worker having subscribers
+	void publish(const std::string& topic, std::string payload);
+	void publish(const std::string& topic, Payload payload);
 	static EventBroker& get();
+	static constexpr size_t ShardsCount = 16;
 protected:
 	EventBroker();
-	std::shared_mutex mtx;
-	std::unordered_map<size_t, OnEventCb> producerIdToEventHandlerMap;
-};
\ No newline at end of file
+	struct alignas(64) Shard {
+		std::shared_mutex mtx;
+		std::unordered_map<size_t, OnEventCb> producerIdToEventHandlerMap;
+		// indices of workers having subscribers
+		std::unordered_map<std::string, std::vector<size_t>> topicWorkers;
+	};
+	inline Shard& shard(size_t key) { return shards[key % ShardsCount]; }
+	inline Shard& shard(const std::string& topic) { return shards[std::hash<std::string>{}(topic) % ShardsCount]; }
+	Shard shards[ShardsCount];
+	std::shared_mutex workersMtx;
+	std::vector<WorkerPostFn> workers;
+};
@@ -0,0 +1,45 @@
+#include "HandlerPool.hpp"
+#include "ProjLogger.hpp"
+
+HandlerPool::HandlerPool(size_t threadsCount) {
+	threads.reserve(threadsCount);
+	for (size_t i = 0; i < threadsCount; ++i) {
+		threads.emplace_back([this](std::stop_token stop) { run(stop); });
+	}
+}
+
+HandlerPool::~HandlerPool() {
+	for (auto& thread : threads) {
+		thread.request_stop();
+	}
+	// jthreads are joined on destruction, before the queue is destroyed
+	threads.clear();
+}
+
+void HandlerPool::push(std::function<void()> task) {
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		tasks.push_back(std::move(task));
+	}
+	cv.notify_one();
+}
+
+void HandlerPool::run(std::stop_token stop) {
+	while (true) {
+		std::function<void()> task;
+		{
+			std::unique_lock<std::mutex> lck(mtx);
+			if (!cv.wait(lck, stop, [this]() { return !tasks.empty(); })) {
+				return;
+			}
+			task = std::move(tasks.front());
+			tasks.pop_front();
+		}
+		try {
+			task();
+		}
+		catch (const std::exception& e) {
+			Log.error("Handler pool task has thrown: {}", e.what());
+		}
+	}
+}
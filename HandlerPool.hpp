@@ -0,0 +1,24 @@
+#pragma once
+#include <functional>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+
+// threads for application code that may block (db queries, calls to other services, etc.), so socket workers never wait for it
+class HandlerPool {
+public:
+	HandlerPool(size_t threadsCount);
+	HandlerPool(const HandlerPool&) = delete;
+	HandlerPool& operator=(const HandlerPool&) = delete;
+	~HandlerPool();
+	void push(std::function<void()> task);
+	inline size_t size() const { return threads.size(); }
+private:
+	void run(std::stop_token stop);
+	std::mutex mtx;
+	std::condition_variable_any cv;
+	std::deque<std::function<void()>> tasks;
+	std::vector<std::jthread> threads;
+};
@@ -1,23 +1,33 @@
 #include "HttpServer.hpp"
 #include "ProjLogger.hpp"
+#include "Metrics.hpp"
 #include <filesystem>
-#include <fstream>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <ctime>
+#include <charconv>
+#include <cstdio>
+#include <algorithm>
+#include <random>
+#include <condition_variable>
+#include <string.h>
 #include "Utils_Fs.hpp"
 
 using namespace util::web::http;
 
-static constexpr size_t MaxFileSize = 1 * 1024 * 1024;
-
-static std::unordered_map<std::string, std::string> FileExt2ContentTypeMap{
-	{".js", "application/javascript"},
-	{".css", "text/css"},
-	{".html", "text/html; charset=utf-8"}
+// html is always revalidated, so new versions of scripts and styles referenced from it are picked up
+static std::unordered_map<std::string, HttpServer::FileTypeInfo> FileExt2ContentTypeMap{
+	{".js", {"application/javascript", "public, max-age=3600"}},
+	{".css", {"text/css", "public, max-age=3600"}},
+	{".html", {"text/html; charset=utf-8", "no-cache"}}
 };
 
 HttpServer::HttpServer() {
-	registerRoute("/", Method::GET, [this](const util::web::http::HttpRequest& request, HttpServer::CallbackMsgFn cbMsgFn) {
-		return getEntireFile("/index.html", request, cbMsgFn);
-		});
+	registerRoute("/", Method::GET, ParamRouteHandlerT([this](const util::web::http::HttpRequest& request, const RouteParams& params, HttpServer::CallbackMsgFn) {
+		return getEntireFile("/index.html", RequestHeaders{ request, &params });
+		}));
 }
 
 HttpServer& HttpServer::get() {
@@ -27,127 +37,461 @@ HttpServer& HttpServer::get() {
 
 void HttpServer::setRoot(const std::string& _root) {
 	root = _root;
+	if (assetCache) {
+		assetCache->setRoot(root);
+	}
 }
 
 void HttpServer::setRoot(std::string&& _root) {
 	root = std::move(_root);
+	if (assetCache) {
+		assetCache->setRoot(root);
+	}
+}
+
+void HttpServer::setCacheControl(const std::string& ext, const std::string& cacheControl) {
+	if (auto iter = FileExt2ContentTypeMap.find(ext); iter != FileExt2ContentTypeMap.end()) {
+		iter->second.cacheControl = cacheControl;
+	}
+	if (assetCache) {
+		assetCache->clear();
+	}
+}
+
+void HttpServer::enableAssetCache(size_t memoryBudget) {
+	if (memoryBudget == 0) {
+		assetCache.reset();
+		return;
+	}
+	assetCache = std::make_unique<AssetCache>(memoryBudget);
+	if (!root.empty()) {
+		assetCache->setRoot(root);
+	}
+}
+
+void HttpServer::registerRoute(const std::string& url, util::web::http::Method method, RouteHandlerT handler, RouteOptions options) {
+	registerRoute(url, method, ParamRouteHandlerT([handler = std::move(handler)](const util::web::http::HttpRequest& request, const RouteParams& params, CallbackMsgFn cbMsgFn) {
+		if ((!params.body().empty() && request.body.empty()) || params.hasHeaders()) {
+			// such handlers expect body and headers inside of request
+			auto full = request;
+			params.copyHeaders(full);
+			if (full.body.empty()) {
+				full.body = std::string(params.body());
+			}
+			return handler(full, cbMsgFn);
+		}
+		return handler(request, cbMsgFn);
+		}), options);
 }
 
-void HttpServer::registerRoute(const std::string& url, util::web::http::Method method, RouteHandlerT handler) {
+void HttpServer::registerRoute(const std::string& url, util::web::http::Method method, ParamRouteHandlerT handler, RouteOptions options) {
 	if (url.empty()) {
 		throw std::runtime_error("route can't be empty");
 	}
-	if (auto iter = _routes.find(method); iter != _routes.end()) {
-		if (auto iter2 = iter->second.find(url); iter2 != iter->second.end()) {
-			throw std::logic_error("route already exists");
+	insertRoute(url, method, Route{ std::move(handler), nullptr, nullptr, nullptr, options });
+}
+
+void HttpServer::registerRoute(const std::string& url, util::web::http::Method method, StreamRouteHandlerT handler, RouteOptions options) {
+	if (url.empty()) {
+		throw std::runtime_error("route can't be empty");
+	}
+	insertRoute(url, method, Route{ nullptr, std::move(handler), nullptr, nullptr, options });
+}
+
+void HttpServer::registerAsyncRoute(const std::string& url, util::web::http::Method method, ParamRouteHandlerT handler, RouteOptions options) {
+	if (url.empty()) {
+		throw std::runtime_error("route can't be empty");
+	}
+	if (!handlerPool) {
+		setHandlerThreads(std::max(1u, std::thread::hardware_concurrency()));
+	}
+	insertRoute(url, method, Route{ nullptr, nullptr, std::move(handler), nullptr, options });
+}
+
+void HttpServer::registerWebSocketRoute(const std::string& url, WebSocketRouteHandlerT handler, RouteOptions options) {
+	if (url.empty()) {
+		throw std::runtime_error("route can't be empty");
+	}
+	insertRoute(url, Method::GET, Route{ nullptr, nullptr, nullptr, std::move(handler), options });
+}
+
+void HttpServer::insertRoute(const std::string& url, util::web::http::Method method, Route&& route) {
+	std::lock_guard<std::mutex> lck(routeNamesMtx);
+	route.id = _routeNames.size();
+	_routes[method].insert(url, std::move(route));
+	_routeNames.push_back(std::string(methodName(method)) + " " + url);
+}
+
+std::vector<std::string> HttpServer::routeNames() const {
+	std::lock_guard<std::mutex> lck(routeNamesMtx);
+	return _routeNames;
+}
+
+void HttpServer::registerSseRoute(const std::string& url, std::shared_ptr<SseChannel> channel) {
+	registerRoute(url, Method::GET, ParamRouteHandlerT([channel](const util::web::http::HttpRequest& request, const RouteParams& params, CallbackMsgFn) {
+		ReplyHead head(200);
+		head.add(Header::ContentType, "text/event-stream").add(Header::CacheControl, "no-cache");
+		Reply reply(std::move(head), ChainBody());
+		reply.topics = { channel->topic(), std::string(SseChannel::HeartbeatTopic) };
+		if (std::string lastEventId = RequestHeaders{ request, &params }.find("Last-Event-ID"); !lastEventId.empty()) {
+			uint64_t lastId = 0;
+			auto [ptr, ec] = std::from_chars(lastEventId.data(), lastEventId.data() + lastEventId.size(), lastId);
+			if ((ec != std::errc()) || (ptr != lastEventId.data() + lastEventId.size())) {
+				// not an id given by this server, client gets only new events
+				Log.warning("Sse client of {} has sent invalid Last-Event-ID", channel->topic());
+				return reply;
+			}
+			// missed events are taken by worker after subscribing, so events published meanwhile are either replayed or broadcast
+			reply.replay = [channel, lastId](ChainBody& missed) {
+				uint64_t lastReplayed = lastId;
+				if (!channel->replay(lastId, missed, lastReplayed)) {
+					Log.warning("Sse client of {} has missed events older than history", channel->topic());
+				}
+				return lastReplayed;
+				};
 		}
+		return reply;
+		}));
+	if (!sseHeartbeat.joinable()) {
+		sseHeartbeat = std::jthread([](std::stop_token stop) {
+			auto payload = std::make_shared<const std::string>(": heartbeat\n\n");
+			std::mutex mtx;
+			std::condition_variable_any cv;
+			std::unique_lock<std::mutex> lck(mtx);
+			while (!stop.stop_requested()) {
+				// woken up early only by stop
+				cv.wait_for(lck, stop, SseChannel::HeartbeatInterval, []() { return false; });
+				if (!stop.stop_requested()) {
+					EventBroker::get().publish(std::string(SseChannel::HeartbeatTopic), payload);
+				}
+			}
+			});
 	}
-	_routes[method][url] = handler;
+}
+
+void HttpServer::enableMetrics(const std::string& url) {
+	registerRoute(url, Method::GET, ParamRouteHandlerT([](const util::web::http::HttpRequest&, const RouteParams&, CallbackMsgFn) {
+		auto text = std::make_shared<const std::string>(Metrics::get().render());
+		ReplyHead head(200);
+		head.add(Header::ContentType, "text/plain; version=0.0.4; charset=utf-8").add(Header::CacheControl, "no-cache").add(Header::ContentLength, text->size());
+		return Reply(std::move(head), SharedBody(std::move(text)));
+		}));
+}
+
+void HttpServer::setHandlerThreads(size_t threadsCount) {
+	handlerPool = std::make_unique<HandlerPool>(threadsCount);
+}
+
+bool HttpServer::callAsync(const Route& route, std::shared_ptr<const util::web::http::HttpRequest> request, const RouteParams& params, CallbackMsgFn cbMsgFn, AsyncDoneFn done) const {
+	size_t inFlight = route.inFlight->fetch_add(1) + 1;
+	if ((route.options.maxConcurrency > 0) && (inFlight > route.options.maxConcurrency)) {
+		route.inFlight->fetch_sub(1);
+		Log.warning("Too many requests to {} in process", request->url);
+		return false;
+	}
+	// views of params point to connection's request and route's pattern, so captures are owned by task
+	std::vector<std::pair<std::string, std::string>> captures;
+	for (const auto& [name, value] : params.all()) {
+		captures.emplace_back(name, value);
+	}
+	handlerPool->push([handler = route.asyncHandler, inFlightCounter = route.inFlight, captures = std::move(captures), request = std::move(request), cbMsgFn = std::move(cbMsgFn), done = std::move(done)]() {
+		RouteParams taskParams(request->body);
+		for (const auto& [name, value] : captures) {
+			taskParams.push(name, value);
+		}
+		std::shared_ptr<Reply> reply;
+		try {
+			reply = std::make_shared<Reply>(handler(*request, taskParams, cbMsgFn));
+		}
+		catch (const std::exception& e) {
+			Log.error("Handler of {} has thrown: {}", request->url, e.what());
+		}
+		catch (...) {
+			Log.error("Handler of {} has thrown unknown exception", request->url);
+		}
+		if (!reply) {
+			ReplyHead head(500);
+			head.add(Header::ContentLength, (size_t)0);
+			reply = std::make_shared<Reply>(std::move(head));
+		}
+		inFlightCounter->fetch_sub(1);
+		done(std::move(reply));
+		});
+	return true;
+}
+
+const HttpServer::Route* HttpServer::findRoute(const util::web::http::HttpRequest& request, RouteParams& params) const {
+	// query is not a part of route
+	std::string_view path(request.url);
+	path = path.substr(0, path.find('?'));
+	if (auto iMethod = _routes.find(request.method); iMethod != _routes.end()) {
+		return iMethod->second.find(path, params);
+	}
+	return nullptr;
 }
 
 void HttpServer::unregisterRoute(const std::string& url, util::web::http::Method method) {
 	if (auto iter = _routes.find(method); iter != _routes.end()) {
-		iter->second.erase(url);
+		iter->second.remove(url);
 		if (iter->second.empty()) {
 			_routes.erase(method);
 		}
 	}
 }
 
-util::web::http::HttpResponse HttpServer::callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
+Reply HttpServer::callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
 	switch (request.method) {
 	case Method::GET:
-		return GET(route, request, cbMsgFn);
+		return GET(route, request, cbMsgFn, body);
 	case Method::HEAD:
-		return HEAD(route, request, cbMsgFn);
+		return HEAD(route, request, cbMsgFn, body);
 	case Method::POST:
-		return POST(route, request, cbMsgFn);
+		return POST(route, request, cbMsgFn, body);
 	case Method::PUT:
-		return PUT(route, request, cbMsgFn);
+		return PUT(route, request, cbMsgFn, body);
 	case Method::DELETE:
-		return DELETE(route, request, cbMsgFn);
+		return DELETE(route, request, cbMsgFn, body);
 	case Method::CONNECT:
-		return CONNECT(route, request, cbMsgFn);
+		return CONNECT(route, request, cbMsgFn, body);
 	case Method::OPTIONS:
-		return OPTIONS(route, request, cbMsgFn);
+		return OPTIONS(route, request, cbMsgFn, body);
 	case Method::TRACE:
-		return TRACE(route, request, cbMsgFn);
+		return TRACE(route, request, cbMsgFn, body);
 	case Method::PATCH:
-		return PATCH(route, request, cbMsgFn);
+		return PATCH(route, request, cbMsgFn, body);
 	default:
 		assert(false);
 	}
 }
 
-util::web::http::HttpResponse HttpServer::_callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
+Reply HttpServer::_callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	// query is not a part of route
+	std::string_view path(route);
+	path = path.substr(0, path.find('?'));
+	RouteParams params(body);
 	if (auto iMethod = _routes.find(request.method); iMethod != _routes.end()) {
-		for (const auto& _route : iMethod->second) {
-			if (_route.first.back() == '*') {
-				// wildcard request - checking prefix to match
-				std::string_view _routeSv(_route.first);
-				_routeSv = _routeSv.substr(0, _routeSv.size() - 1);
-				if ((route.find(_routeSv) == 0) && (_routeSv.size() <= route.size())) {
-					return _route.second(request, cbMsgFn);
-				}
-			}
-			else {
-				// exact request - checking for equality
-				if (route == _route.first) {
-					return _route.second(request, cbMsgFn);
-				}
-			}
+		if (auto _route = iMethod->second.find(path, params); _route) {
+			return callRoute(*_route, request, params, cbMsgFn);
 		}
 	}
-	return defaultReponse(404, request);
+	// route exists, but for other methods
+	std::string allow;
+	for (const auto& [method, router] : _routes) {
+		params = RouteParams(body);
+		if ((method != request.method) && router.find(path, params)) {
+			if (!allow.empty()) allow += ", ";
+			allow += methodName(method);
+		}
+	}
+	if (!allow.empty()) {
+		ReplyHead head(405);
+		head.add(Header::Allow, allow).add(Header::ContentLength, (size_t)0);
+		return Reply(std::move(head));
+	}
+	return Reply::prebuilt(404);
 }
 
-util::web::http::HttpResponse HttpServer::GET(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("GET {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::callRoute(const Route& route, const util::web::http::HttpRequest& request, const RouteParams& params, CallbackMsgFn cbMsgFn) const {
+	if (route.handler) {
+		return route.handler(request, params, cbMsgFn);
+	}
+	if (route.asyncHandler) {
+		// called directly, not through socket worker
+		return route.asyncHandler(request, params, cbMsgFn);
+	}
+	if (!route.streamHandler) {
+		// websocket route called without upgrade
+		return Reply::prebuilt(426);
+	}
+	// streaming route called with whole body
+	auto sink = route.streamHandler(request, params);
+	if (!sink || (!params.body().empty() && (sink->onData(params.body()) == BodySink::Status::Abort))) {
+		return Reply::prebuilt(400);
+	}
+	return sink->onComplete(cbMsgFn);
 }
 
-util::web::http::HttpResponse HttpServer::HEAD(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("HEAD {}", route));
-	return _callRoute(route, request, cbMsgFn);
+std::string_view HttpServer::methodName(util::web::http::Method method) {
+	switch (method) {
+	case Method::GET: return "GET";
+	case Method::HEAD: return "HEAD";
+	case Method::POST: return "POST";
+	case Method::PUT: return "PUT";
+	case Method::DELETE: return "DELETE";
+	case Method::CONNECT: return "CONNECT";
+	case Method::OPTIONS: return "OPTIONS";
+	case Method::TRACE: return "TRACE";
+	case Method::PATCH: return "PATCH";
+	default: return "";
+	}
 }
 
-util::web::http::HttpResponse HttpServer::POST(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("POST {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::GET(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::PUT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("PUT {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::HEAD(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::DELETE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("DELETE {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::POST(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::CONNECT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("CONNECT {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::PUT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::OPTIONS(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("OPTIONS {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::DELETE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::TRACE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("TRACE {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::CONNECT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::PATCH(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("PATCH {}", route));
-	return _callRoute(route, request, cbMsgFn);
+Reply HttpServer::OPTIONS(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
 }
 
-util::web::http::HttpResponse HttpServer::getEntireFile(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
+Reply HttpServer::TRACE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
+}
+
+Reply HttpServer::PATCH(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn, std::string_view body) const {
+	return _callRoute(route, request, cbMsgFn, body);
+}
+
+static bool readFile(int fd, size_t fsize, std::string& data) {
+	data.resize(fsize);
+	size_t offset = 0;
+	while (offset < fsize) {
+		ssize_t nbytes = pread(fd, data.data() + offset, fsize - offset, offset);
+		if (nbytes < 0 && errno == EINTR) continue;
+		if (nbytes <= 0) return false;
+		offset += nbytes;
+	}
+	return true;
+}
+
+static std::string_view trim(std::string_view sv) {
+	while (!sv.empty() && (sv.front() == ' ' || sv.front() == '\t')) sv.remove_prefix(1);
+	while (!sv.empty() && (sv.back() == ' ' || sv.back() == '\t')) sv.remove_suffix(1);
+	return sv;
+}
+
+// checks Accept-Encoding header value for encoding with non-zero quality
+static bool acceptsEncoding(std::string_view header, std::string_view enc) {
+	while (!header.empty()) {
+		size_t end = header.find(',');
+		auto token = trim(header.substr(0, end));
+		header = (end == std::string_view::npos) ? std::string_view() : header.substr(end + 1);
+		auto params = token.find(';');
+		auto name = trim(token.substr(0, params));
+		if (name != enc) continue;
+		if (params == std::string_view::npos) return true;
+		auto q = token.find("q=", params);
+		return (q == std::string_view::npos) || (std::strtod(std::string(token.substr(q + 2)).c_str(), nullptr) > 0);
+	}
+	return false;
+}
+
+enum class RangeParseResult {
+	// invalid or unsupported header - whole file is sent
+	Ignore,
+	Unsatisfiable,
+	Ok
+};
+
+// whole token must be a number, so "10x" is not taken as 10
+static bool parseRangeNumber(std::string_view token, size_t& value) {
+	auto [ptr, ec] = std::from_chars(token.data(), token.data() + token.size(), value);
+	return (ec == std::errc()) && (ptr == token.data() + token.size());
+}
+
+// parses "bytes=0-99, 200-, -50" into [offset, length] pairs
+static RangeParseResult parseRanges(std::string_view header, size_t fsize, std::vector<std::pair<size_t, size_t>>& ranges) {
+	static constexpr size_t MaxRanges = 16;
+	constexpr std::string_view Prefix = "bytes=";
+	if (!header.starts_with(Prefix)) {
+		return RangeParseResult::Ignore;
+	}
+	header.remove_prefix(Prefix.size());
+	while (!header.empty()) {
+		size_t end = header.find(',');
+		auto spec = trim(header.substr(0, end));
+		header = (end == std::string_view::npos) ? std::string_view() : header.substr(end + 1);
+		if (spec.empty()) continue;
+		size_t dash = spec.find('-');
+		if (dash == std::string_view::npos) {
+			return RangeParseResult::Ignore;
+		}
+		auto sFirst = spec.substr(0, dash);
+		auto sLast = spec.substr(dash + 1);
+		size_t first = 0, last = 0;
+		if (!sFirst.empty() && !parseRangeNumber(sFirst, first)) {
+			return RangeParseResult::Ignore;
+		}
+		if (!sLast.empty() && !parseRangeNumber(sLast, last)) {
+			return RangeParseResult::Ignore;
+		}
+		if (sFirst.empty()) {
+			// suffix range - last N bytes
+			if (sLast.empty()) return RangeParseResult::Ignore;
+			if ((last == 0) || (fsize == 0)) continue;
+			last = std::min(last, fsize);
+			ranges.push_back({ fsize - last, last });
+		}
+		else {
+			if (!sLast.empty() && (last < first)) return RangeParseResult::Ignore;
+			if (first >= fsize) continue;
+			last = sLast.empty() ? fsize - 1 : std::min(last, fsize - 1);
+			ranges.push_back({ first, last - first + 1 });
+		}
+		if (ranges.size() > MaxRanges) {
+			return RangeParseResult::Ignore;
+		}
+	}
+	return ranges.empty() ? RangeParseResult::Unsatisfiable : RangeParseResult::Ok;
+}
+
+// If-Range with etag needs strong match, with date - file must not have been modified after it
+static bool ifRangeMatches(const std::string& ifRange, std::string_view etag, time_t mtime) {
+	if (ifRange.empty()) {
+		return true;
+	}
+	auto sv = trim(ifRange);
+	if (sv.starts_with('"') || sv.starts_with("W/")) {
+		return sv == etag;
+	}
+	time_t since = 0;
+	return HttpServer::parseHttpDate(std::string(sv), since) && (mtime <= since);
+}
+
+std::string HttpServer::RequestHeaders::find(std::string_view name) const {
+	if (params && params->hasHeaders()) {
+		return std::string(params->header(name));
+	}
+	return request.headers.find(std::string(name));
+}
+
+Reply HttpServer::getEntireFile(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
+	return getEntireFile(route, RequestHeaders{ request });
+}
+
+Reply HttpServer::getEntireFile(const std::string& route, const RequestHeaders& headers) const {
 	std::string absRoute = root + route;
+	// ranges are served from file, cache keeps only whole representations
+	bool ranged = !headers.find("Range").empty();
+	// "/a/../b" and "/b" share entry, normalized without syscalls so hits stay cheap
+	std::string cacheKey = assetCache ? std::filesystem::path(absRoute).lexically_normal().string() : std::string();
+	if (assetCache && !ranged) {
+		if (auto asset = assetCache->find(cacheKey); asset) {
+			return cachedReply(*asset, headers);
+		}
+	}
+	// taking it before touching file, so changes made meanwhile are not missed
+	uint64_t cacheGeneration = assetCache ? assetCache->generation() : 0;
 	auto pathRoute = std::filesystem::weakly_canonical(absRoute);
 
 	// checking route to be subpath of root to prevent "/../..." access
@@ -155,32 +499,258 @@ util::web::http::HttpResponse HttpServer::getEntireFile(const std::string& route
 		!std::filesystem::exists(absRoute) || 
 		!util::fs::isSubpath(std::filesystem::canonical(absRoute), root) || 
 		!FileExt2ContentTypeMap.contains(std::filesystem::path(absRoute).extension())) {
-		return defaultReponse(404, request);
+		return Reply::prebuilt(404);
+	}
+
+	// body is not read here - socket worker sends it directly from file
+	int fd = open(absRoute.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return Reply::prebuilt(404);
+	}
+	struct stat st;
+	if ((fstat(fd, &st) < 0) || !S_ISREG(st.st_mode)) {
+		close(fd);
+		return Reply::prebuilt(404);
+	}
+	size_t fsize = st.st_size;
+	const auto& fileType = FileExt2ContentTypeMap.find(pathRoute.extension())->second;
+
+	if (assetCache && !ranged && (fsize <= AssetCache::MaxAssetSize)) {
+		auto asset = loadAsset(pathRoute.string(), fd, st, fileType);
+		close(fd);
+		if (!asset) {
+			return Reply::prebuilt(404);
+		}
+		assetCache->insert(cacheKey, asset, cacheGeneration);
+		return cachedReply(*asset, headers);
+	}
+
+	std::string etag = makeEtag(fileEtagBase(st), AssetCache::Encoding::Identity);
+	std::string lastModified = formatHttpDate(st.st_mtime);
+	if (notModified(headers, etag, st.st_mtime)) {
+		close(fd);
+		ReplyHead head(304);
+		addValidators(head, etag, lastModified, fileType.cacheControl);
+		return Reply(std::move(head));
+	}
+	if (ranged) {
+		if (auto reply = rangeReply(headers, fd, fsize, fileType, etag, lastModified, st.st_mtime); reply) {
+			close(fd);
+			return std::move(*reply);
+		}
+	}
+
+	ReplyHead head(200);
+	head.add(Header::ContentType, fileType.contentType).add(Header::ContentLength, fsize).add(Header::AcceptRanges, "bytes");
+	addValidators(head, etag, lastModified, fileType.cacheControl);
+	return Reply(std::move(head), FileBody(fd, 0, fsize));
+}
+
+// returns nullopt if whole file should be sent instead, fd is never taken - file bodies get their own copies of it
+std::optional<Reply> HttpServer::rangeReply(const RequestHeaders& headers, int fd, size_t fsize, const FileTypeInfo& fileType, std::string_view etag, std::string_view lastModified, time_t mtime) const {
+	if (!ifRangeMatches(headers.find("If-Range"), etag, mtime)) {
+		return std::nullopt;
+	}
+	std::vector<std::pair<size_t, size_t>> ranges;
+	switch (parseRanges(headers.find("Range"), fsize, ranges)) {
+	case RangeParseResult::Ignore:
+		return std::nullopt;
+	case RangeParseResult::Unsatisfiable: {
+		ReplyHead head(416);
+		head.add(Header::ContentRange, std::format("bytes */{}", fsize)).add(Header::ContentLength, (size_t)0);
+		return Reply(std::move(head));
+	}
+	case RangeParseResult::Ok:
+		break;
+	}
+
+	std::vector<FileBody> parts;
+	for (const auto& [offset, length] : ranges) {
+		int partFd = dup(fd);
+		if (partFd < 0) {
+			Log.error("Error on dup for range request: {}", strerror(errno));
+			return std::nullopt;
+		}
+		parts.emplace_back(partFd, offset, length);
 	}
 
-	std::ifstream ifs(absRoute);
-	ifs.seekg(0, ifs.end);
-	size_t fsize = ifs.tellg();
-	if (fsize > MaxFileSize) {
-		return defaultReponse(413, request);
+	if (parts.size() == 1) {
+		auto [offset, length] = ranges.front();
+		ReplyHead head(206);
+		head.add(Header::ContentType, fileType.contentType)
+			.add(Header::ContentLength, length)
+			.add(Header::ContentRange, std::format("bytes {}-{}/{}", offset, offset + length - 1, fsize));
+		addValidators(head, etag, lastModified, fileType.cacheControl);
+		return Reply(std::move(head), std::move(parts.front()));
 	}
-	ifs.seekg(0, ifs.beg);
 
-	std::string responseBody;
-	responseBody.resize(fsize);
-	ifs.read(responseBody.data(), fsize);
+	thread_local std::mt19937_64 rng{ std::random_device{}() };
+	std::string boundary = std::format("{:016x}{:016x}", rng(), rng());
+	ChainBody body;
+	for (size_t i = 0; i < parts.size(); ++i) {
+		auto [offset, length] = ranges[i];
+		body.append(std::format("\r\n--{}\r\nContent-Type: {}\r\nContent-Range: bytes {}-{}/{}\r\n\r\n", boundary, fileType.contentType, offset, offset + length - 1, fsize));
+		body.append(std::move(parts[i]));
+	}
+	body.append(std::format("\r\n--{}--\r\n", boundary));
+
+	ReplyHead head(206);
+	head.add(Header::ContentType, "multipart/byteranges; boundary=" + boundary).add(Header::ContentLength, body.size());
+	addValidators(head, etag, lastModified, fileType.cacheControl);
+	return Reply(std::move(head), std::move(body));
+}
+
+// strong validator from inode, size and modification time - no need to hash content
+std::string HttpServer::fileEtagBase(const struct stat& st) {
+	return std::format("{:x}-{:x}-{:x}", (uint64_t)st.st_ino, (uint64_t)st.st_size, (uint64_t)st.st_mtim.tv_sec * 1000000000ull + st.st_mtim.tv_nsec);
+}
+
+// every encoding is a different representation, so it gets its own strong etag
+std::string HttpServer::makeEtag(const std::string& base, AssetCache::Encoding enc) {
+	std::string etag = "\"" + base;
+	if (enc != AssetCache::Encoding::Identity) {
+		etag += '-';
+		etag += AssetCache::encodingName(enc);
+	}
+	etag += '"';
+	return etag;
+}
+
+std::string HttpServer::formatHttpDate(time_t t) {
+	char buf[DateHeader::DateSize];
+	DateHeader::format(t, buf);
+	return std::string(buf, sizeof(buf));
+}
+
+// IMF-fixdate only, names are compared with the same tables it is formatted with, so locale doesn't matter
+bool HttpServer::parseHttpDate(const std::string& s, time_t& t) {
+	struct tm tm {};
+	char day[4] = {};
+	char month[4] = {};
+	int consumed = 0;
+	if ((sscanf(s.c_str(), "%3[A-Za-z], %2d %3[A-Za-z] %4d %2d:%2d:%2d GMT%n", day, &tm.tm_mday, month, &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 7) || (consumed == 0)) {
+		return false;
+	}
+	auto iMonth = std::find(std::begin(DateHeader::MonthNames), std::end(DateHeader::MonthNames), std::string_view(month));
+	if ((iMonth == std::end(DateHeader::MonthNames)) || (std::find(std::begin(DateHeader::DayNames), std::end(DateHeader::DayNames), std::string_view(day)) == std::end(DateHeader::DayNames))) {
+		return false;
+	}
+	tm.tm_mon = (int)(iMonth - std::begin(DateHeader::MonthNames));
+	tm.tm_year -= 1900;
+	t = timegm(&tm);
+	return t != (time_t)-1;
+}
 
-	HttpResponse response(200, request.headers, std::move(responseBody));
-	response.headers.add("Content-Type", FileExt2ContentTypeMap.find(pathRoute.extension())->second);
-	return response;
+// If-None-Match takes precedence, If-Modified-Since is checked only without it
+bool HttpServer::notModified(const RequestHeaders& headers, std::string_view etag, time_t mtime) {
+	if (std::string ifNoneMatch = headers.find("If-None-Match"); !ifNoneMatch.empty()) {
+		std::string_view header(ifNoneMatch);
+		while (!header.empty()) {
+			size_t end = header.find(',');
+			auto token = trim(header.substr(0, end));
+			header = (end == std::string_view::npos) ? std::string_view() : header.substr(end + 1);
+			if (token == "*") return true;
+			// weak comparison
+			if (token.starts_with("W/")) token.remove_prefix(2);
+			if (token == etag) return true;
+		}
+		return false;
+	}
+	if (std::string ifModifiedSince = headers.find("If-Modified-Since"); !ifModifiedSince.empty()) {
+		time_t since = 0;
+		return parseHttpDate(ifModifiedSince, since) && (mtime <= since);
+	}
+	return false;
 }
 
-util::web::http::HttpResponse HttpServer::defaultReponse(size_t statusCode, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn) const {
-	Log.info(std::format("Sending default response {}", statusCode));
-	HttpHeaders headers;
-	util::web::http::HttpResponse response{
-		statusCode,
-		HttpHeaders()
-	};
-	return response;
-}
\ No newline at end of file
+void HttpServer::addValidators(ReplyHead& head, std::string_view etag, std::string_view lastModified, std::string_view cacheControl) {
+	head.add(Header::ETag, etag).add(Header::LastModified, lastModified);
+	if (!cacheControl.empty()) {
+		head.add(Header::CacheControl, cacheControl);
+	}
+}
+
+// reads file and its precompressed siblings into fully encoded responses
+std::shared_ptr<const AssetCache::Asset> HttpServer::loadAsset(const std::string& path, int fd, const struct stat& st, const FileTypeInfo& fileType) const {
+	std::string bodies[(size_t)AssetCache::Encoding::Count];
+	bool hasVariants = false;
+	if (!readFile(fd, st.st_size, bodies[(size_t)AssetCache::Encoding::Identity])) {
+		return nullptr;
+	}
+	for (auto enc : { AssetCache::Encoding::Gzip, AssetCache::Encoding::Brotli }) {
+		std::string variantPath = path + std::string(AssetCache::encodingExt(enc));
+		// sibling may be a symlink out of root as well
+		std::error_code ec;
+		auto canonicalVariant = std::filesystem::canonical(variantPath, ec);
+		if (ec || !util::fs::isSubpath(canonicalVariant, root)) {
+			continue;
+		}
+		int variantFd = open(variantPath.c_str(), O_RDONLY | O_CLOEXEC);
+		if (variantFd < 0) {
+			continue;
+		}
+		struct stat variantSt;
+		// sibling older than source is left from previous version of it, and would be served under new etag
+		if ((fstat(variantFd, &variantSt) == 0) && S_ISREG(variantSt.st_mode) && ((size_t)variantSt.st_size <= AssetCache::MaxAssetSize) && (variantSt.st_mtime >= st.st_mtime)) {
+			if (readFile(variantFd, variantSt.st_size, bodies[(size_t)enc])) {
+				hasVariants = true;
+			}
+			else {
+				bodies[(size_t)enc].clear();
+			}
+		}
+		close(variantFd);
+	}
+
+	auto asset = std::make_shared<AssetCache::Asset>();
+	asset->path = path;
+	asset->etag = fileEtagBase(st);
+	asset->lastModified = formatHttpDate(st.st_mtime);
+	asset->mtime = st.st_mtime;
+	for (size_t i = 0; i < (size_t)AssetCache::Encoding::Count; ++i) {
+		auto enc = (AssetCache::Encoding)i;
+		if ((enc != AssetCache::Encoding::Identity) && bodies[i].empty()) {
+			continue;
+		}
+		std::string etag = makeEtag(asset->etag, enc);
+
+		ReplyHead head(200);
+		head.add(Header::ContentType, fileType.contentType).add(Header::ContentLength, bodies[i].size());
+		if (enc != AssetCache::Encoding::Identity) {
+			head.add(Header::ContentEncoding, AssetCache::encodingName(enc));
+		}
+		else {
+			head.add(Header::AcceptRanges, "bytes");
+		}
+		ReplyHead notModifiedHead(304);
+		for (auto* h : { &head, &notModifiedHead }) {
+			addValidators(*h, etag, asset->lastModified, fileType.cacheControl);
+			if (hasVariants) {
+				h->add(Header::Vary, "Accept-Encoding");
+			}
+		}
+		// status line is shared one, so connection may still add headers before the cached ones
+		auto encoded = std::make_shared<std::string>(head.finishLines());
+		encoded->append(bodies[i]);
+		asset->encoded[i] = std::move(encoded);
+		asset->notModified[i] = std::make_shared<const std::string>(notModifiedHead.finishLines());
+	}
+	return asset;
+}
+
+Reply HttpServer::cachedReply(const AssetCache::Asset& asset, const RequestHeaders& headers) const {
+	auto enc = AssetCache::Encoding::Identity;
+	if (asset.encoded[(size_t)AssetCache::Encoding::Gzip] || asset.encoded[(size_t)AssetCache::Encoding::Brotli]) {
+		std::string acceptEncoding = headers.find("Accept-Encoding");
+		for (auto variant : { AssetCache::Encoding::Brotli, AssetCache::Encoding::Gzip }) {
+			if (asset.encoded[(size_t)variant] && acceptsEncoding(acceptEncoding, AssetCache::encodingName(variant))) {
+				enc = variant;
+				break;
+			}
+		}
+	}
+	if (notModified(headers, makeEtag(asset.etag, enc), asset.mtime)) {
+		return Reply::shared(304, asset.notModified[(size_t)enc]);
+	}
+	return Reply::shared(200, asset.encoded[(size_t)enc]);
+}
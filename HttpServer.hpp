@@ -3,34 +3,135 @@
 #include <unordered_map>
 #include <functional>
 #include <memory>
+#include <optional>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <sys/stat.h>
 #include "EventBroker.hpp"
 #include "Http.hpp"
+#include "Reply.hpp"
+#include "AssetCache.hpp"
+#include "Router.hpp"
+#include "BodySink.hpp"
+#include "HandlerPool.hpp"
+#include "SseChannel.hpp"
+#include "WebSocket.hpp"
+
+// per-route settings, outside of HttpServer so it can be used as default argument there
+struct RouteOptions {
+	static constexpr size_t DefaultMaxBodySize = 1024 * 1024;
+	// bigger requests are rejected with 413
+	size_t maxBodySize = DefaultMaxBodySize;
+	// async routes only - handlers running at once, further requests are rejected with 503, 0 - unlimited
+	size_t maxConcurrency = 0;
+};
 
 class HttpServer {
 public:
 	using CallbackMsgFn = EventBroker::OnEventCb;
-	using RouteHandlerT = std::function<util::web::http::HttpResponse(const util::web::http::HttpRequest&, CallbackMsgFn)>;
-	void registerRoute(const std::string& url, util::web::http::Method method, RouteHandlerT handler);
+	// handlers may return plain HttpResponse, it is implicitly converted to Reply
+	using RouteHandlerT = std::function<Reply(const util::web::http::HttpRequest&, CallbackMsgFn)>;
+	// for routes with ":param" or "*name" captures, headers are views in RouteParams::header(), request gets only method and url
+	// (async handlers get headers copied into request as well, see RequestHeaders)
+	using ParamRouteHandlerT = std::function<Reply(const util::web::http::HttpRequest&, const RouteParams&, CallbackMsgFn)>;
+	// for routes getting body by pieces while it is received, returned sink gets the body
+	using StreamRouteHandlerT = std::function<std::unique_ptr<BodySink>(const util::web::http::HttpRequest&, const RouteParams&)>;
+	// for websocket routes, returned handler serves upgraded connection, nullptr - upgrade is refused
+	using WebSocketRouteHandlerT = std::function<std::unique_ptr<WebSocketHandler>(const util::web::http::HttpRequest&, const RouteParams&)>;
+	// only one of handlers is set
+	struct Route {
+		ParamRouteHandlerT handler;
+		StreamRouteHandlerT streamHandler;
+		// runs on handler pool
+		ParamRouteHandlerT asyncHandler;
+		WebSocketRouteHandlerT wsHandler;
+		RouteOptions options;
+		// index in routeNames(), assigned on registration
+		size_t id = 0;
+		// async handlers being run, shared with their tasks, so it outlives unregistered route
+		std::shared_ptr<std::atomic<size_t>> inFlight = std::make_shared<std::atomic<size_t>>(0);
+	};
+	// headers of request being handled - views from params when socket worker has set them, otherwise ones copied into request
+	struct RequestHeaders {
+		const util::web::http::HttpRequest& request;
+		const RouteParams* params = nullptr;
+		std::string find(std::string_view name) const;
+	};
+	// called on handler pool's thread
+	using AsyncDoneFn = std::function<void(std::shared_ptr<Reply>)>;
+	using RouterT = RadixRouter<Route>;
+	struct FileTypeInfo {
+		std::string contentType;
+		// empty - no Cache-Control header
+		std::string cacheControl;
+	};
+	// url may contain ":name" segments and trailing "*" (or "*name"), see RadixRouter
+	void registerRoute(const std::string& url, util::web::http::Method method, RouteHandlerT handler, RouteOptions options = {});
+	void registerRoute(const std::string& url, util::web::http::Method method, ParamRouteHandlerT handler, RouteOptions options = {});
+	void registerRoute(const std::string& url, util::web::http::Method method, StreamRouteHandlerT handler, RouteOptions options = {});
+	// handler is run on handler pool instead of socket worker, so it may block
+	void registerAsyncRoute(const std::string& url, util::web::http::Method method, ParamRouteHandlerT handler, RouteOptions options = {});
+	// GET route streaming channel's events as text/event-stream, with heartbeat comments sent to all sse connections
+	void registerSseRoute(const std::string& url, std::shared_ptr<SseChannel> channel);
+	// GET route upgrading connection to websocket, options.maxBodySize limits size of message
+	void registerWebSocketRoute(const std::string& url, WebSocketRouteHandlerT handler, RouteOptions options = {});
+	// GET route answering with metrics of server in Prometheus text format
+	void enableMetrics(const std::string& url = "/metrics");
+	// must be called before serving, by default pool has as many threads as cpu cores
+	void setHandlerThreads(size_t threadsCount);
+	// runs async route handler for request (with body in it), false if route's concurrency limit is reached
+	// handler and captures are copied into task, so route may be unregistered while it runs
+	bool callAsync(const Route& route, std::shared_ptr<const util::web::http::HttpRequest> request, const RouteParams& params, CallbackMsgFn cbMsgFn, AsyncDoneFn done) const;
+	// route for request, looked up as soon as headers are received, nullptr if there is none
+	const Route* findRoute(const util::web::http::HttpRequest& request, RouteParams& params) const;
 	void unregisterRoute(const std::string& url, util::web::http::Method method);
-	util::web::http::HttpResponse defaultReponse(size_t statusCode, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
+	// body is a view into connection's input buffer, handlers get it as RouteParams::body()
+	Reply callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	// calls route found by findRoute() already, params must have body set
+	Reply callRoute(const Route& route, const util::web::http::HttpRequest& request, const RouteParams& params, CallbackMsgFn cbMsgFn = nullptr) const;
 	inline auto& routes() { return _routes; }
+	// "METHOD pattern" by route id, id 0 stands for requests without route
+	// copy, so metrics scraper may take it while routes are registered
+	std::vector<std::string> routeNames() const;
 	static HttpServer& get();
 	void setRoot(const std::string& root);
 	void setRoot(std::string&& root);
-	util::web::http::HttpResponse GET(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse HEAD(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse POST(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse PUT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse DELETE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse CONNECT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse OPTIONS(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse TRACE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse PATCH(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
-	util::web::http::HttpResponse getEntireFile(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
+	// must be called before serving, only known extensions are affected
+	void setCacheControl(const std::string& ext, const std::string& cacheControl);
+	// caches small static files in memory, set memoryBudget to 0 to disable
+	void enableAssetCache(size_t memoryBudget);
+	Reply GET(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply HEAD(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply POST(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply PUT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply DELETE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply CONNECT(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply OPTIONS(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply TRACE(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply PATCH(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
+	Reply getEntireFile(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
+	Reply getEntireFile(const std::string& route, const RequestHeaders& headers) const;
+	static bool parseHttpDate(const std::string& s, time_t& t);
+	static std::string_view methodName(util::web::http::Method method);
 private:
-	util::web::http::HttpResponse _callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr) const;
+	Reply _callRoute(const std::string& route, const util::web::http::HttpRequest& request, CallbackMsgFn cbMsgFn = nullptr, std::string_view body = {}) const;
 	HttpServer();
-	std::unordered_map<util::web::http::Method, std::unordered_map<std::string, RouteHandlerT>> _routes;
+	void insertRoute(const std::string& url, util::web::http::Method method, Route&& route);
+	std::shared_ptr<const AssetCache::Asset> loadAsset(const std::string& path, int fd, const struct stat& st, const FileTypeInfo& fileType) const;
+	std::optional<Reply> rangeReply(const RequestHeaders& headers, int fd, size_t fsize, const FileTypeInfo& fileType, std::string_view etag, std::string_view lastModified, time_t mtime) const;
+	static std::string fileEtagBase(const struct stat& st);
+	static std::string makeEtag(const std::string& base, AssetCache::Encoding enc);
+	static std::string formatHttpDate(time_t t);
+	static bool notModified(const RequestHeaders& headers, std::string_view etag, time_t mtime);
+	static void addValidators(ReplyHead& head, std::string_view etag, std::string_view lastModified, std::string_view cacheControl);
+	Reply cachedReply(const AssetCache::Asset& asset, const RequestHeaders& headers) const;
+	std::unordered_map<util::web::http::Method, RouterT> _routes;
+	std::vector<std::string> _routeNames{ "other" };
+	mutable std::mutex routeNamesMtx;
 	std::string root;
+	std::unique_ptr<AssetCache> assetCache;
+	std::unique_ptr<HandlerPool> handlerPool;
+	// shared timer publishing sse heartbeats, started with the first sse route
+	std::jthread sseHeartbeat;
 };
\ No newline at end of file
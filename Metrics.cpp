@@ -0,0 +1,166 @@
+#include "Metrics.hpp"
+#include <format>
+#include <iterator>
+#include <algorithm>
+#include <bit>
+
+// nominal "le" bounds in microseconds
+static constexpr uint64_t LatencyBounds[] = {
+	100, 250, 500,
+	1000, 2500, 5000,
+	10000, 25000, 50000,
+	100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000
+};
+
+// bounds are exported as upper edges of buckets containing nominal ones (e.g. 0.000103 instead of 0.0001)
+// so no bucket straddles a bound and every count is exact
+static const std::vector<std::pair<uint64_t, std::string>>& exportedBounds() {
+	static const auto bounds = []() {
+		std::vector<std::pair<uint64_t, std::string>> res;
+		for (auto micros : LatencyBounds) {
+			uint64_t edge = LatencyHistogram::maxOf(LatencyHistogram::bucketOf(micros));
+			std::string seconds = std::to_string(edge / 1000000);
+			if (uint64_t fraction = edge % 1000000; fraction > 0) {
+				// six digits with leading zeros, trailing ones are dropped
+				std::string digits = std::to_string(fraction + 1000000).substr(1);
+				digits.erase(digits.find_last_not_of('0') + 1);
+				seconds += '.';
+				seconds += digits;
+			}
+			res.emplace_back(edge, std::move(seconds));
+		}
+		return res;
+	}();
+	return bounds;
+}
+
+void LatencyHistogram::record(uint64_t micros) {
+	buckets[bucketOf(micros)].add();
+	total.add(micros);
+}
+
+// values below SubBuckets have a bucket each, then every power of two is split into SubBuckets equal parts
+size_t LatencyHistogram::bucketOf(uint64_t micros) {
+	micros = std::min<uint64_t>(micros, ((uint64_t)1 << MaxBits) - 1);
+	if (micros < SubBuckets) {
+		return (size_t)micros;
+	}
+	unsigned shift = (unsigned)std::bit_width(micros) - 1 - SubBucketBits;
+	return (shift + 1) * SubBuckets + (size_t)((micros >> shift) - SubBuckets);
+}
+
+uint64_t LatencyHistogram::maxOf(size_t bucket) {
+	if (bucket < SubBuckets) {
+		return bucket;
+	}
+	unsigned shift = (unsigned)(bucket / SubBuckets - 1);
+	uint64_t lower = (uint64_t)(SubBuckets + bucket % SubBuckets) << shift;
+	return lower + ((uint64_t)1 << shift) - 1;
+}
+
+void LatencySnapshot::add(const LatencyHistogram& histogram) {
+	for (size_t i = 0; i < counts.size(); ++i) {
+		uint64_t n = histogram.count(i);
+		counts[i] += n;
+		total += n;
+	}
+	sum += histogram.sum();
+}
+
+uint64_t LatencySnapshot::countUpTo(uint64_t micros) const {
+	uint64_t res = 0;
+	for (size_t i = 0; (i < counts.size()) && (LatencyHistogram::maxOf(i) <= micros); ++i) {
+		res += counts[i];
+	}
+	return res;
+}
+
+WorkerMetrics::~WorkerMetrics() {
+	for (auto& histogram : routeLatency) {
+		delete histogram.load();
+	}
+}
+
+void WorkerMetrics::recordLatency(size_t route, uint64_t micros) {
+	if (route >= MaxRoutes) {
+		route = 0;
+	}
+	auto histogram = routeLatency[route].load(std::memory_order_relaxed);
+	if (!histogram) {
+		histogram = new LatencyHistogram();
+		routeLatency[route].store(histogram, std::memory_order_release);
+	}
+	histogram->record(micros);
+}
+
+void MetricsWriter::family(std::string_view name, std::string_view type, std::string_view help) {
+	std::format_to(std::back_inserter(out), "# HELP {} {}\n# TYPE {} {}\n", name, help, name, type);
+}
+
+void MetricsWriter::sample(std::string_view name, std::string_view labels, uint64_t value) {
+	if (labels.empty()) {
+		std::format_to(std::back_inserter(out), "{} {}\n", name, value);
+	}
+	else {
+		std::format_to(std::back_inserter(out), "{}{{{}}} {}\n", name, labels, value);
+	}
+}
+
+void MetricsWriter::sample(std::string_view name, std::string_view labels, double value) {
+	if (labels.empty()) {
+		std::format_to(std::back_inserter(out), "{} {}\n", name, value);
+	}
+	else {
+		std::format_to(std::back_inserter(out), "{}{{{}}} {}\n", name, labels, value);
+	}
+}
+
+void MetricsWriter::histogram(std::string_view name, std::string_view labels, const LatencySnapshot& snapshot) {
+	std::string_view sep = labels.empty() ? "" : ",";
+	for (const auto& [micros, seconds] : exportedBounds()) {
+		std::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"{}\"}} {}\n", name, labels, sep, seconds, snapshot.countUpTo(micros));
+	}
+	std::format_to(std::back_inserter(out), "{}_bucket{{{}{}le=\"+Inf\"}} {}\n", name, labels, sep, snapshot.total);
+	sample(std::string(name) + "_sum", labels, snapshot.sum / 1e6);
+	sample(std::string(name) + "_count", labels, snapshot.total);
+}
+
+std::string MetricsWriter::label(std::string_view name, std::string_view value) {
+	std::string res(name);
+	res += "=\"";
+	for (char c : value) {
+		switch (c) {
+		case '\\': res += "\\\\"; break;
+		case '"': res += "\\\""; break;
+		case '\n': res += "\\n"; break;
+		default: res += c;
+		}
+	}
+	res += '"';
+	return res;
+}
+
+Metrics& Metrics::get() {
+	static Metrics metrics;
+	return metrics;
+}
+
+void Metrics::attach(const void* owner, CollectFn collect) {
+	std::lock_guard<std::mutex> lck(mtx);
+	sources.emplace_back(owner, std::move(collect));
+}
+
+void Metrics::detach(const void* owner) {
+	std::lock_guard<std::mutex> lck(mtx);
+	std::erase_if(sources, [owner](const auto& source) { return source.first == owner; });
+}
+
+std::string Metrics::render() {
+	MetricsWriter writer;
+	std::lock_guard<std::mutex> lck(mtx);
+	for (const auto& [owner, collect] : sources) {
+		collect(writer);
+	}
+	return std::move(writer.text());
+}
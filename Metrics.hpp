@@ -0,0 +1,118 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <array>
+#include <functional>
+#include <mutex>
+#include <atomic>
+#include <cstdint>
+#include <cstddef>
+
+// counter written by one thread only, so increment is plain load and store without locked instruction
+// readers from other threads see some recent value
+class LocalCounter {
+public:
+	inline void add(uint64_t n = 1) { value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed); }
+	inline uint64_t get() const { return value.load(std::memory_order_relaxed); }
+private:
+	std::atomic<uint64_t> value = 0;
+};
+
+// log-linear histogram of microseconds like HdrHistogram: every power of two is split into SubBuckets buckets,
+// so bucket's width is under 1/SubBuckets of its values, written by one thread
+class LatencyHistogram {
+public:
+	static constexpr unsigned SubBucketBits = 3;
+	static constexpr size_t SubBuckets = 1 << SubBucketBits;
+	// values up to 2^MaxBits microseconds (~71 minutes), bigger ones go to the last bucket
+	static constexpr unsigned MaxBits = 32;
+	static constexpr size_t BucketsCount = (MaxBits - SubBucketBits + 1) * SubBuckets;
+	void record(uint64_t micros);
+	inline uint64_t count(size_t bucket) const { return buckets[bucket].get(); }
+	inline uint64_t sum() const { return total.get(); }
+	static size_t bucketOf(uint64_t micros);
+	// the biggest value falling into bucket
+	static uint64_t maxOf(size_t bucket);
+private:
+	std::array<LocalCounter, BucketsCount> buckets;
+	LocalCounter total;
+};
+
+// histograms of several workers added together on scrape
+struct LatencySnapshot {
+	std::array<uint64_t, LatencyHistogram::BucketsCount> counts{};
+	uint64_t sum = 0;
+	uint64_t total = 0;
+	void add(const LatencyHistogram& histogram);
+	// values not bigger than micros, exact when micros is the biggest value of a bucket (see LatencyHistogram::maxOf)
+	uint64_t countUpTo(uint64_t micros) const;
+};
+
+// everything socket worker counts, written only by worker's thread and read by scraper
+// allocated separately for every worker and aligned, so counters of different workers never share cache line
+struct alignas(64) WorkerMetrics {
+	// routes with bigger ids share histogram with requests without route
+	static constexpr size_t MaxRoutes = 128;
+	WorkerMetrics() = default;
+	WorkerMetrics(const WorkerMetrics&) = delete;
+	WorkerMetrics& operator=(const WorkerMetrics&) = delete;
+	~WorkerMetrics();
+	// route 0 - no route
+	void recordLatency(size_t route, uint64_t micros);
+	// nullptr - there have been no requests to route
+	inline const LatencyHistogram* latency(size_t route) const { return routeLatency[route].load(std::memory_order_acquire); }
+
+	LocalCounter connectionsOpened;
+	LocalCounter connectionsClosed;
+	LocalCounter bytesRead;
+	LocalCounter bytesWritten;
+	// reads finding socket empty
+	LocalCounter readEagain;
+	// writes stopped by full socket buffer, the rest waits for EPOLLOUT
+	LocalCounter writeBlocked;
+	LocalCounter parseErrors;
+	LocalCounter timeouts;
+	// answered with 503 because worker's event queue is too long
+	LocalCounter overloaded;
+	// by status class, 0 - status out of 100-599
+	std::array<LocalCounter, 6> responses;
+private:
+	// histograms are created by worker on first request to route
+	std::array<std::atomic<LatencyHistogram*>, MaxRoutes> routeLatency{};
+};
+
+// builds Prometheus text exposition
+class MetricsWriter {
+public:
+	// starts family, its samples must follow it
+	void family(std::string_view name, std::string_view type, std::string_view help);
+	// labels are "name=\"value\",..." without braces, empty - no labels
+	void sample(std::string_view name, std::string_view labels, uint64_t value);
+	void sample(std::string_view name, std::string_view labels, double value);
+	// cumulative buckets in seconds, sum and count of one histogram of family
+	void histogram(std::string_view name, std::string_view labels, const LatencySnapshot& snapshot);
+	// name="value" with value escaped
+	static std::string label(std::string_view name, std::string_view value);
+	inline std::string& text() { return out; }
+private:
+	std::string out;
+};
+
+// collects metrics of server parts for metrics route, parts attach themselves while they live
+class Metrics {
+public:
+	using CollectFn = std::function<void(MetricsWriter&)>;
+	static Metrics& get();
+	Metrics(const Metrics&) = delete;
+	Metrics& operator=(const Metrics&) = delete;
+	// collect is called on scrape from scraping thread
+	void attach(const void* owner, CollectFn collect);
+	// waits for scrape in process, so owner may be destroyed after it
+	void detach(const void* owner);
+	std::string render();
+private:
+	Metrics() = default;
+	std::mutex mtx;
+	std::vector<std::pair<const void*, CollectFn>> sources;
+};
@@ -1,11 +1,7 @@
 #pragma once
-#include "Logger.hpp"
-#include <iostream>
-#include <format>
+#include "AsyncLogger.hpp"
 
-using Logger = util::TsSingletonLogger<util::StreamLogger>;
-using LogLevel = util::Logger::LogLevel;
+// path - log file, empty - stdout
+void initLogger(LogLevel lvl, const std::string& path = {});
 
-void initLogger(LogLevel lvl);
-
-#define Log (Logger::get())
\ No newline at end of file
+#define Log (AsyncLogger::get())
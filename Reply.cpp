@@ -0,0 +1,464 @@
+#include "Reply.hpp"
+#include <unistd.h>
+#include <charconv>
+#include <atomic>
+#include <string.h>
+
+FileBody::FileBody(int fd, size_t offset, size_t size)
+	: _fd{ fd }, _offset{ offset }, _remaining{ size }
+{
+	;
+}
+
+FileBody::FileBody(FileBody&& other) noexcept
+	: _fd{ other._fd }, _offset{ other._offset }, _remaining{ other._remaining }
+{
+	other._fd = -1;
+	other._remaining = 0;
+}
+
+FileBody& FileBody::operator=(FileBody&& other) noexcept {
+	if (this != &other) {
+		if (_fd >= 0) close(_fd);
+		_fd = other._fd;
+		_offset = other._offset;
+		_remaining = other._remaining;
+		other._fd = -1;
+		other._remaining = 0;
+	}
+	return *this;
+}
+
+FileBody::~FileBody() {
+	if (_fd >= 0) close(_fd);
+}
+
+void FileBody::advance(size_t n) {
+	n = std::min(n, _remaining);
+	_offset += n;
+	_remaining -= n;
+}
+
+SharedBody::SharedBody(std::shared_ptr<const std::string> data)
+	: _data{ std::move(data) }
+{
+	;
+}
+
+void SharedBody::advance(size_t n) {
+	_offset += std::min(n, remaining());
+}
+
+void ChainBody::append(std::string&& data) {
+	if (!data.empty()) {
+		segments.emplace_back(std::move(data));
+	}
+}
+
+void ChainBody::append(FileBody&& file) {
+	if (!file.finished()) {
+		segments.emplace_back(std::move(file));
+	}
+}
+
+size_t ChainBody::size() const {
+	size_t size = 0;
+	for (const auto& segment : segments) {
+		size += std::visit([](const auto& s) { 
+			if constexpr (std::is_same_v<std::decay_t<decltype(s)>, std::string>) {
+				return s.size();
+			}
+			else {
+				return s.remaining();
+			}
+			}, segment);
+	}
+	return size;
+}
+
+StreamBody::StreamBody(std::shared_ptr<State> _state)
+	: state{ std::move(_state) }
+{
+	;
+}
+
+StreamBody& StreamBody::operator=(StreamBody&& other) noexcept {
+	if (this != &other) {
+		cancel();
+		state = std::move(other.state);
+		_finished = other._finished;
+	}
+	return *this;
+}
+
+StreamBody::~StreamBody() {
+	cancel();
+}
+
+std::string StreamBody::take(std::function<void()> onData) {
+	std::string data;
+	if (!state) {
+		_finished = true;
+		return data;
+	}
+	std::lock_guard<std::mutex> lck(state->mtx);
+	if (!state->pending.empty()) {
+		data.swap(state->pending);
+	}
+	else if (state->closed) {
+		_finished = true;
+	}
+	else {
+		state->onData = std::move(onData);
+	}
+	return data;
+}
+
+void StreamBody::cancel() {
+	if (!state) return;
+	std::function<void()> onData;
+	{
+		std::lock_guard<std::mutex> lck(state->mtx);
+		state->cancelled = true;
+		state->pending.clear();
+		// releasing whatever callback holds (socket, etc.)
+		onData.swap(state->onData);
+	}
+	state.reset();
+}
+
+std::pair<Reply, ChunkedWriter> ChunkedWriter::reply(size_t status, std::string_view contentType) {
+	auto state = std::make_shared<StreamBody::State>();
+	ReplyHead head(status);
+	head.add(Header::ContentType, contentType).add(Header::TransferEncoding, "chunked");
+	return { Reply(std::move(head), StreamBody(state)), ChunkedWriter(state) };
+}
+
+ChunkedWriter::ChunkedWriter(std::shared_ptr<StreamBody::State> state)
+	: producer{ std::make_shared<Producer>(std::move(state)) }
+{
+	;
+}
+
+bool ChunkedWriter::write(std::string_view data) {
+	auto& state = producer->state;
+	std::function<void()> onData;
+	{
+		std::lock_guard<std::mutex> lck(state->mtx);
+		if (state->cancelled || state->closed) {
+			return false;
+		}
+		if (data.empty()) {
+			// empty chunk would terminate body
+			return true;
+		}
+		char buf[24];
+		auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), data.size(), 16);
+		state->pending.append(buf, end);
+		state->pending += "\r\n";
+		state->pending += data;
+		state->pending += "\r\n";
+		onData.swap(state->onData);
+	}
+	if (onData) {
+		onData();
+	}
+	return true;
+}
+
+void ChunkedWriter::finish() {
+	close(*producer->state);
+}
+
+// writes terminating chunk
+void ChunkedWriter::close(StreamBody::State& state) {
+	std::function<void()> onData;
+	{
+		std::lock_guard<std::mutex> lck(state.mtx);
+		if (state.cancelled || state.closed) {
+			return;
+		}
+		state.closed = true;
+		state.pending += "0\r\n\r\n";
+		onData.swap(state.onData);
+	}
+	if (onData) {
+		onData();
+	}
+}
+
+ChunkedWriter::Producer::~Producer() {
+	close(*state);
+}
+
+ReplyHead::ReplyHead(size_t status)
+	: _status{ status }
+{
+	head.reserve(256);
+}
+
+ReplyHead& ReplyHead::add(std::string_view name, std::string_view value) {
+	head += name;
+	head += ": ";
+	head += value;
+	head += "\r\n";
+	return *this;
+}
+
+ReplyHead& ReplyHead::add(std::string_view name, size_t value) {
+	head += name;
+	head += ": ";
+	appendNumber(value);
+	head += "\r\n";
+	return *this;
+}
+
+ReplyHead& ReplyHead::add(Header name, std::string_view value) {
+	head += headerPrefix(name);
+	head += value;
+	head += "\r\n";
+	return *this;
+}
+
+ReplyHead& ReplyHead::add(Header name, size_t value) {
+	head += headerPrefix(name);
+	appendNumber(value);
+	head += "\r\n";
+	return *this;
+}
+
+std::string_view ReplyHead::headerPrefix(Header name) {
+	static constexpr std::string_view Prefixes[] = {
+		"Accept-Ranges: ",
+		"Allow: ",
+		"Cache-Control: ",
+		"Connection: ",
+		"Content-Encoding: ",
+		"Content-Length: ",
+		"Content-Range: ",
+		"Content-Type: ",
+		"ETag: ",
+		"Last-Modified: ",
+		"Retry-After: ",
+		"Sec-WebSocket-Accept: ",
+		"Transfer-Encoding: ",
+		"Upgrade: ",
+		"Vary: ",
+	};
+	static_assert(std::size(Prefixes) == (size_t)Header::Count);
+	return Prefixes[(size_t)name];
+}
+
+void ReplyHead::appendNumber(size_t value) {
+	char buf[24];
+	auto [end, ec] = std::to_chars(buf, buf + sizeof(buf), value);
+	head.append(buf, end);
+}
+
+std::string ReplyHead::finish() {
+	std::string res;
+	res.reserve(head.size() + 64);
+	if (auto line = statusLine(_status); !line.empty()) {
+		res += line;
+	}
+	else {
+		res += "HTTP/1.1 ";
+		res += std::to_string(_status);
+		res += ' ';
+		res += statusText(_status);
+		res += "\r\n";
+	}
+	res += head;
+	res += "\r\n";
+	return res;
+}
+
+std::string ReplyHead::finishLines() {
+	head += "\r\n";
+	return std::move(head);
+}
+
+std::string_view ReplyHead::statusLine(size_t status) {
+	static constexpr size_t MinStatus = 100;
+	static constexpr size_t MaxStatus = 599;
+	static const std::vector<std::string> lines = []() {
+		std::vector<std::string> res;
+		res.reserve(MaxStatus - MinStatus + 1);
+		for (size_t code = MinStatus; code <= MaxStatus; ++code) {
+			std::string line = "HTTP/1.1 ";
+			line += std::to_string(code);
+			line += ' ';
+			line += statusText(code);
+			line += "\r\n";
+			res.push_back(std::move(line));
+		}
+		return res;
+		}();
+	if ((status < MinStatus) || (status > MaxStatus)) {
+		return {};
+	}
+	return lines[status - MinStatus];
+}
+
+std::string_view ReplyHead::statusText(size_t status) {
+	switch (status) {
+	case 100: return "Continue";
+	case 101: return "Switching Protocols";
+	case 200: return "OK";
+	case 201: return "Created";
+	case 202: return "Accepted";
+	case 204: return "No Content";
+	case 206: return "Partial Content";
+	case 301: return "Moved Permanently";
+	case 302: return "Found";
+	case 304: return "Not Modified";
+	case 400: return "Bad Request";
+	case 401: return "Unauthorized";
+	case 403: return "Forbidden";
+	case 404: return "Not Found";
+	case 405: return "Method Not Allowed";
+	case 408: return "Request Timeout";
+	case 411: return "Length Required";
+	case 412: return "Precondition Failed";
+	case 413: return "Content Too Large";
+	case 416: return "Range Not Satisfiable";
+	case 426: return "Upgrade Required";
+	case 429: return "Too Many Requests";
+	case 500: return "Internal Server Error";
+	case 501: return "Not Implemented";
+	case 503: return "Service Unavailable";
+	default: return "Unknown";
+	}
+}
+
+Reply::Reply(const util::web::http::HttpResponse& response)
+	: status{ 0 }, head{ response.encode() }
+{
+	// "HTTP/1.1 200 ..."
+	std::string_view sv(head);
+	if (sv.size() > 12) {
+		std::from_chars(sv.data() + 9, sv.data() + 12, status);
+	}
+}
+
+Reply::Reply(size_t _status, std::string&& _head, ReplyBody&& _body)
+	: status{ _status }, head{ std::move(_head) }, body{ std::move(_body) }
+{
+	;
+}
+
+Reply::Reply(ReplyHead&& replyHead, ReplyBody&& _body)
+	: status{ replyHead._status }, statusLine{ ReplyHead::statusLine(replyHead._status) }, body{ std::move(_body) }
+{
+	if (statusLine.empty()) {
+		head = replyHead.finish();
+		return;
+	}
+	DateHeader::append(replyHead.head);
+	replyHead.head += "\r\n";
+	head = std::move(replyHead.head);
+}
+
+Reply Reply::prebuilt(size_t status, bool close) {
+	static constexpr std::string_view Empty = "Content-Length: 0\r\n\r\n";
+	static constexpr std::string_view Closing = "Connection: close\r\nContent-Length: 0\r\n\r\n";
+	static constexpr std::string_view Busy = "Retry-After: 1\r\nContent-Length: 0\r\n\r\n";
+	auto tail = close ? Closing : ((status == 503) ? Busy : Empty);
+	std::string head;
+	head.reserve(DateHeader::Size + tail.size());
+	DateHeader::append(head);
+	head += tail;
+	Reply reply(status, std::move(head));
+	reply.statusLine = ReplyHead::statusLine(status);
+	return reply;
+}
+
+Reply Reply::shared(size_t status, std::shared_ptr<const std::string> data) {
+	// Date can't be cached with the rest, so it goes between shared status line and shared header lines
+	std::string head;
+	head.reserve(DateHeader::Size);
+	DateHeader::append(head);
+	Reply reply(status, std::move(head), SharedBody(std::move(data)));
+	reply.statusLine = ReplyHead::statusLine(status);
+	return reply;
+}
+
+// seqlock over atomic words, so readers never block and never see torn line
+void DateHeader::append(std::string& out) {
+	static constexpr size_t Words = (Size + 7) / 8;
+	static std::atomic<int64_t> second{ -1 };
+	static std::atomic<uint32_t> seq{ 0 };
+	static std::atomic<uint64_t> words[Words];
+	static std::mutex mtx;
+	int64_t now = time(nullptr);
+	if (second.load(std::memory_order_acquire) != now) {
+		// one thread renders, the rest use previous second meanwhile, unless there is none yet
+		std::unique_lock<std::mutex> lck(mtx, std::defer_lock);
+		if (second.load(std::memory_order_acquire) < 0) {
+			lck.lock();
+		}
+		else {
+			lck.try_lock();
+		}
+		if (lck.owns_lock() && (second.load(std::memory_order_relaxed) != now)) {
+			char line[Words * 8] = {};
+			render(now, line);
+			seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+			std::atomic_thread_fence(std::memory_order_release);
+			for (size_t i = 0; i < Words; ++i) {
+				uint64_t word;
+				memcpy(&word, line + i * 8, sizeof(word));
+				words[i].store(word, std::memory_order_relaxed);
+			}
+			seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			second.store(now, std::memory_order_release);
+		}
+	}
+	uint64_t copy[Words];
+	while (true) {
+		uint32_t before = seq.load(std::memory_order_acquire);
+		if (before & 1) {
+			continue;
+		}
+		for (size_t i = 0; i < Words; ++i) {
+			copy[i] = words[i].load(std::memory_order_relaxed);
+		}
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (seq.load(std::memory_order_relaxed) == before) {
+			break;
+		}
+	}
+	out.append((const char*)copy, Size);
+}
+
+// fixed width, so line always has the same size
+void DateHeader::render(time_t t, char* line) {
+	memcpy(line, "Date: ", 6);
+	format(t, line + 6);
+	memcpy(line + 6 + DateSize, "\r\n", 2);
+}
+
+void DateHeader::format(time_t t, char* out) {
+	struct tm tm;
+	gmtime_r(&t, &tm);
+	auto two = [](char* p, int v) {
+		p[0] = (char)('0' + v / 10);
+		p[1] = (char)('0' + v % 10);
+	};
+	memcpy(out, DayNames[tm.tm_wday].data(), 3);
+	memcpy(out + 3, ", ", 2);
+	two(out + 5, tm.tm_mday);
+	out[7] = ' ';
+	memcpy(out + 8, MonthNames[tm.tm_mon].data(), 3);
+	out[11] = ' ';
+	int year = tm.tm_year + 1900;
+	two(out + 12, (year / 100) % 100);
+	two(out + 14, year % 100);
+	out[16] = ' ';
+	two(out + 17, tm.tm_hour);
+	out[19] = ':';
+	two(out + 20, tm.tm_min);
+	out[22] = ':';
+	two(out + 23, tm.tm_sec);
+	memcpy(out + 25, " GMT", 4);
+}
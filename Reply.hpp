@@ -0,0 +1,208 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include <variant>
+#include <deque>
+#include <vector>
+#include <mutex>
+#include <functional>
+#include <ctime>
+#include "Http.hpp"
+
+// opened file and range of it that is still to be sent
+// owns fd and closes it on destruction
+class FileBody {
+public:
+	FileBody(int fd, size_t offset, size_t size);
+	FileBody(const FileBody&) = delete;
+	FileBody& operator=(const FileBody&) = delete;
+	FileBody(FileBody&& other) noexcept;
+	FileBody& operator=(FileBody&& other) noexcept;
+	~FileBody();
+	inline int fd() const { return _fd; }
+	inline size_t offset() const { return _offset; }
+	inline size_t remaining() const { return _remaining; }
+	inline bool finished() const { return _remaining == 0; }
+	void advance(size_t n);
+private:
+	int _fd = -1;
+	size_t _offset = 0;
+	size_t _remaining = 0;
+};
+
+// immutable bytes shared between replies (e.g. cached assets), sent without copying
+class SharedBody {
+public:
+	SharedBody(std::shared_ptr<const std::string> data);
+	inline const char* data() const { return _data->data() + _offset; }
+	// whole buffer, kept by sender while kernel may still read it (zerocopy)
+	inline const std::shared_ptr<const std::string>& buffer() const { return _data; }
+	inline size_t offset() const { return _offset; }
+	inline size_t remaining() const { return _data->size() - _offset; }
+	inline bool finished() const { return _offset == _data->size(); }
+	void advance(size_t n);
+private:
+	std::shared_ptr<const std::string> _data;
+	size_t _offset = 0;
+};
+
+// sequence of in-memory and file segments sent one after another (e.g. multipart/byteranges)
+class ChainBody {
+public:
+	using Segment = std::variant<std::string, FileBody>;
+	void append(std::string&& data);
+	void append(FileBody&& file);
+	inline bool finished() const { return segments.empty(); }
+	inline Segment& front() { return segments.front(); }
+	inline void pop() { segments.pop_front(); }
+	// total number of bytes left
+	size_t size() const;
+private:
+	std::deque<Segment> segments;
+};
+
+// body produced progressively by route handler through ChunkedWriter, sent with chunked transfer-encoding
+// ends when writer finishes, cancels writer when destroyed (e.g. connection is closed)
+class StreamBody {
+public:
+	struct State {
+		std::mutex mtx;
+		// chunk-encoded data not taken by connection yet
+		std::string pending;
+		// terminating chunk is written
+		bool closed = false;
+		// nobody reads anymore
+		bool cancelled = false;
+		// set when connection waits for data, called once by writer after new data
+		std::function<void()> onData;
+	};
+	StreamBody(std::shared_ptr<State> state);
+	StreamBody(StreamBody&& other) noexcept = default;
+	StreamBody& operator=(StreamBody&& other) noexcept;
+	~StreamBody();
+	inline bool finished() const { return _finished; }
+	// returns pending data, if there is none yet - onData is called as soon as it appears
+	std::string take(std::function<void()> onData);
+private:
+	void cancel();
+	std::shared_ptr<State> state;
+	bool _finished = false;
+};
+
+using ReplyBody = std::variant<std::monostate, FileBody, SharedBody, ChainBody, StreamBody>;
+
+inline bool bodyFinished(const ReplyBody& body) {
+	return std::visit([](const auto& b) {
+		if constexpr (std::is_same_v<std::decay_t<decltype(b)>, std::monostate>) {
+			return true;
+		}
+		else {
+			return b.finished();
+		}
+		}, body);
+}
+
+// common response headers, written from static table of interned "Name: " prefixes
+enum class Header : uint8_t {
+	AcceptRanges,
+	Allow,
+	CacheControl,
+	Connection,
+	ContentEncoding,
+	ContentLength,
+	ContentRange,
+	ContentType,
+	ETag,
+	LastModified,
+	RetryAfter,
+	SecWebSocketAccept,
+	TransferEncoding,
+	Upgrade,
+	Vary,
+	Count
+};
+
+// "Date: <IMF-fixdate>\r\n" line, rendered at most once per second and shared by all threads
+class DateHeader {
+public:
+	static constexpr size_t Size = 37;
+	// IMF-fixdate without "Date: " and line end
+	static constexpr size_t DateSize = 29;
+	static void append(std::string& out);
+	// writes DateSize characters, names are taken from fixed tables, so result doesn't depend on locale
+	static void format(time_t t, char* out);
+	static constexpr std::string_view DayNames[] = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
+	static constexpr std::string_view MonthNames[] = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec" };
+private:
+	static void render(time_t t, char* line);
+};
+
+// builds header block without intermediate maps, status line is taken from shared pre-rendered ones
+class ReplyHead {
+public:
+	ReplyHead(size_t status);
+	ReplyHead& add(std::string_view name, std::string_view value);
+	ReplyHead& add(std::string_view name, size_t value);
+	ReplyHead& add(Header name, std::string_view value);
+	ReplyHead& add(Header name, size_t value);
+	// terminates header block and returns it together with status line
+	std::string finish();
+	// terminates header block and returns it without status line, so it may be sent after shared one
+	std::string finishLines();
+	inline size_t status() const { return _status; }
+	// "HTTP/1.1 200 OK\r\n", rendered once for every code, empty for codes out of 100-599
+	static std::string_view statusLine(size_t status);
+	static std::string_view statusText(size_t status);
+	// "Name: "
+	static std::string_view headerPrefix(Header name);
+private:
+	friend struct Reply;
+	void appendNumber(size_t value);
+	size_t _status;
+	// header lines only
+	std::string head;
+};
+
+// what is sent back to client - encoded message (or only its head) and optional body streamed from file
+struct Reply {
+	Reply(const util::web::http::HttpResponse& response);
+	Reply(size_t status, std::string&& head, ReplyBody&& body = {});
+	// head is sent after shared status line, without copying it, Date is added to it
+	Reply(ReplyHead&& head, ReplyBody&& body = {});
+	// bodyless reply made by server itself (404, 413, 503, ...) from prebuilt header bytes, only Date is rendered
+	// close - with "Connection: close"
+	static Reply prebuilt(size_t status, bool close = false);
+	// reply kept in memory (cached asset) - data is header lines from ReplyHead::finishLines() followed by body, Date is rendered into head
+	static Reply shared(size_t status, std::shared_ptr<const std::string> data);
+	size_t status;
+	// static storage, sent before head, empty if head has its own status line
+	std::string_view statusLine;
+	// with status line - header lines, not terminated if header block goes on in shared body
+	std::string head;
+	ReplyBody body;
+	// connection is subscribed to these EventBroker topics once reply is queued, published payloads are sent after it
+	std::vector<std::string> topics;
+	// called right after subscribing, so nothing published meanwhile is missed, appends what was published before to chain body
+	// returns id of the last appended sse event, broadcasts of events up to it are not sent again
+	std::function<uint64_t(ChainBody&)> replay;
+};
+
+// producer side of StreamBody, may be copied and used from any thread
+// body is finished by finish() or when the last copy is destroyed
+class ChunkedWriter {
+public:
+	// reply with chunked head to be returned from handler, and writer feeding its body
+	static std::pair<Reply, ChunkedWriter> reply(size_t status, std::string_view contentType);
+	// false if connection has gone, so producing can be stopped
+	bool write(std::string_view data);
+	void finish();
+private:
+	struct Producer {
+		std::shared_ptr<StreamBody::State> state;
+		~Producer();
+	};
+	ChunkedWriter(std::shared_ptr<StreamBody::State> state);
+	static void close(StreamBody::State& state);
+	std::shared_ptr<Producer> producer;
+};
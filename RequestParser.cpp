@@ -0,0 +1,352 @@
+#include "RequestParser.hpp"
+#include <string.h>
+
+using namespace util::web::http;
+
+static constexpr std::string_view MethodNames[] = { "GET", "HEAD", "POST", "PUT", "DELETE", "CONNECT", "OPTIONS", "TRACE", "PATCH" };
+static constexpr Method Methods[] = { Method::GET, Method::HEAD, Method::POST, Method::PUT, Method::DELETE, Method::CONNECT, Method::OPTIONS, Method::TRACE, Method::PATCH };
+// longest method name
+static constexpr size_t MaxMethodSize = 7;
+
+static bool iequals(std::string_view a, std::string_view b) {
+	return (a.size() == b.size()) && (strncasecmp(a.data(), b.data(), a.size()) == 0);
+}
+
+static std::string_view trimOws(std::string_view sv) {
+	while (!sv.empty() && ((sv.front() == ' ') || (sv.front() == '\t'))) sv.remove_prefix(1);
+	while (!sv.empty() && ((sv.back() == ' ') || (sv.back() == '\t'))) sv.remove_suffix(1);
+	return sv;
+}
+
+RequestParser::Result RequestParser::parse(std::string_view _data) {
+	data = _data;
+	while (state != State::Done) {
+		if ((state == State::Body) && (_contentLength > bodyLimit)) {
+			// limit is set by caller after headers, so checking it here
+			_tooLarge = true;
+			return fail("body is too large");
+		}
+		if ((state == State::Body) && streaming) {
+			size_t size = std::min(data.size() - lineStart, _contentLength - bodyReceived);
+			_chunk = span(lineStart, lineStart + size);
+			lineStart = scanPos = lineStart + size;
+			bodyReceived += size;
+			if (bodyReceived == _contentLength) {
+				_consumed = lineStart;
+				state = State::Done;
+			}
+			if (size > 0) {
+				return Result::BodyChunk;
+			}
+			if (state != State::Done) {
+				return Result::Incomplete;
+			}
+			break;
+		}
+		if (state == State::Body) {
+			if (_contentLength > MaxBufferedBody - lineStart) {
+				_tooLarge = true;
+				return fail("body is too large");
+			}
+			if (data.size() - lineStart < _contentLength) {
+				return Result::Incomplete;
+			}
+			_body = span(lineStart, lineStart + _contentLength);
+			_consumed = lineStart + _contentLength;
+			state = State::Done;
+			break;
+		}
+		if (state == State::ChunkData) {
+			size_t size = std::min(data.size() - scanPos, chunkRemaining);
+			if (streaming) {
+				_chunk = span(scanPos, scanPos + size);
+			}
+			else {
+				decoded.append(data.substr(scanPos, size));
+			}
+			scanPos += size;
+			chunkRemaining -= size;
+			if (chunkRemaining == 0) {
+				lineStart = scanPos;
+				state = State::ChunkEnd;
+			}
+			if (streaming && (size > 0)) {
+				return Result::BodyChunk;
+			}
+			if (chunkRemaining > 0) {
+				return Result::Incomplete;
+			}
+			continue;
+		}
+		size_t maxLine = (state == State::RequestLine) ? MaxRequestLine : MaxHeaderLine;
+		auto nl = (const char*)memchr(data.data() + scanPos, '\n', data.size() - scanPos);
+		if (!nl) {
+			scanPos = data.size();
+			if (scanPos - lineStart > maxLine) {
+				return fail("too long line");
+			}
+			if ((state == State::RequestLine) && !methodPrefix(data.substr(lineStart, MaxMethodSize))) {
+				// rejecting garbage as soon as possible, without waiting for the whole line
+				return fail("unknown method");
+			}
+			return Result::Incomplete;
+		}
+		size_t end = nl - data.data();
+		if (end - lineStart > maxLine) {
+			return fail("too long line");
+		}
+		size_t lineEnd = ((end > lineStart) && (data[end - 1] == '\r')) ? end - 1 : end;
+		bool ok = false;
+		bool inHeaders = (state == State::Headers);
+		switch (state) {
+		case State::RequestLine: ok = parseRequestLine(lineEnd); break;
+		case State::Headers: ok = parseHeaderLine(lineEnd); break;
+		case State::ChunkSize: ok = parseChunkSize(lineEnd); break;
+		case State::ChunkEnd:
+			// chunk data must be followed by empty line
+			if (lineEnd != lineStart) {
+				fail("malformed chunk");
+				break;
+			}
+			state = State::ChunkSize;
+			ok = true;
+			break;
+		case State::Trailers: ok = parseTrailerLine(lineEnd, end + 1); break;
+		default: break;
+		}
+		if (!ok) {
+			return Result::Error;
+		}
+		lineStart = scanPos = end + 1;
+		if (inHeaders && headersComplete()) {
+			return Result::Headers;
+		}
+	}
+	return Result::Complete;
+}
+
+size_t RequestParser::release() {
+	// partially scanned line is kept, chunk data is delivered as soon as scanned
+	size_t n = (state == State::ChunkData) ? scanPos : lineStart;
+	// in chunk data line start stays at size line, before scan position
+	lineStart -= std::min(lineStart, n);
+	scanPos -= n;
+	_consumed -= std::min(_consumed, n);
+	_chunk = Span();
+	data = data.substr(n);
+	return n;
+}
+
+size_t RequestParser::bodyAllowance() const {
+	if (state == State::Done) {
+		return 0;
+	}
+	if (chunked) {
+		// current chunk and whatever is allowed by limit, chunk framing is not counted
+		return (bodyLimit == SIZE_MAX) ? SIZE_MAX : chunkRemaining + (bodyLimit - std::min(bodyLimit, bodyReceived));
+	}
+	if (streaming) {
+		return _contentLength - bodyReceived;
+	}
+	return _contentLength - std::min(_contentLength, data.size() - std::min(data.size(), lineStart));
+}
+
+void RequestParser::reset() {
+	*this = RequestParser();
+}
+
+std::string_view RequestParser::header(std::string_view name) const {
+	for (const auto& h : _headers) {
+		if (iequals(view(h.name), name)) {
+			return view(h.value);
+		}
+	}
+	return {};
+}
+
+void RequestParser::fill(HttpRequest& request) const {
+	request.method = _method;
+	request.url = std::string(url());
+}
+
+void RequestParser::fillHeaders(HttpRequest& request) const {
+	for (const auto& h : _headers) {
+		request.headers.add(std::string(view(h.name)), std::string(view(h.value)));
+	}
+}
+
+RequestParser::Result RequestParser::fail(const char* err) {
+	_error = err;
+	return Result::Error;
+}
+
+bool RequestParser::parseRequestLine(size_t end) {
+	if (end == lineStart) {
+		// empty lines before request are allowed
+		return true;
+	}
+	std::string_view line = data.substr(lineStart, end - lineStart);
+	size_t sp1 = line.find(' ');
+	size_t sp2 = (sp1 == std::string_view::npos) ? sp1 : line.find(' ', sp1 + 1);
+	if ((sp2 == std::string_view::npos) || (sp2 == sp1 + 1)) {
+		fail("malformed request line");
+		return false;
+	}
+	if (!methodFromToken(line.substr(0, sp1), _method)) {
+		fail("unknown method");
+		return false;
+	}
+	std::string_view version = line.substr(sp2 + 1);
+	if ((version != "HTTP/1.1") && (version != "HTTP/1.0")) {
+		fail("unsupported version");
+		return false;
+	}
+	_methodName = span(lineStart, lineStart + sp1);
+	_url = span(lineStart + sp1 + 1, lineStart + sp2);
+	_version = span(lineStart + sp2 + 1, end);
+	state = State::Headers;
+	return true;
+}
+
+bool RequestParser::parseHeaderLine(size_t end) {
+	if (end == lineStart) {
+		return headersDone();
+	}
+	if ((data[lineStart] == ' ') || (data[lineStart] == '\t')) {
+		// obsolete line folding
+		fail("folded header");
+		return false;
+	}
+	if (_headers.size() == MaxHeaders) {
+		fail("too many headers");
+		return false;
+	}
+	std::string_view line = data.substr(lineStart, end - lineStart);
+	size_t colon = line.find(':');
+	if ((colon == 0) || (colon == std::string_view::npos) || (line[colon - 1] == ' ') || (line[colon - 1] == '\t')) {
+		fail("malformed header");
+		return false;
+	}
+	std::string_view value = trimOws(line.substr(colon + 1));
+	size_t valueStart = value.empty() ? end : value.data() - data.data();
+	_headers.push_back({ span(lineStart, lineStart + colon), span(valueStart, valueStart + value.size()) });
+	return true;
+}
+
+bool RequestParser::headersDone() {
+	bool hasLength = false;
+	for (const auto& h : _headers) {
+		auto name = view(h.name);
+		if (iequals(name, "Transfer-Encoding")) {
+			// only plain chunked is supported, anything else can't be delimited
+			if (!iequals(view(h.value), "chunked") || chunked) {
+				fail("unsupported transfer encoding");
+				return false;
+			}
+			chunked = true;
+			continue;
+		}
+		if (!iequals(name, "Content-Length")) {
+			continue;
+		}
+		auto value = view(h.value);
+		size_t length = 0;
+		if (value.empty() || (value.size() > 18)) {
+			fail("invalid content length");
+			return false;
+		}
+		for (char c : value) {
+			if ((c < '0') || (c > '9')) {
+				fail("invalid content length");
+				return false;
+			}
+			length = length * 10 + (c - '0');
+		}
+		if (hasLength && (length != _contentLength)) {
+			fail("conflicting content length");
+			return false;
+		}
+		hasLength = true;
+		_contentLength = length;
+	}
+	if (chunked && hasLength) {
+		// ambiguous framing, typical for request smuggling
+		fail("both content length and transfer encoding");
+		return false;
+	}
+	state = chunked ? State::ChunkSize : State::Body;
+	return true;
+}
+
+bool RequestParser::parseChunkSize(size_t end) {
+	std::string_view line = data.substr(lineStart, end - lineStart);
+	// chunk extensions are ignored
+	line = trimOws(line.substr(0, line.find(';')));
+	if (line.empty() || (line.size() > 15)) {
+		fail("invalid chunk size");
+		return false;
+	}
+	size_t size = 0;
+	for (char c : line) {
+		int digit = ((c >= '0') && (c <= '9')) ? c - '0' : ((c | 0x20) >= 'a') && ((c | 0x20) <= 'f') ? (c | 0x20) - 'a' + 10 : -1;
+		if (digit < 0) {
+			fail("invalid chunk size");
+			return false;
+		}
+		size = size * 16 + digit;
+	}
+	if (size == 0) {
+		state = State::Trailers;
+		return true;
+	}
+	if (size > bodyLimit - bodyReceived) {
+		_tooLarge = true;
+		fail("body is too large");
+		return false;
+	}
+	bodyReceived += size;
+	chunkRemaining = size;
+	state = State::ChunkData;
+	return true;
+}
+
+// trailer fields are skipped, empty line ends the request
+bool RequestParser::parseTrailerLine(size_t end, size_t next) {
+	if (end == lineStart) {
+		_consumed = next;
+		state = State::Done;
+		return true;
+	}
+	if (++trailers > MaxTrailers) {
+		fail("too many trailers");
+		return false;
+	}
+	return true;
+}
+
+bool RequestParser::methodFromToken(std::string_view token, Method& method) {
+	for (size_t i = 0; i < std::size(MethodNames); ++i) {
+		if (token == MethodNames[i]) {
+			method = Methods[i];
+			return true;
+		}
+	}
+	return false;
+}
+
+// whether token may be the beginning of known method
+bool RequestParser::methodPrefix(std::string_view token) {
+	// leading empty lines are skipped
+	while (!token.empty() && ((token.front() == '\r') || (token.front() == '\n'))) {
+		token.remove_prefix(1);
+	}
+	if (size_t sp = token.find(' '); sp != std::string_view::npos) {
+		token = token.substr(0, sp);
+	}
+	for (auto name : MethodNames) {
+		if (name.starts_with(token)) {
+			return true;
+		}
+	}
+	return false;
+}
@@ -0,0 +1,128 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include "Http.hpp"
+
+// incremental http/1.x request parser
+// state is kept between reads and scanning continues where it stopped, so no byte is looked at twice
+// parsed parts are stored as offsets and returned as views into the last data passed to parse(), so they are valid until input buffer is changed
+// in streaming mode body is not kept - every received piece of it is returned as chunk() and may be released from input buffer
+class RequestParser {
+public:
+	enum class Result {
+		// more data is needed
+		Incomplete,
+		// headers are just received, parse() has to be called again to continue with body
+		Headers,
+		// streaming mode only - next piece of body is in chunk()
+		BodyChunk,
+		// whole request including body is received
+		Complete,
+		Error
+	};
+	// data must start with the first byte of request (or of what is left after release()) and include everything passed before
+	Result parse(std::string_view data);
+	// may be switched on when headers are received
+	inline void setStreaming(bool _streaming) { streaming = _streaming; }
+	// body bigger than limit makes parse() fail with tooLarge() set
+	inline void setBodyLimit(size_t limit) { bodyLimit = limit; }
+	inline bool tooLarge() const { return _tooLarge; }
+	inline std::string_view chunk() const { return view(_chunk); }
+	// streaming mode only - forgets everything before current position and returns number of bytes to be dropped from input buffer
+	// views to request line and headers are invalid after it
+	size_t release();
+	void reset();
+	inline bool complete() const { return state == State::Done; }
+	inline bool headersComplete() const { return state >= State::Body; }
+	// valid only after request line is parsed
+	inline util::web::http::Method method() const { return _method; }
+	inline std::string_view methodName() const { return view(_methodName); }
+	inline std::string_view url() const { return view(_url); }
+	inline std::string_view version() const { return view(_version); }
+	inline size_t headersCount() const { return _headers.size(); }
+	inline std::pair<std::string_view, std::string_view> header(size_t idx) const { return { view(_headers[idx].name), view(_headers[idx].value) }; }
+	// case-insensitive, empty view if there is no such header
+	std::string_view header(std::string_view name) const;
+	// for chunked request - size of body received so far
+	inline size_t contentLength() const { return chunked ? bodyReceived : _contentLength; }
+	inline bool isChunked() const { return chunked; }
+	// body bytes of current request that may still come after what is passed to parse(), SIZE_MAX if unknown
+	// valid only after headers, used to limit reads from socket
+	size_t bodyAllowance() const;
+	// valid only after request is complete and not in streaming mode, chunked body is decoded into parser's own storage
+	inline std::string_view body() const { return chunked ? std::string_view(decoded) : view(_body); }
+	// size of the whole request, bytes after it belong to the next one
+	inline size_t consumed() const { return _consumed; }
+	inline const char* error() const { return _error; }
+	// fills method and url of request for route handlers, headers are read as views with header()
+	void fill(util::web::http::HttpRequest& request) const;
+	// copies headers into request, for handlers that keep it after input buffer is changed
+	void fillHeaders(util::web::http::HttpRequest& request) const;
+
+	// limits protecting from garbage and slow-loris style requests
+	static constexpr size_t MaxRequestLine = 8 * 1024;
+	static constexpr size_t MaxHeaderLine = 8 * 1024;
+	static constexpr size_t MaxHeaders = 100;
+	static constexpr size_t MaxTrailers = 16;
+	// whole body kept in input buffer is addressed by 32-bit spans, bigger ones must be streamed
+	static constexpr size_t MaxBufferedBody = UINT32_MAX;
+private:
+	// order matters - everything starting from Body is after headers
+	enum class State {
+		RequestLine,
+		Headers,
+		Body,
+		ChunkSize,
+		ChunkData,
+		ChunkEnd,
+		Trailers,
+		Done
+	};
+	struct Span {
+		uint32_t offset = 0;
+		uint32_t size = 0;
+	};
+	struct Header {
+		Span name;
+		Span value;
+	};
+	inline std::string_view view(Span span) const { return data.substr(span.offset, span.size); }
+	inline Span span(size_t from, size_t to) const { return { (uint32_t)from, (uint32_t)(to - from) }; }
+	Result fail(const char* err);
+	bool parseRequestLine(size_t end);
+	bool parseHeaderLine(size_t end);
+	bool parseChunkSize(size_t end);
+	bool parseTrailerLine(size_t end, size_t next);
+	bool headersDone();
+	static bool methodFromToken(std::string_view token, util::web::http::Method& method);
+	static bool methodPrefix(std::string_view token);
+
+	std::string_view data;
+	State state = State::RequestLine;
+	// start of line being parsed
+	size_t lineStart = 0;
+	// everything before is scanned already
+	size_t scanPos = 0;
+	util::web::http::Method _method = util::web::http::Method::GET;
+	Span _methodName;
+	Span _url;
+	Span _version;
+	std::vector<Header> _headers;
+	size_t _contentLength = 0;
+	Span _body;
+	bool chunked = false;
+	bool streaming = false;
+	size_t bodyLimit = SIZE_MAX;
+	bool _tooLarge = false;
+	// body bytes received, counted for chunked or streamed body
+	size_t bodyReceived = 0;
+	Span _chunk;
+	// bytes left in current chunk
+	size_t chunkRemaining = 0;
+	size_t trailers = 0;
+	std::string decoded;
+	size_t _consumed = 0;
+	const char* _error = "";
+};
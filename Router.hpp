@@ -0,0 +1,250 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include "RequestParser.hpp"
+
+// parameters captured while routing, views point to route pattern and request url, so valid only while request is handled
+class RouteParams {
+public:
+	RouteParams() = default;
+	explicit RouteParams(std::string_view _body) : bodyView{ _body } {}
+	inline void push(std::string_view name, std::string_view value) { values.push_back({ name, value }); }
+	inline void pop() { values.pop_back(); }
+	// empty view if there is no such parameter
+	inline std::string_view get(std::string_view name) const {
+		for (const auto& [_name, value] : values) {
+			if (_name == name) return value;
+		}
+		return {};
+	}
+	inline bool contains(std::string_view name) const {
+		for (const auto& [_name, value] : values) {
+			if (_name == name) return true;
+		}
+		return false;
+	}
+	inline const auto& all() const { return values; }
+	// request body without copying, it is in connection's input buffer
+	inline std::string_view body() const { return bodyView; }
+	inline void setBody(std::string_view _body) { bodyView = _body; }
+	// headers of request as views into input buffer, without copying them into HttpRequest
+	inline void setHeaders(const RequestParser* _parser) { parser = _parser; }
+	inline bool hasHeaders() const { return parser != nullptr; }
+	// empty view if there is no such header or headers are not set
+	inline std::string_view header(std::string_view name) const { return parser ? parser->header(name) : std::string_view(); }
+	inline void copyHeaders(util::web::http::HttpRequest& request) const {
+		if (parser) parser->fillHeaders(request);
+	}
+private:
+	std::string_view bodyView;
+	const RequestParser* parser = nullptr;
+	std::vector<std::pair<std::string_view, std::string_view>> values;
+};
+
+// compressed radix tree of url patterns
+// pattern may contain static parts, ":name" parameters matching one path segment and trailing "*" (or "*name") matching the rest
+// lookup priority is static > parameter > catch-all, a catch-all is used only if nothing else matches whole path and deeper one wins
+// so result doesn't depend on registration order
+template<typename Handler>
+class RadixRouter {
+public:
+	void insert(std::string_view pattern, Handler handler) {
+		Node* node = &root;
+		while (!pattern.empty()) {
+			size_t special = pattern.find_first_of(":*");
+			node = insertStatic(node, pattern.substr(0, special));
+			if (special == std::string_view::npos) {
+				break;
+			}
+			pattern.remove_prefix(special);
+			if (pattern.front() == '*') {
+				// catch-all must be the last
+				if (node->catchAll) {
+					throw std::logic_error("route already exists");
+				}
+				node->catchAllName = std::string(pattern.substr(1));
+				node->catchAll = std::move(handler);
+				return;
+			}
+			size_t end = pattern.find('/');
+			std::string_view name = pattern.substr(1, end == std::string_view::npos ? end : end - 1);
+			if (name.empty()) {
+				throw std::runtime_error("route parameter must have a name");
+			}
+			if (!node->param) {
+				node->param = std::make_unique<Node>();
+				node->paramName = std::string(name);
+			}
+			else if (node->paramName != name) {
+				throw std::logic_error("conflicting route parameter names");
+			}
+			node = node->param.get();
+			pattern.remove_prefix(std::min(pattern.size(), end));
+		}
+		if (node->handler) {
+			throw std::logic_error("route already exists");
+		}
+		node->handler = std::move(handler);
+	}
+
+	// returns false if there is no such pattern
+	bool remove(std::string_view pattern) {
+		return removeFrom(&root, pattern);
+	}
+
+	// catch-all routes are tried only if no static or parameter route matches the whole path
+	const Handler* find(std::string_view path, RouteParams& params) const {
+		if (auto res = match(&root, path, params, false); res) {
+			return res;
+		}
+		return match(&root, path, params, true);
+	}
+
+	bool empty() const {
+		return unused(root);
+	}
+
+private:
+	struct Node {
+		// static part of the edge leading to this node
+		std::string prefix;
+		std::vector<std::unique_ptr<Node>> children;
+		std::unique_ptr<Node> param;
+		std::string paramName;
+		std::optional<Handler> catchAll;
+		std::string catchAllName;
+		std::optional<Handler> handler;
+	};
+
+	static bool unused(const Node& node) {
+		return !node.handler && !node.catchAll && !node.param && node.children.empty();
+	}
+
+	// nodes left without routes are pruned on the way back, so adding and removing routes doesn't grow the tree
+	static bool removeFrom(Node* node, std::string_view pattern) {
+		if (pattern.empty()) {
+			bool existed = node->handler.has_value();
+			node->handler.reset();
+			return existed;
+		}
+		if (pattern.front() == '*') {
+			bool existed = node->catchAll.has_value();
+			node->catchAll.reset();
+			node->catchAllName.clear();
+			return existed;
+		}
+		if (pattern.front() == ':') {
+			if (!node->param) return false;
+			size_t end = pattern.find('/');
+			bool existed = removeFrom(node->param.get(), pattern.substr(std::min(pattern.size(), end)));
+			if (unused(*node->param)) {
+				node->param.reset();
+				node->paramName.clear();
+			}
+			return existed;
+		}
+		Node* child = findChild(node, pattern.front());
+		if (!child || !pattern.starts_with(child->prefix)) {
+			return false;
+		}
+		bool existed = removeFrom(child, pattern.substr(child->prefix.size()));
+		prune(node, child);
+		return existed;
+	}
+
+	// drops child without routes, or merges it with its only child, so edges split by insert are joined back
+	static void prune(Node* node, Node* child) {
+		for (auto iter = node->children.begin(); iter != node->children.end(); ++iter) {
+			if (iter->get() != child) {
+				continue;
+			}
+			if (unused(*child)) {
+				node->children.erase(iter);
+			}
+			else if (!child->handler && !child->catchAll && !child->param && (child->children.size() == 1)) {
+				auto grandChild = std::move(child->children.front());
+				grandChild->prefix = child->prefix + grandChild->prefix;
+				*iter = std::move(grandChild);
+			}
+			return;
+		}
+	}
+
+	static Node* findChild(const Node* node, char c) {
+		for (const auto& child : node->children) {
+			if (child->prefix.front() == c) return child.get();
+		}
+		return nullptr;
+	}
+
+	static Node* insertStatic(Node* node, std::string_view s) {
+		while (!s.empty()) {
+			Node* child = findChild(node, s.front());
+			if (!child) {
+				auto newChild = std::make_unique<Node>();
+				newChild->prefix = std::string(s);
+				node->children.push_back(std::move(newChild));
+				return node->children.back().get();
+			}
+			size_t common = 0;
+			while ((common < s.size()) && (common < child->prefix.size()) && (s[common] == child->prefix[common])) {
+				++common;
+			}
+			if (common < child->prefix.size()) {
+				// splitting edge - new node takes common part, old one keeps the rest
+				auto split = std::make_unique<Node>();
+				split->prefix = child->prefix.substr(0, common);
+				for (auto& c : node->children) {
+					if (c.get() == child) {
+						child->prefix.erase(0, common);
+						split->children.push_back(std::move(c));
+						c = std::move(split);
+						child = c.get();
+						break;
+					}
+				}
+			}
+			node = child;
+			s.remove_prefix(common);
+		}
+		return node;
+	}
+
+	// static children are tried first, then parameter, backtracking on failure
+	// with catchAll set, the deepest catch-all on that order is taken when nothing else matches
+	static const Handler* match(const Node* node, std::string_view path, RouteParams& params, bool catchAll) {
+		if (path.empty() && node->handler) {
+			return &*node->handler;
+		}
+		if (!path.empty()) {
+			if (Node* child = findChild(node, path.front()); child && path.starts_with(child->prefix)) {
+				if (auto res = match(child, path.substr(child->prefix.size()), params, catchAll); res) {
+					return res;
+				}
+			}
+			if (node->param) {
+				size_t end = std::min(path.find('/'), path.size());
+				if (end > 0) {
+					params.push(node->paramName, path.substr(0, end));
+					if (auto res = match(node->param.get(), path.substr(end), params, catchAll); res) {
+						return res;
+					}
+					params.pop();
+				}
+			}
+		}
+		if (catchAll && node->catchAll) {
+			if (!node->catchAllName.empty()) {
+				params.push(node->catchAllName, path);
+			}
+			return &*node->catchAll;
+		}
+		return nullptr;
+	}
+
+	Node root;
+};
@@ -1,17 +1,29 @@
 #include "SocketWorker.hpp"
 #include "ProjLogger.hpp"
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <linux/errqueue.h>
 #include <string.h>
 #include <syncstream>
 #include "EventBroker.hpp"
 #include "Http.hpp"
+#include "TcpNonblockingSocket.hpp"
 #include <iostream>
 
 using namespace inet;
 using namespace util::web::http;
 
+static uint64_t nowMicros() {
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
 SocketDataHandler::SocketDataHandler(QueueT&& tasksQueue, ThreadPoolT* ptp, size_t _threadIdx)
-	: tasksQueue{ std::move(tasksQueue) }, threadPool{ptp}, threadIdx{_threadIdx}
+	: tasksQueue{ std::move(tasksQueue) }, events{ std::make_unique<EventRingT>() }, threadPool{ptp}, threadIdx{_threadIdx}, workerMetrics{ std::make_unique<WorkerMetrics>() }
 {
 	onResponseFromApiCb = [this](int epollFd, std::shared_ptr<inet::ISocket> clientSock) {
 		return [this, epollFd, clientSock](size_t producerId, std::variant<HttpResponse, std::string> response) {
@@ -34,6 +46,7 @@ SocketDataHandler::SocketDataHandler(QueueT&& tasksQueue, ThreadPoolT* ptp, size
 					}, response);
 				}),
 				std::move(epfd), std::move(clsock), std::move(response));
+			wakeUp();
 			};
 		};
 }
@@ -42,22 +55,40 @@ SocketDataHandler::SocketDataHandler(SocketDataHandler&& other) noexcept
 {
 	std::lock_guard<std::mutex> lck(other.mtx);
 	tasksQueue = std::move(other.tasksQueue);
+	events = std::move(other.events);
 	threadPool = other.threadPool;
 	threadIdx = other.threadIdx;
 	thread = std::move(other.thread);
 	sockConnection = std::move(other.sockConnection);
 	mapper = other.mapper;
+	epollFd = other.epollFd;
+	wakeFd = other.wakeFd.load();
+	timeouts = other.timeouts;
+	admission = other.admission;
+	zeroCopyMinSize = other.zeroCopyMinSize;
+	workerMetrics = std::move(other.workerMetrics);
+	accessLog = other.accessLog;
+	assigned = other.assigned.load();
 }
 
 SocketDataHandler& SocketDataHandler::operator=(SocketDataHandler&& other) noexcept
 {
 	std::lock_guard<std::mutex> lck(other.mtx);
 	tasksQueue = std::move(other.tasksQueue);
+	events = std::move(other.events);
 	threadPool = other.threadPool;
 	threadIdx = other.threadIdx;
 	thread = std::move(other.thread);
 	sockConnection = std::move(other.sockConnection);
 	mapper = other.mapper;
+	epollFd = other.epollFd;
+	wakeFd = other.wakeFd.load();
+	timeouts = other.timeouts;
+	admission = other.admission;
+	zeroCopyMinSize = other.zeroCopyMinSize;
+	workerMetrics = std::move(other.workerMetrics);
+	accessLog = other.accessLog;
+	assigned = other.assigned.load();
 	return *this;
 }
 
@@ -85,125 +116,483 @@ void SocketDataHandler::setMapper(SocketThreadMapper* _mapper) {
 	mapper = _mapper;
 }
 
-void SocketDataHandler::onInputData(int epollFd, std::shared_ptr<ISocket> clientSock) {
-	int fd = clientSock->fd();
-	if (!checkFd(clientSock)) return;
-	//cout << format("Reading from epoll {} and socket {}\n", epollFd, socketFd);
-	auto& connection = sockConnection[fd];
-	if (!connection.obuf.empty()) {
-		Log.warning(std::format("Receiveng request from {}, but response is in process", fd));
-		onError(epollFd, clientSock);
-		return;
+void SocketDataHandler::setEpollFd(int _epollFd) {
+	epollFd = _epollFd;
+}
+
+void SocketDataHandler::setTimeouts(const ConnectionTimeouts& _timeouts) {
+	timeouts = _timeouts;
+}
+
+void SocketDataHandler::setAdmission(AdmissionControl* _admission, std::chrono::milliseconds retryInterval) {
+	admission = _admission;
+	acceptRetryInterval = retryInterval;
+}
+
+void SocketDataHandler::setZeroCopy(size_t minSize) {
+	zeroCopyMinSize = minSize;
+}
+
+void SocketDataHandler::setAccessLog(AccessLog* _accessLog) {
+	accessLog = (_accessLog && _accessLog->enabled()) ? _accessLog : nullptr;
+}
+
+// once ring has been full, events go by slow path until it is drained, so events of one fd keep their order
+void SocketDataHandler::pushEvent(SocketEvent event) {
+	if ((overflowed.load(std::memory_order_acquire) > 0) || !events->push(event)) {
+		// ring is full - falling back to slow path so event is not lost
+		overflowed.fetch_add(1, std::memory_order_relaxed);
+		threadPool->pushTask(threadIdx, std::function([this](SocketEvent event) {
+			// events pushed to ring before the overflow go first
+			drainEvents();
+			onEvent(event);
+			overflowed.fetch_sub(1, std::memory_order_release);
+			return 0;
+			}), std::move(event));
 	}
-	auto& buf = connection.ibuf;
-	Log.debug(std::format("Handling client data {}", fd));
-	size_t offset = buf.size();
-	ssize_t nbytes = 0;
-	if (nbytes = clientSock->read(buf); nbytes <= 0 && nbytes != -EAGAIN) {
-		//Log.debug(std::format("Error number {} on {}: {}", nbytes, fd, strerror(errno)));
-		Log.error(clientSock->strerr());
-		onError(epollFd, clientSock);
+	wakeUp();
+}
+
+void SocketDataHandler::onEvent(SocketEvent event) {
+	auto entry = mapper->findThreadIdx(event.fd);
+	if (!entry.valid || entry.epoch != event.epoch) {
+		// connection was closed (and fd possibly reused) after event had been queued
 		return;
 	}
-	else if (nbytes == -EAGAIN) {
-		Log.debug(std::format("Error number EAGAIN on {}", fd));
-		return;
+	auto& connection = sockConnection[event.fd];
+	if (connection.epoch != event.epoch) {
+		// first event of new connection
+		connection = Connection();
+		connection.sock = mapper->takeSock(event.fd, event.epoch);
+		if (!connection.sock) {
+			// slot has been taken over by another connection meanwhile
+			sockConnection.erase(event.fd);
+			return;
+		}
+		connection.plain = isPlainTcp(connection.sock.get());
+		connection.epoch = event.epoch;
+		workerMetrics->connectionsOpened.add();
 	}
-	else {
-		Log.debug(std::format("Read {} bytes from {}", nbytes, clientSock->fd()));
+	// connection may be erased while handling, keeping socket alive till the end
+	auto clientSock = connection.sock;
+	switch (event.kind) {
+	case SocketEvent::Kind::Error:
+		if (reapZeroCopy(connection)) {
+			// only zerocopy completions are reported, hangup (if any) is found by reading
+			onHttpResponse(epollFd, clientSock);
+			if (checkFd(clientSock)) {
+				onInputData(epollFd, clientSock);
+			}
+			break;
+		}
+		onError(epollFd, clientSock);
+		break;
+	case SocketEvent::Kind::Input:
+		onInputData(epollFd, clientSock);
+		break;
+	case SocketEvent::Kind::Output:
+		// continuing to write response, previously stopped on EAGAIN 
+		onHttpResponse(epollFd, clientSock);
+		break;
 	}
-	auto bufData = buf.get();
-	auto& request = connection.request;
-	size_t& bodyStartPos = connection.bodyStartPos;
+}
 
-	if (!request.parsed()) {
-		if (bufData.size() < 7) {
-			// min data size to check - shortest method "GET" + "\r\n\r\n" == 7, and longest method "OPTIONS" == 7, so it is sufficient to check
+void SocketDataHandler::onInputData(int epollFd, const std::shared_ptr<ISocket>& clientSock) {
+	readInput(epollFd, clientSock);
+	if (checkFd(clientSock)) {
+		updateConnection(sockConnection[clientSock->fd()]);
+	}
+}
+
+void SocketDataHandler::readInput(int epollFd, const std::shared_ptr<ISocket>& clientSock) {
+	int fd = clientSock->fd();
+	if (!checkFd(clientSock)) return;
+	//cout << format("Reading from epoll {} and socket {}\n", epollFd, socketFd);
+	auto& connection = sockConnection[fd];
+	Log.debug("Handling client data {}", fd);
+	// reads are limited by what current request may still take, and parsed before next one
+	// so one client can neither grow buffer beyond limits nor hold worker for long
+	size_t budget = MaxReadPerEvent;
+	while (true) {
+		if (connection.closeAfterWrite || connection.bodyPaused || connection.awaiting) {
+			// request is rejected, body sink can't take more data, or async reply is awaited - leaving data in socket
 			return;
 		}
-		if (offset == 0) {
-			if (!checkInputBufData(std::string_view((char*)bufData.data(), (char*)bufData.data() + 7))) {
-				Log.warning(std::format("Invalid non-http data from {}", fd));
-				onError(epollFd, clientSock);
+		if (connection.queue.size() >= Connection::OutputQueueHighWater) {
+			// client doesn't read responses - leaving requests in socket until queue is drained
+			connection.readPaused = true;
+			return;
+		}
+		size_t limit = readLimit(connection);
+		if (limit == 0) {
+			// sink has no space - it resumes reading on its own
+			connection.bodyPaused = true;
+			return;
+		}
+		bool more = false;
+		ssize_t nbytes = readSocket(clientSock, connection, std::min(limit, budget), more);
+		if ((nbytes <= 0) && (nbytes != -EAGAIN)) {
+			//Log.debug("Error number {} on {}: {}", nbytes, fd, strerror(errno));
+			if (connection.plain) {
+				Log.error("Error on reading from {}: {}", fd, (nbytes == 0) ? "closed by peer" : strerror((int)-nbytes));
+			}
+			else {
+				Log.error("{}", clientSock->strerr());
+			}
+			onError(epollFd, clientSock);
+			return;
+		}
+		else if (nbytes == -EAGAIN) {
+			// there still may be requests left in ibuf after pause
+			Log.debug("Error number EAGAIN on {}", fd);
+			workerMetrics->readEagain.add();
+		}
+		else {
+			Log.debug("Read {} bytes from {}", nbytes, clientSock->fd());
+			workerMetrics->bytesRead.add(nbytes);
+			connection.lastRead = nowTick;
+		}
+		if (connection.ws) {
+			onWebSocketData(epollFd, clientSock, connection);
+			if (!checkFd(clientSock) || connection.closeAfterWrite || connection.readPaused) {
 				return;
 			}
 		}
-		if (bufData.size() > Connection::MaxIbufSize) {
-			Log.warning(std::format("Invalid non-http data from {}: suspicious data of too large size", fd));
-			onError(epollFd, clientSock);
+		else if (!parseInput(epollFd, clientSock, connection)) {
 			return;
 		}
-		//Log.debug(std::format("data = {}, offset = {}, size = {}", (void*)bufData.data(), offset, bufData.size()));
-		auto bufSv = std::string_view((char*)bufData.data() + offset, (char*)bufData.data() + bufData.size());
-		auto pos = bufSv.find("\r\n\r\n");
-		if (pos == std::string::npos) {
-			Log.warning(std::format("Invalid non-http data from {}", fd));
-			onError(epollFd, clientSock);
+		if (!more) {
+			// socket is drained, edge-triggered epoll reports the next data
+			return;
+		}
+		budget -= nbytes;
+		if (budget == 0) {
+			// the rest is read after other connections of this worker have had their turn
+			threadPool->pushTask(threadIdx, std::function([this](int epollFd, std::shared_ptr<inet::ISocket> clientSock) {
+				if (checkFd(clientSock)) {
+					onInputData(epollFd, clientSock);
+				}
+				return 0;
+				}), epollFd, clientSock);
+			wakeUp();
 			return;
 		}
-		bodyStartPos = offset + pos + 4;
 	}
-	if (request.parsed() || request.parse(std::string_view((char*)bufData.data(), (char*)bufData.data() + bodyStartPos))) {
-		if (std::string sContLen = request.headers().find("Content-Length"); !sContLen.empty()) {
-			size_t contentLength = std::stoull(sContLen);
-			size_t dataRestLen = bufData.size() - bodyStartPos;
-			if (dataRestLen < contentLength) {
-				// waiting for the rest data
-				return;
+}
+
+// handles complete requests in ibuf, true if more input is needed to go on
+bool SocketDataHandler::parseInput(int epollFd, const std::shared_ptr<ISocket>& clientSock, Connection& connection) {
+	int fd = clientSock->fd();
+	auto& buf = connection.ibuf;
+	auto& parser = connection.parser;
+	// pipelined requests - handling all complete ones, responses are queued in the same order
+	while (true) {
+		auto bufData = buf.get();
+		// parser continues from where previous read stopped
+		auto res = parser.parse(std::string_view((char*)bufData.data(), (char*)bufData.data() + bufData.size()));
+		if (res == RequestParser::Result::Error) {
+			Log.warning("Invalid http data from {}: {}", fd, parser.error());
+			workerMetrics->parseErrors.add();
+			if (parser.tooLarge()) {
+				rejectRequest(epollFd, clientSock, connection, 413);
+				return false;
 			}
-			else {
-				request.message().body = std::string((char*)bufData.data() + bodyStartPos, (char*)bufData.data() + bodyStartPos + contentLength);
-				buf.clear(bodyStartPos + contentLength);
+			onError(epollFd, clientSock);
+			return false;
+		}
+		if (res == RequestParser::Result::Incomplete) {
+			if (!parser.headersComplete() && (bufData.size() > Connection::MaxHeaderBlockSize)) {
+				Log.warning("Invalid non-http data from {}: suspicious data of too large size", fd);
+				workerMetrics->parseErrors.add();
+				onError(epollFd, clientSock);
+				return false;
+			}
+			// waiting for the rest data
+			return true;
+		}
+		if (res == RequestParser::Result::Headers) {
+			if (!onRequestHeaders(epollFd, clientSock, connection)) {
+				return false;
+			}
+			continue;
+		}
+		if (res == RequestParser::Result::BodyChunk) {
+			auto status = connection.sink->onData(parser.chunk());
+			buf.clear(parser.release());
+			if (status == BodySink::Status::Abort) {
+				rejectRequest(epollFd, clientSock, connection, 400);
+				return false;
+			}
+			if (status == BodySink::Status::Pause) {
+				connection.bodyPaused = true;
+				return false;
 			}
+			continue;
+		}
+		if (connection.route && connection.route->wsHandler) {
+			// the rest of input belongs to websocket, it is read by caller as frames
+			upgradeWebSocket(epollFd, clientSock, connection);
+			return checkFd(clientSock);
+		}
+		if ((timeouts.maxRequests > 0) && (++connection.requests >= timeouts.maxRequests)) {
+			// reply gets "Connection: close", nothing is read after it
+			connection.lastRequest = true;
+		}
+		if (connection.sink) {
+			auto cb = onResponseFromApiCb(epollFd, clientSock);
+			enqueueResponse(connection, connection.sink->onComplete(cb));
+			connection.sink.reset();
+			__onHttpResponse(epollFd, clientSock, connection);
+		}
+		else if (overloaded()) {
+			// worker is behind - answering without running handler is cheaper than making everyone wait
+			workerMetrics->overloaded.add();
+			enqueueResponse(connection, Reply::prebuilt(503));
+			__onHttpResponse(epollFd, clientSock, connection);
 		}
 		else {
-			// no body - assuming message is received
-			buf.clear(bodyStartPos);
+			// body is passed as view into ibuf, so buffer is cleared only after request is handled
+			onHttpRequest(epollFd, clientSock, connection.request, parser.body());
+		}
+		if (!checkFd(clientSock)) {
+			// connection has been closed while responding
+			return false;
+		}
+		buf.clear(parser.consumed());
+		parser.reset();
+		connection.request = HttpRequest();
+		connection.route = nullptr;
+		connection.params = RouteParams();
+		// header timeout of the next request starts anew
+		connection.phase = Connection::Phase::None;
+		if (connection.closeAfterWrite) {
+			return false;
+		}
+		if (connection.awaiting) {
+			// next pipelined request is handled after async reply, so replies keep order
+			return false;
+		}
+		if (connection.queue.size() >= Connection::OutputQueueHighWater) {
+			connection.readPaused = true;
+			return false;
 		}
 	}
-	else {
-		Log.warning(std::format("Couldn't parse http message from {}", fd));
-		onError(epollFd, clientSock);
-		return;
+}
+
+// plain tcp sockets are read directly into pooled buffer, ssl ones through worker's decrypt buffer
+// returns the same as ISocket::read - number of bytes, -EAGAIN if there is nothing, 0 or other negative on error
+// plain sockets are read up to limit, more is set if socket may still have data
+// ssl socket decides on its own how much it reads, limits are checked by parser after it
+ssize_t SocketDataHandler::readSocket(const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, size_t limit, bool& more) {
+	more = false;
+	if (!connection.plain) {
+		ssize_t nbytes = clientSock->read(sslInput);
+		if (nbytes > 0) {
+			auto data = sslInput.get();
+			connection.ibuf.append(data);
+		}
+		// emptied after every read, so it is never left with data of another connection
+		sslInput.clear(sslInput.size());
+		return nbytes;
+	}
+	ssize_t total = 0;
+	while (true) {
+		if ((size_t)total >= limit) {
+			// edge-triggered - the rest is read by caller after parsing
+			more = true;
+			return total;
+		}
+		auto space = connection.ibuf.tail(MinReadSpace);
+		ssize_t nbytes = recv(clientSock->fd(), space.data(), std::min(space.size(), limit - total), 0);
+		if (nbytes > 0) {
+			connection.ibuf.commit(nbytes);
+			total += nbytes;
+			continue;
+		}
+		if ((nbytes < 0) && (errno == EINTR)) {
+			continue;
+		}
+		if (total > 0) {
+			// error or eof is reported by the next read
+			return total;
+		}
+		if (connection.ibuf.empty()) {
+			// nothing has come, storage goes back to pool
+			connection.ibuf.release();
+		}
+		if (nbytes == 0) {
+			return 0;
+		}
+		return (errno == EAGAIN) ? -EAGAIN : -errno;
 	}
-	onHttpRequest(epollFd, clientSock, request.message());
-	connection.request = util::web::http::HttpParser<util::web::http::HttpRequest>();
 }
 
-void SocketDataHandler::onError(int epollFd, std::shared_ptr<ISocket> clientSock) {
-	onCloseClient(epollFd, clientSock);
+// header block may grow to its limit, body - to what route allows and sink is able to take
+size_t SocketDataHandler::readLimit(const Connection& connection) const {
+	const auto& parser = connection.parser;
+	size_t limit = MaxReadChunk;
+	if (connection.ws) {
+		return limit;
+	}
+	if (!parser.headersComplete()) {
+		// one byte over limit makes parser reject the request
+		return std::min(limit, Connection::MaxHeaderBlockSize + 1 - std::min(connection.ibuf.size(), Connection::MaxHeaderBlockSize));
+	}
+	if (connection.sink) {
+		size_t space = connection.sink->freeSpace();
+		if (space == 0) {
+			return 0;
+		}
+		limit = std::min(limit, space);
+	}
+	// chunk framing and head of the next pipelined request may follow body
+	return std::min(limit, std::max(parser.bodyAllowance(), MinReadSpace));
 }
 
-bool SocketDataHandler::checkInputBufData(std::string_view sv) {
-	if (
-		sv.size() >= 3 && sv.substr(0, 3) == "GET" ||
-		sv.size() >= 4 && sv.substr(0, 4) == "HEAD" ||
-		sv.size() >= 4 && sv.substr(0, 4) == "POST" ||
-		sv.size() >= 3 && sv.substr(0, 3) == "PUT" ||
-		sv.size() >= 6 && sv.substr(0, 6) == "DELETE" ||
-		sv.size() >= 7 && sv.substr(0, 7) == "CONNECT" ||
-		sv.size() >= 7 && sv.substr(0, 7) == "OPTIONS" ||
-		sv.size() >= 5 && sv.substr(0, 5) == "TRACE" ||
-		sv.size() >= 5 && sv.substr(0, 5) == "PATCH"
-		)
-	{
+// route is known as soon as headers are received, so its body limit is applied and streaming routes get body by pieces
+bool SocketDataHandler::onRequestHeaders(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection) {
+	auto& parser = connection.parser;
+	parser.fill(connection.request);
+	connection.requestStart = nowMicros();
+	connection.requestMethod = connection.request.method;
+	if (accessLog) {
+		connection.requestUrl = connection.request.url;
+	}
+	// kept till request is handled, so route is looked up only once
+	connection.params = RouteParams();
+	connection.params.setHeaders(&parser);
+	auto route = HttpServer::get().findRoute(connection.request, connection.params);
+	connection.route = route;
+	connection.requestRouteId = route ? route->id : 0;
+	size_t maxBodySize = route ? route->options.maxBodySize : RouteOptions::DefaultMaxBodySize;
+	if (parser.contentLength() > maxBodySize) {
+		Log.warning("Request body from {} is too large: {}", clientSock->fd(), parser.contentLength());
+		rejectRequest(epollFd, clientSock, connection, 413);
+		return false;
+	}
+	parser.setBodyLimit(maxBodySize);
+	if (!route || !route->streamHandler) {
 		return true;
 	}
-	return false;
+	Log.debug("{} {}", HttpServer::methodName(connection.request.method), connection.request.url);
+	connection.sink = route->streamHandler(connection.request, connection.params);
+	if (!connection.sink) {
+		rejectRequest(epollFd, clientSock, connection, 400);
+		return false;
+	}
+	connection.sink->resume = [this, epollFd, clientSock]() {
+		threadPool->pushTask(threadIdx, std::function([this](int epollFd, std::shared_ptr<inet::ISocket> clientSock) {
+			if (checkFd(clientSock)) {
+				sockConnection[clientSock->fd()].bodyPaused = false;
+				onInputData(epollFd, clientSock);
+			}
+			return 0;
+			}), epollFd, clientSock);
+		wakeUp();
+		};
+	// body pieces are dropped from ibuf as soon as sink takes them, header views are invalid after it
+	parser.setStreaming(true);
+	connection.params.setHeaders(nullptr);
+	connection.ibuf.clear(parser.release());
+	return true;
+}
+
+// sends bodyless error and closes connection after it, the rest of input is ignored
+void SocketDataHandler::rejectRequest(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, size_t status) {
+	connection.sink.reset();
+	connection.lastRequest = false;
+	connection.closeAfterWrite = true;
+	enqueueResponse(connection, Reply::prebuilt(status, true));
+	__onHttpResponse(epollFd, clientSock, connection);
+}
+
+// switches connection to websocket protocol, frames are sent through the same reply queue, so ssl connections work as well
+void SocketDataHandler::upgradeWebSocket(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection) {
+	auto& parser = connection.parser;
+	auto key = parser.header("Sec-WebSocket-Key");
+	if (!WebSocket::isUpgrade(parser.header("Upgrade"), parser.header("Connection")) || key.empty()) {
+		rejectRequest(epollFd, clientSock, connection, 426);
+		return;
+	}
+	if (parser.header("Sec-WebSocket-Version") != WebSocket::Version) {
+		rejectRequest(epollFd, clientSock, connection, 400);
+		return;
+	}
+	// route and params are resolved with headers
+	auto handler = connection.route->wsHandler(connection.request, connection.params);
+	if (!handler) {
+		rejectRequest(epollFd, clientSock, connection, 403);
+		return;
+	}
+	ReplyHead head(101);
+	// extensions offered by client are not confirmed, so it falls back to plain frames
+	head.add(Header::Upgrade, "websocket").add(Header::Connection, "Upgrade").add(Header::SecWebSocketAccept, WebSocket::acceptKey(key));
+	enqueueResponse(connection, Reply(std::move(head)));
+	Log.info("WebSocket {} on {}", connection.request.url, clientSock->fd());
+	// websocket is owned by connection, so pointer to it is valid whenever callbacks are called
+	auto pConnection = &connection;
+	connection.ws = std::make_unique<WebSocket>(std::move(handler), connection.route->options.maxBodySize,
+		[this, pConnection](std::string&& frame) { enqueue(*pConnection, Reply(0, std::move(frame))); },
+		[this, pConnection](const std::string& topic) { subscribe(*pConnection, topic); });
+	connection.ibuf.clear(parser.consumed());
+	parser.reset();
+	connection.request = HttpRequest();
+	connection.route = nullptr;
+	connection.params = RouteParams();
+	connection.ws->open();
+	onWebSocketData(epollFd, clientSock, connection);
+}
+
+// frames are unmasked right in input buffer, handler's sends are queued and written after all complete frames are handled
+void SocketDataHandler::onWebSocketData(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection) {
+	auto& buf = connection.ibuf;
+	auto bufData = buf.get();
+	size_t consumed = 0;
+	if (!connection.ws->onData((char*)bufData.data(), bufData.size(), consumed)) {
+		Log.warning("Invalid websocket data from {}", clientSock->fd());
+	}
+	buf.clear(consumed);
+	if (connection.ws->closing()) {
+		// nothing may follow close frame
+		connection.broadcasts.clear();
+		connection.closeAfterWrite = true;
+	}
+	else if (connection.queue.size() >= Connection::OutputQueueHighWater) {
+		connection.readPaused = true;
+	}
+	__onHttpResponse(epollFd, clientSock, connection);
+}
 
+void SocketDataHandler::onError(int epollFd, const std::shared_ptr<ISocket>& clientSock) {
+	onCloseClient(epollFd, clientSock);
 }
 
-void SocketDataHandler::onCloseClient(int epollFd, std::shared_ptr<ISocket> clientSock) {
+void SocketDataHandler::onCloseClient(int epollFd, const std::shared_ptr<ISocket>& clientSock) {
 	int fd = clientSock->fd();
 	if (!checkFd(clientSock)) return;
-	Log.error(std::format("Closing connection from server with client {}", clientSock->fd()));
+	Log.debug("Closing connection from server with client {}", clientSock->fd());
 	epoll_ctl(epollFd, EPOLL_CTL_DEL, fd, NULL);
+	if (mapper) {
+		// before close, so a new connection that gets the same fd is not removed
+		mapper->removeFd(fd);
+	}
+	auto& connection = sockConnection[fd];
+	if (admission) {
+		admission->charge(-(int64_t)connection.charged);
+		admission->release(fd);
+	}
+	assigned.fetch_sub(1, std::memory_order_relaxed);
+	workerMetrics->connectionsClosed.add();
 	close(fd);
-	mapper->removeFd(clientSock->fd());
+	retireZeroCopy(connection);
+	if (connection.ws) {
+		connection.ws->disconnected();
+	}
+	unsubscribeAll(connection);
 	sockConnection.erase(fd);
 }
 
-void SocketDataHandler::onHttpRequest(int epollFd, std::shared_ptr<ISocket> clientSock, const util::web::http::HttpRequest& request) {
+void SocketDataHandler::onHttpRequest(int epollFd, const std::shared_ptr<ISocket>& clientSock, const util::web::http::HttpRequest& request, std::string_view body) {
 	int fd = clientSock->fd();
 	// no need to check fd, because it is sequential call from onInputData
 	auto& connection = sockConnection[fd];
@@ -213,106 +602,1186 @@ void SocketDataHandler::onHttpRequest(int epollFd, std::shared_ptr<ISocket> clie
 
 		};*/
 	auto cb = onResponseFromApiCb(epollFd, clientSock);
-	auto response = HttpServer::get().callRoute(request.url, request, cb);
-
-	connection.obuf = OutputSocketBuffer(response.encode());
+	if (connection.route && connection.route->asyncHandler) {
+		// handler may block, so it runs on handler pool, and reply comes back to this thread
+		// handler outlives input buffer, so headers and body are copied
+		auto asyncRequest = std::make_shared<HttpRequest>(request);
+		connection.parser.fillHeaders(*asyncRequest);
+		asyncRequest->body = std::string(body);
+		auto done = [this, epollFd, clientSock](std::shared_ptr<Reply> reply) {
+			threadPool->pushTask(threadIdx, std::function([this](int epollFd, std::shared_ptr<inet::ISocket> clientSock, std::shared_ptr<Reply> reply) {
+				onAsyncReply(epollFd, clientSock, std::move(*reply));
+				return 0;
+				}), epollFd, clientSock, std::move(reply));
+			wakeUp();
+			};
+		if (HttpServer::get().callAsync(*connection.route, std::move(asyncRequest), connection.params, cb, std::move(done))) {
+			connection.awaiting = true;
+			return;
+		}
+		enqueueResponse(connection, Reply::prebuilt(503));
+	}
+	else if (connection.route) {
+		connection.params.setBody(body);
+		enqueueResponse(connection, HttpServer::get().callRoute(*connection.route, request, connection.params, cb));
+	}
+	else {
+		// 404 or 405
+		enqueueResponse(connection, HttpServer::get().callRoute(request.url, request, cb, body));
+	}
 	__onHttpResponse(epollFd, clientSock, connection);
 }
 
-bool SocketDataHandler::onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock, const util::web::http::HttpResponse& response) {
+void SocketDataHandler::onAsyncReply(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Reply&& reply) {
+	if (!checkFd(clientSock)) {
+		// client has gone while handler was running
+		return;
+	}
+	auto& connection = sockConnection[clientSock->fd()];
+	connection.awaiting = false;
+	enqueueResponse(connection, std::move(reply));
+	if (!__onHttpResponse(epollFd, clientSock, connection)) {
+		return;
+	}
+	// continuing with pipelined requests
+	onInputData(epollFd, clientSock);
+}
+
+bool SocketDataHandler::onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, const util::web::http::HttpResponse& response) {
 	int fd = clientSock->fd();
 	if (!checkFd(clientSock)) return false;
 	auto& connection = sockConnection[fd];
-	if (!connection.obuf.empty()) {
-		Log.warning(std::format("Receiveng response from {}, but another response is in process", fd));
-		onError(epollFd, clientSock);
-		return false;
-	}
-	connection.obuf = OutputSocketBuffer(response.encode());
+	enqueue(connection, Reply(response));
 	return __onHttpResponse(epollFd, clientSock, connection);
 }
 
 // can be used for raw-message, for example, for appending to existing http response
-bool SocketDataHandler::onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock, std::string&& response) {
+bool SocketDataHandler::onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, std::string&& response) {
 	int fd = clientSock->fd();
 	if (!checkFd(clientSock)) return false;
 	auto& connection = sockConnection[fd];
-	if (!connection.obuf.empty()) {
-		Log.warning(std::format("Receiveng response from {}, but another response is in process", fd));
-		onError(epollFd, clientSock);
-		return false;
-	}
-	connection.obuf = OutputSocketBuffer(std::move(response));
+	// status is unknown for raw message
+	enqueue(connection, Reply(0, std::move(response)));
 	return __onHttpResponse(epollFd, clientSock, connection);
 }
 
-bool SocketDataHandler::onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock) {
+bool SocketDataHandler::onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock) {
 	int fd = clientSock->fd();
 	if (!checkFd(clientSock)) return false;
 	auto& connection = sockConnection[fd];
-	return __onHttpResponse(epollFd, clientSock, connection);
+	if (!__onHttpResponse(epollFd, clientSock, connection)) {
+		return false;
+	}
+	if (connection.readPaused && (connection.queue.size() < Connection::OutputQueueLowWater)) {
+		// queue is drained enough - continuing with requests left in ibuf and socket
+		connection.readPaused = false;
+		onInputData(epollFd, clientSock);
+	}
+	return true;
 }
 
-bool SocketDataHandler::__onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock, Connection& connection) {
-	auto& obuf = connection.obuf;
-	if (obuf.empty()) return true;
-	ssize_t nbytes = clientSock->write(obuf);
-	if ((nbytes == 0) || ((nbytes < 0) && (nbytes != -EAGAIN))) {
-		// error - closing connection
-		Log.error(clientSock->strerr());
-		onError(epollFd, clientSock);
-		return false;
+// response is sent right away if nothing else is in process, otherwise it waits in queue
+void SocketDataHandler::enqueue(Connection& connection, Reply&& reply) {
+	for (const auto& topic : reply.topics) {
+		subscribe(connection, topic);
+	}
+	if (auto chain = std::get_if<ChainBody>(&reply.body); chain && reply.replay) {
+		connection.replayedId = reply.replay(*chain);
+	}
+	if (connection.lastRequest && (reply.status >= 200)) {
+		if (!reply.statusLine.empty()) {
+			// head is only header lines, terminated by empty line unless the rest of them is in shared body (cached assets)
+			reply.head.insert(reply.head.ends_with("\r\n\r\n") ? reply.head.size() - 2 : reply.head.size(), "Connection: close\r\n");
+		}
+		else if (size_t end = reply.head.find("\r\n\r\n"); end != std::string::npos) {
+			reply.head.insert(end + 2, "Connection: close\r\n");
+		}
+		connection.lastRequest = false;
+		connection.closeAfterWrite = true;
+	}
+	if (connection.writing()) {
+		connection.queue.push_back(std::move(reply));
+		return;
+	}
+	startReply(connection, std::move(reply));
+}
+
+// latency is measured till reply is ready, by route of request, requests without headers (e.g. header timeout) have no latency
+void SocketDataHandler::enqueueResponse(Connection& connection, Reply&& reply) {
+	uint64_t now = nowMicros();
+	workerMetrics->responses[((reply.status >= 100) && (reply.status < 600)) ? reply.status / 100 : 0].add();
+	if (connection.requestStart) {
+		workerMetrics->recordLatency(connection.requestRouteId, now - std::min(now, connection.requestStart));
+	}
+	if (accessLog) {
+		logAccess(connection, reply, now);
 	}
-	else if ((nbytes == EAGAIN) || !(obuf.finished())) {
-		// recoverable error - will try to send again later
-		// NOTE: now outcommented because trying to handle it in EPOLLOUT event
-		//threadPool->pushTask(threadIdx, std::function([this](int epollFd, std::shared_ptr<inet::ISocket> clientSock, const util::web::http::HttpRequest& request) { onHttpResponse(epollFd, clientSock, request); return 0; }), std::move(epollFd), std::move(clientSock), request);
-		;
+	connection.requestStart = 0;
+	enqueue(connection, std::move(reply));
+}
+
+// request is known only if its headers have been received, e.g. header timeout has neither method nor url
+void SocketDataHandler::logAccess(Connection& connection, const Reply& reply, uint64_t now) {
+	AccessRecord record{};
+	record.time = connection.requestStart ? connection.requestStart : now;
+	record.latency = (uint32_t)std::min<uint64_t>(now - record.time, UINT32_MAX);
+	record.status = (uint16_t)reply.status;
+	record.worker = (uint16_t)threadIdx;
+	record.bytes = reply.statusLine.size() + reply.head.size() + std::visit([](const auto& body) -> size_t {
+		using T = std::decay_t<decltype(body)>;
+		if constexpr (std::is_same_v<T, FileBody> || std::is_same_v<T, SharedBody>) {
+			return body.remaining();
+		}
+		else if constexpr (std::is_same_v<T, ChainBody>) {
+			return body.size();
+		}
+		else {
+			return 0;
+		}
+		}, reply.body);
+	if (connection.peer.family == 0) {
+		connection.peer = PeerAddress::of(connection.sock->fd());
+	}
+	connection.peer.copyTo(record);
+	if (connection.requestStart) {
+		auto method = HttpServer::methodName(connection.requestMethod);
+		memcpy(record.method, method.data(), std::min(method.size(), sizeof(record.method)));
+		const auto& url = connection.requestUrl;
+		record.urlSize = (uint16_t)std::min<size_t>(url.size(), UINT16_MAX);
+		memcpy(record.url, url.data(), std::min(url.size(), AccessRecord::UrlCapacity));
+	}
+	if (accessBatch.empty()) {
+		accessBatch.reserve(AccessBatchSize);
+		accessFlushTick = nowTick + ticks(AccessFlushInterval);
+	}
+	accessBatch.push_back(record);
+	if (accessBatch.size() >= AccessBatchSize) {
+		flushAccessLog();
+	}
+}
+
+void SocketDataHandler::flushAccessLog() {
+	if (accessLog && !accessBatch.empty()) {
+		accessLog->write(accessBatch);
+	}
+	accessBatch.clear();
+}
+
+// plain socket gets status line, head and body by reference
+// ssl one has no gathering write, so head is joined with small in-memory replies queued behind it into one record
+void SocketDataHandler::startReply(Connection& connection, Reply&& reply) {
+	connection.body = std::move(reply.body);
+	if (connection.plain) {
+		connection.statusLine = reply.statusLine;
+		connection.out = std::move(reply.head);
+		connection.outSent = 0;
+		return;
+	}
+	std::string data;
+	if (reply.statusLine.empty()) {
+		data = std::move(reply.head);
 	}
 	else {
-		// ok - written all response
-		obuf.clear();
-		//onCloseClient(epollFd, clientSock);
+		data.reserve(reply.statusLine.size() + reply.head.size());
+		data += reply.statusLine;
+		data += reply.head;
 	}
-	if (nbytes > 0) {
-		Log.debug(std::format("Write {} bytes to {}", nbytes, clientSock->fd()));
+	if (auto* shared = std::get_if<SharedBody>(&connection.body); shared && (data.size() + shared->remaining() <= CoalesceSize)) {
+		data.append(shared->data(), shared->remaining());
+		connection.body = std::monostate{};
 	}
-	return true;
+	while (std::holds_alternative<std::monostate>(connection.body) && !connection.queue.empty()) {
+		auto& next = connection.queue.front();
+		auto* shared = std::get_if<SharedBody>(&next.body);
+		if (!shared && !std::holds_alternative<std::monostate>(next.body)) {
+			break;
+		}
+		size_t size = next.statusLine.size() + next.head.size() + (shared ? shared->remaining() : 0);
+		if (data.size() + size > CoalesceSize) {
+			break;
+		}
+		data += next.statusLine;
+		data += next.head;
+		if (shared) {
+			data.append(shared->data(), shared->remaining());
+		}
+		connection.queue.pop_front();
+	}
+	connection.obuf = OutputSocketBuffer(std::move(data));
 }
 
-bool SocketDataHandler::checkFd(std::shared_ptr<ISocket> sock) {
-	// fd may have been already closed
-	if (auto [_sock, threadIdx] = mapper->findThreadIdx(sock->fd()); _sock == nullptr) {
+// makes the next queued reply, or pending broadcast when there are no replies, current one
+// false - nothing is left to send
+bool SocketDataHandler::nextOutput(Connection& connection) {
+	connection.body = std::monostate{};
+	if (!connection.queue.empty()) {
+		auto reply = std::move(connection.queue.front());
+		connection.queue.pop_front();
+		startReply(connection, std::move(reply));
+		return true;
+	}
+	auto& broadcasts = connection.broadcasts;
+	if (broadcasts.empty()) {
 		return false;
 	}
+	// replies go first, then pending broadcasts
+	if (connection.plain || (broadcasts.front().second->size() > CoalesceSize)) {
+		// plain socket gathers following broadcasts itself, big payload to ssl socket is sent by chunks
+		connection.body = SharedBody(std::move(broadcasts.front().second));
+		broadcasts.pop_front();
+		return true;
+	}
+	std::string data;
+	while (!broadcasts.empty() && (data.size() + broadcasts.front().second->size() <= CoalesceSize)) {
+		data += *broadcasts.front().second;
+		broadcasts.pop_front();
+	}
+	connection.obuf = OutputSocketBuffer(std::move(data));
 	return true;
 }
 
+bool SocketDataHandler::__onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection) {
+	auto& obuf = connection.obuf;
+	while (true) {
+		if (connection.plain && gatherable(connection)) {
+			SendResult res = writeGather(epollFd, clientSock, connection);
+			if (res == SendResult::Error) {
+				return false;
+			}
+			if (res == SendResult::Blocked) {
+				workerMetrics->writeBlocked.add();
+				connection.writeBlocked = true;
+				updateConnection(connection);
+				return true;
+			}
+			continue;
+		}
+		if (!obuf.empty()) {
+			ssize_t nbytes = clientSock->write(obuf);
+			if ((nbytes == 0) || ((nbytes < 0) && (nbytes != -EAGAIN))) {
+				// error - closing connection
+				Log.error("{}", clientSock->strerr());
+				onError(epollFd, clientSock);
+				return false;
+			}
+			if (nbytes > 0) {
+				Log.debug("Write {} bytes to {}", nbytes, clientSock->fd());
+				workerMetrics->bytesWritten.add(nbytes);
+				connection.lastWrite = nowTick;
+			}
+			if ((nbytes == -EAGAIN) || !(obuf.finished())) {
+				// recoverable error - will try to send again on EPOLLOUT
+				workerMetrics->writeBlocked.add();
+				connection.writeBlocked = true;
+				updateConnection(connection);
+				return true;
+			}
+			// ok - written all buffered data
+			obuf.clear();
+		}
+		if (bodyFinished(connection.body)) {
+			// current response is sent - taking the next pipelined one
+			if (nextOutput(connection)) {
+				continue;
+			}
+			if (connection.closeAfterWrite) {
+				onCloseClient(epollFd, clientSock);
+				return false;
+			}
+			connection.writeBlocked = false;
+			updateConnection(connection);
+			return true;
+		}
+		SendResult res = std::visit([this, epollFd, &clientSock, &connection](auto& body) {
+			if constexpr (std::is_same_v<std::decay_t<decltype(body)>, std::monostate>) {
+				return SendResult::Progress;
+			}
+			else {
+				return sendBody(epollFd, clientSock, connection, body);
+			}
+			}, connection.body);
+		if (res == SendResult::Error) {
+			return false;
+		}
+		else if ((res == SendResult::Blocked) || (res == SendResult::Waiting)) {
+			// socket buffer is full - will continue on EPOLLOUT, or body producer will trigger sending
+			if (res == SendResult::Blocked) {
+				workerMetrics->writeBlocked.add();
+			}
+			connection.writeBlocked = (res == SendResult::Blocked);
+			updateConnection(connection);
+			return true;
+		}
+	}
+}
+
+// head of current reply or its in-memory body is waiting, big shared bodies are left for zerocopy send
+bool SocketDataHandler::gatherable(const Connection& connection) const {
+	if (connection.pendingHead() > 0) {
+		return true;
+	}
+	auto* shared = std::get_if<SharedBody>(&connection.body);
+	return shared && !shared->finished() && !zeroCopyFor(connection, shared->remaining());
+}
+
+bool SocketDataHandler::zeroCopyFor(const Connection& connection, size_t size) const {
+	return (zeroCopyMinSize > 0) && (size >= zeroCopyMinSize) && (connection.zeroCopy >= 0);
+}
+
+// current reply's head and in-memory body, then whole in-memory replies and broadcasts behind it go out with one sendmsg
+// gathering stops at the first body that has to be sent otherwise (file, stream, zerocopy), so written bytes are consumed in the same order
+SocketDataHandler::SendResult SocketDataHandler::writeGather(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection) {
+	struct iovec iov[MaxGatherPieces];
+	size_t count = 0;
+	size_t total = 0;
+	// body sent right after gathered data, so kernel may hold the last segment for it
+	bool moreFollows = false;
+	auto add = [&iov, &count, &total](const char* data, size_t size) {
+		if (size == 0) {
+			return true;
+		}
+		if ((count == MaxGatherPieces) || (total >= MaxGatherBytes)) {
+			return false;
+		}
+		iov[count++] = { (void*)data, size };
+		total += size;
+		return true;
+		};
+	auto addHead = [&add](std::string_view statusLine, const std::string& head, size_t sent) {
+		if (sent < statusLine.size()) {
+			if (!add(statusLine.data() + sent, statusLine.size() - sent)) {
+				return false;
+			}
+			sent = 0;
+		}
+		else {
+			sent -= statusLine.size();
+		}
+		return add(head.data() + sent, head.size() - sent);
+		};
+	// true - body is gathered completely, so the next reply may follow
+	auto addBody = [this, &add, &connection, &moreFollows](const ReplyBody& body) {
+		if (bodyFinished(body)) {
+			return true;
+		}
+		auto* shared = std::get_if<SharedBody>(&body);
+		if (!shared || zeroCopyFor(connection, shared->remaining())) {
+			moreFollows = !shared ? std::holds_alternative<FileBody>(body) : true;
+			return false;
+		}
+		return add(shared->data(), shared->remaining());
+		};
+	bool more = addHead(connection.statusLine, connection.out, connection.outSent) && addBody(connection.body);
+	for (auto iter = connection.queue.begin(); more && (iter != connection.queue.end()); ++iter) {
+		more = addHead(iter->statusLine, iter->head, 0) && addBody(iter->body);
+	}
+	for (auto iter = connection.broadcasts.begin(); more && (iter != connection.broadcasts.end()); ++iter) {
+		const auto& payload = *iter->second;
+		more = !zeroCopyFor(connection, payload.size()) && add(payload.data(), payload.size());
+	}
+
+	struct msghdr msg {};
+	msg.msg_iov = iov;
+	msg.msg_iovlen = count;
+	ssize_t nbytes;
+	do {
+		nbytes = sendmsg(clientSock->fd(), &msg, MSG_NOSIGNAL | (moreFollows ? MSG_MORE : 0));
+	} while ((nbytes < 0) && (errno == EINTR));
+	if (nbytes < 0) {
+		if (errno == EAGAIN) {
+			return SendResult::Blocked;
+		}
+		Log.error("Error on sendmsg to {}: {}", clientSock->fd(), strerror(errno));
+		onError(epollFd, clientSock);
+		return SendResult::Error;
+	}
+	Log.debug("Write {} bytes in {} pieces to {}", nbytes, count, clientSock->fd());
+	workerMetrics->bytesWritten.add(nbytes);
+	connection.lastWrite = nowTick;
+	consumeOutput(connection, nbytes);
+	// socket buffer has taken only a part - the rest waits for EPOLLOUT
+	return ((size_t)nbytes < total) ? SendResult::Blocked : SendResult::Progress;
+}
+
+// walks written bytes through current reply and the ones gathered after it
+void SocketDataHandler::consumeOutput(Connection& connection, size_t nbytes) {
+	while (true) {
+		size_t n = std::min(nbytes, connection.pendingHead());
+		connection.outSent += n;
+		nbytes -= n;
+		if (connection.pendingHead() == 0) {
+			connection.statusLine = {};
+			connection.out = std::string();
+			connection.outSent = 0;
+		}
+		if (auto* shared = std::get_if<SharedBody>(&connection.body); shared) {
+			n = std::min(nbytes, shared->remaining());
+			shared->advance(n);
+			nbytes -= n;
+		}
+		if (nbytes == 0) {
+			return;
+		}
+		// current reply is written completely, the rest belongs to the next one
+		nextOutput(connection);
+	}
+}
+
+// takes zerocopy completions from socket's error queue and releases buffers kernel is done with
+// false - socket has a real error (or zerocopy isn't used), so error event means closing
+bool SocketDataHandler::reapZeroCopy(Connection& connection) {
+	if (connection.zeroCopy <= 0) {
+		return false;
+	}
+	int fd = connection.sock->fd();
+	while (true) {
+		char control[128];
+		struct msghdr msg {};
+		msg.msg_control = control;
+		msg.msg_controllen = sizeof(control);
+		if (recvmsg(fd, &msg, MSG_ERRQUEUE) < 0) {
+			if (errno == EINTR) continue;
+			// EAGAIN - queue is empty
+			break;
+		}
+		for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+			if (!((cmsg->cmsg_level == SOL_IP) && (cmsg->cmsg_type == IP_RECVERR)) && !((cmsg->cmsg_level == SOL_IPV6) && (cmsg->cmsg_type == IPV6_RECVERR))) {
+				continue;
+			}
+			auto err = (const struct sock_extended_err*)CMSG_DATA(cmsg);
+			if ((err->ee_origin != SO_EE_ORIGIN_ZEROCOPY) || (err->ee_errno != 0)) {
+				return false;
+			}
+			// inclusive range of send ids, they wrap around
+			for (auto& [id, buffer] : connection.zeroCopyHeld) {
+				if ((uint32_t)(id - err->ee_info) <= (uint32_t)(err->ee_data - err->ee_info)) {
+					buffer.reset();
+				}
+			}
+		}
+	}
+	auto& held = connection.zeroCopyHeld;
+	while (!held.empty() && !held.front().second) {
+		held.pop_front();
+	}
+	int error = 0;
+	socklen_t len = sizeof(error);
+	return (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == 0) && (error == 0);
+}
+
+// completions of closed socket never come
+void SocketDataHandler::retireZeroCopy(Connection& connection) {
+	for (auto& [id, buffer] : connection.zeroCopyHeld) {
+		if (buffer) {
+			zeroCopyRetired.emplace_back(nowTick + ticks(ZeroCopyLinger), std::move(buffer));
+		}
+	}
+	connection.zeroCopyHeld.clear();
+}
+
+// sends next part of file body
+// plain tcp sockets get it directly with sendfile, ssl ones - through obuf by chunks
+SocketDataHandler::SendResult SocketDataHandler::sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, FileBody& body) {
+	if (connection.plain) {
+		while (!body.finished()) {
+			off_t offset = body.offset();
+			ssize_t nbytes = sendfile(clientSock->fd(), body.fd(), &offset, std::min(body.remaining(), MaxSendfileChunk));
+			if (nbytes < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return SendResult::Blocked;
+				Log.error("Error on sendfile to {}: {}", clientSock->fd(), strerror(errno));
+				onError(epollFd, clientSock);
+				return SendResult::Error;
+			}
+			if (nbytes == 0) {
+				Log.error("File for {} has been truncated while sending", clientSock->fd());
+				onError(epollFd, clientSock);
+				return SendResult::Error;
+			}
+			Log.debug("Sendfile {} bytes to {}", nbytes, clientSock->fd());
+			workerMetrics->bytesWritten.add(nbytes);
+			body.advance(nbytes);
+			connection.lastWrite = nowTick;
+		}
+		return SendResult::Progress;
+	}
+	std::string chunk(std::min(body.remaining(), FileChunkSize), '\0');
+	ssize_t nbytes = pread(body.fd(), chunk.data(), chunk.size(), body.offset());
+	if (nbytes <= 0) {
+		Log.error("Error on reading file for {}: {}", clientSock->fd(), nbytes < 0 ? strerror(errno) : "truncated");
+		onError(epollFd, clientSock);
+		return SendResult::Error;
+	}
+	chunk.resize(nbytes);
+	body.advance(nbytes);
+	connection.obuf = OutputSocketBuffer(std::move(chunk));
+	return SendResult::Progress;
+}
+
+// sends next part of shared body
+// plain tcp sockets get here only big bodies, sent with zerocopy from shared buffer kept till kernel completes, ssl ones - through obuf by chunks
+SocketDataHandler::SendResult SocketDataHandler::sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, SharedBody& body) {
+	if (connection.plain) {
+		if (connection.zeroCopy == 0) {
+			int one = 1;
+			connection.zeroCopy = (setsockopt(clientSock->fd(), SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0) ? 1 : -1;
+		}
+		int flags = MSG_NOSIGNAL | ((connection.zeroCopy > 0) ? MSG_ZEROCOPY : 0);
+		while (!body.finished()) {
+			ssize_t nbytes = send(clientSock->fd(), body.data(), body.remaining(), flags);
+			if (nbytes < 0) {
+				if (errno == EINTR) continue;
+				if (errno == EAGAIN) return SendResult::Blocked;
+				if ((errno == ENOBUFS) && (flags & MSG_ZEROCOPY)) {
+					// pinned pages are over socket's limit - copying this time
+					flags &= ~MSG_ZEROCOPY;
+					continue;
+				}
+				Log.error("Error on send to {}: {}", clientSock->fd(), strerror(errno));
+				onError(epollFd, clientSock);
+				return SendResult::Error;
+			}
+			if (flags & MSG_ZEROCOPY) {
+				connection.zeroCopyHeld.emplace_back(connection.zeroCopyNext++, body.buffer());
+			}
+			Log.debug("Write {} bytes to {}", nbytes, clientSock->fd());
+			workerMetrics->bytesWritten.add(nbytes);
+			body.advance(nbytes);
+			connection.lastWrite = nowTick;
+		}
+		return SendResult::Progress;
+	}
+	size_t size = std::min(body.remaining(), FileChunkSize);
+	connection.obuf = OutputSocketBuffer(std::string(body.data(), size));
+	body.advance(size);
+	return SendResult::Progress;
+}
+
+// sends next segment of chained body - in-memory segments go through obuf, file ones as usual file body
+SocketDataHandler::SendResult SocketDataHandler::sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, ChainBody& body) {
+	auto& segment = body.front();
+	if (auto* data = std::get_if<std::string>(&segment); data) {
+		if (connection.plain) {
+			connection.out = std::move(*data);
+		}
+		else {
+			connection.obuf = OutputSocketBuffer(std::move(*data));
+		}
+		body.pop();
+		return SendResult::Progress;
+	}
+	auto& file = std::get<FileBody>(segment);
+	if (file.finished()) {
+		body.pop();
+		return SendResult::Progress;
+	}
+	return sendBody(epollFd, clientSock, connection, file);
+}
+
+// sends whatever chunks handler has produced so far
+SocketDataHandler::SendResult SocketDataHandler::sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, StreamBody& body) {
+	auto data = body.take([this, epollFd, clientSock]() {
+		// called from producer's thread
+		threadPool->pushTask(threadIdx, std::function([this](int epollFd, std::shared_ptr<inet::ISocket> clientSock) {
+			onHttpResponse(epollFd, clientSock);
+			return 0;
+			}), epollFd, clientSock);
+		wakeUp();
+		});
+	if (!data.empty()) {
+		if (connection.plain) {
+			connection.out = std::move(data);
+		}
+		else {
+			connection.obuf = OutputSocketBuffer(std::move(data));
+		}
+		return SendResult::Progress;
+	}
+	return body.finished() ? SendResult::Progress : SendResult::Waiting;
+}
+
+void SocketDataHandler::subscribe(Connection& connection, const std::string& topic) {
+	if (std::find(connection.topics.begin(), connection.topics.end(), topic) != connection.topics.end()) {
+		return;
+	}
+	connection.topics.push_back(topic);
+	auto& topicSubscribers = subscribers[topic];
+	topicSubscribers.push_back(connection.sock);
+	if (topicSubscribers.size() == 1) {
+		// broker needs to know only whether this worker has subscribers of topic
+		EventBroker::get().subscribe(topic, threadIdx);
+	}
+}
+
+void SocketDataHandler::unsubscribeAll(Connection& connection) {
+	for (const auto& topic : connection.topics) {
+		auto iter = subscribers.find(topic);
+		if (iter == subscribers.end()) {
+			continue;
+		}
+		std::erase(iter->second, connection.sock);
+		if (iter->second.empty()) {
+			subscribers.erase(iter);
+			EventBroker::get().unsubscribe(topic, threadIdx);
+		}
+	}
+	connection.topics.clear();
+}
+
+void SocketDataHandler::postBroadcast(const std::string& topic, const EventBroker::Payload& payload) {
+	{
+		std::lock_guard<std::mutex> lck(inboxMtx);
+		inbox.emplace_back(topic, payload);
+		if (inboxScheduled) {
+			// task taking the whole inbox is already queued
+			return;
+		}
+		inboxScheduled = true;
+	}
+	threadPool->pushTask(threadIdx, std::function([this]() { deliverBroadcasts(); return 0; }));
+	wakeUp();
+}
+
+// every subscriber shares the same payload buffer
+// slow consumer keeps only MaxPendingBroadcasts, older payload of the same topic is superseded by newer one, otherwise the oldest is dropped
+void SocketDataHandler::queueBroadcast(Connection& connection, const std::string* topic, const EventBroker::Payload& payload) {
+	if (connection.replayedId > 0) {
+		// published while connection was subscribing, it is in replay already
+		uint64_t id = SseChannel::idOf(*payload);
+		if ((id > 0) && (id <= connection.replayedId)) {
+			return;
+		}
+	}
+	auto& broadcasts = connection.broadcasts;
+	if (broadcasts.size() >= Connection::MaxPendingBroadcasts) {
+		auto same = std::find_if(broadcasts.begin(), broadcasts.end(), [topic](const auto& b) { return b.first == topic; });
+		broadcasts.erase((same != broadcasts.end()) ? same : broadcasts.begin());
+	}
+	broadcasts.emplace_back(topic, payload);
+}
+
+void SocketDataHandler::deliverBroadcasts() {
+	std::vector<std::pair<std::string, EventBroker::Payload>> batch;
+	{
+		std::lock_guard<std::mutex> lck(inboxMtx);
+		batch.swap(inbox);
+		inboxScheduled = false;
+	}
+	for (const auto& [topic, payload] : batch) {
+		auto iter = subscribers.find(topic);
+		if (iter == subscribers.end()) {
+			continue;
+		}
+		// sending may close connections and change subscribers list
+		auto topicSubscribers = iter->second;
+		// key stays in map while any of its subscribers is connected
+		const std::string* topicKey = &iter->first;
+		// websocket subscribers get the same text frame
+		EventBroker::Payload wsFrame;
+		for (const auto& clientSock : topicSubscribers) {
+			if (!checkFd(clientSock)) {
+				continue;
+			}
+			auto& connection = sockConnection[clientSock->fd()];
+			if (connection.ws) {
+				if (connection.ws->closing()) {
+					continue;
+				}
+				if (!wsFrame) {
+					wsFrame = std::make_shared<const std::string>(WebSocket::frame(WebSocket::Opcode::Text, *payload));
+				}
+				queueBroadcast(connection, topicKey, wsFrame);
+			}
+			else {
+				queueBroadcast(connection, topicKey, payload);
+			}
+			__onHttpResponse(epollFd, clientSock, connection);
+		}
+	}
+}
+
+void SocketDataHandler::updateConnection(Connection& connection) {
+	updateTimer(connection);
+	chargeMemory(connection);
+}
+
+// buffered input and queued replies are charged, bodies are mostly files or shared buffers
+void SocketDataHandler::chargeMemory(Connection& connection) {
+	if (!admission) {
+		return;
+	}
+	size_t used = Connection::BaseMemory + connection.ibuf.capacity();
+	for (const auto& reply : connection.queue) {
+		used += reply.head.size();
+	}
+	if (used != connection.charged) {
+		admission->charge((int64_t)used - (int64_t)connection.charged);
+		connection.charged = used;
+	}
+}
+
+bool SocketDataHandler::overloaded() const {
+	return admission && (admission->limits().maxQueueDepth > 0) && (queueDepth() > admission->limits().maxQueueDepth);
+}
+
+// phase is derived from connection's state, and only its change restarts timeout
+SocketDataHandler::Connection::Phase SocketDataHandler::currentPhase(Connection& connection) const {
+	using Phase = Connection::Phase;
+	if (connection.writeBlocked) {
+		return Phase::WriteStall;
+	}
+	if (connection.ws && !connection.closeAfterWrite) {
+		// client may be silent for long, but not forever
+		return Phase::WebSocket;
+	}
+	if (connection.closeAfterWrite || connection.awaiting || connection.bodyPaused || connection.readPaused || connection.writing()) {
+		// server side is in charge
+		return Phase::None;
+	}
+	if (connection.parser.headersComplete()) {
+		return Phase::Body;
+	}
+	if (!connection.ibuf.empty()) {
+		return Phase::Header;
+	}
+	// subscribers wait for broadcasts, not for requests
+	return connection.topics.empty() ? Phase::Idle : Phase::None;
+}
+
+// 0 - no deadline
+uint64_t SocketDataHandler::deadline(const Connection& connection) const {
+	using Phase = Connection::Phase;
+	switch (connection.phase) {
+	case Phase::Idle:
+		return (timeouts.idle.count() > 0) ? connection.phaseStart + ticks(timeouts.idle) : 0;
+	case Phase::Header:
+		// not moved by data, so trickling headers doesn't help
+		return (timeouts.headerRead.count() > 0) ? connection.phaseStart + ticks(timeouts.headerRead) : 0;
+	case Phase::Body:
+		return (timeouts.bodyRead.count() > 0) ? std::max(connection.phaseStart, connection.lastRead) + ticks(timeouts.bodyRead) : 0;
+	case Phase::WriteStall:
+		return (timeouts.writeStall.count() > 0) ? std::max(connection.phaseStart, connection.lastWrite) + ticks(timeouts.writeStall) : 0;
+	case Phase::WebSocket:
+		return (timeouts.webSocketIdle.count() > 0) ? std::max(connection.phaseStart, connection.lastRead) + ticks(timeouts.webSocketIdle) : 0;
+	default:
+		return 0;
+	}
+}
+
+// timer is moved only if deadline gets earlier, later deadline is checked when timer fires
+void SocketDataHandler::updateTimer(Connection& connection) {
+	auto phase = currentPhase(connection);
+	if (phase != connection.phase) {
+		connection.phase = phase;
+		connection.phaseStart = nowTick;
+	}
+	uint64_t at = deadline(connection);
+	if (at == 0) {
+		connection.timer.cancel();
+		return;
+	}
+	if (!connection.timer.active() || (connection.timer.expiry() > at)) {
+		connection.timer.key = connection.sock->fd();
+		timers.schedule(connection.timer, at);
+	}
+}
+
+void SocketDataHandler::advanceTimers() {
+	nowTick = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch()) / TimerTick;
+	timers.advance(nowTick, [this](TimerWheel::Timer& timer) { onTimer(timer.key); });
+	while (!zeroCopyRetired.empty() && (zeroCopyRetired.front().first <= nowTick)) {
+		zeroCopyRetired.pop_front();
+	}
+	if (!accessBatch.empty() && (accessFlushTick <= nowTick)) {
+		flushAccessLog();
+	}
+}
+
+void SocketDataHandler::onTimer(int fd) {
+	using Phase = Connection::Phase;
+	auto iter = sockConnection.find(fd);
+	if (iter == sockConnection.end()) {
+		return;
+	}
+	auto& connection = iter->second;
+	uint64_t at = deadline(connection);
+	if (at == 0) {
+		return;
+	}
+	if (at > nowTick) {
+		// there has been progress since timer was set
+		timers.schedule(connection.timer, at);
+		return;
+	}
+	auto clientSock = connection.sock;
+	workerMetrics->timeouts.add();
+	switch (connection.phase) {
+	case Phase::Header:
+	case Phase::Body:
+		Log.warning("Request from {} has timed out", fd);
+		rejectRequest(epollFd, clientSock, connection, 408);
+		break;
+	case Phase::Idle:
+		Log.debug("Idle connection {} has timed out", fd);
+		onCloseClient(epollFd, clientSock);
+		break;
+	case Phase::WebSocket:
+		Log.debug("Idle websocket {} has timed out", fd);
+		// close frame goes first, connection is closed once it is written
+		connection.ws->close(WebSocket::CloseGoingAway);
+		connection.broadcasts.clear();
+		connection.closeAfterWrite = true;
+		__onHttpResponse(epollFd, clientSock, connection);
+		break;
+	default:
+		Log.warning("Client {} doesn't read response, closing connection", fd);
+		onCloseClient(epollFd, clientSock);
+		break;
+	}
+}
+
+uint64_t SocketDataHandler::ticks(std::chrono::milliseconds timeout) const {
+	return std::max<uint64_t>(1, (timeout + TimerTick - std::chrono::milliseconds(1)) / TimerTick);
+}
+
+bool SocketDataHandler::isPlainTcp(const inet::ISocket* sock) {
+	return (dynamic_cast<const inet::TcpNonblockingSocket*>(sock) != nullptr) && (dynamic_cast<const inet::SslTcpNonblockingSocket*>(sock) == nullptr);
+}
+
+bool SocketDataHandler::checkFd(const std::shared_ptr<ISocket>& sock) {
+	// fd may have been already closed, or even reused by another connection
+	auto iter = sockConnection.find(sock->fd());
+	return (iter != sockConnection.end()) && (iter->second.sock == sock);
+}
+
+void SocketDataHandler::collectMetrics(MetricsWriter& writer, const std::vector<const SocketDataHandler*>& workers) {
+	std::vector<std::string> labels;
+	for (auto worker : workers) {
+		labels.push_back(MetricsWriter::label("worker", std::to_string(worker->threadIdx)));
+	}
+	auto counter = [&writer, &workers, &labels](std::string_view name, std::string_view help, LocalCounter WorkerMetrics::* member) {
+		writer.family(name, "counter", help);
+		for (size_t i = 0; i < workers.size(); ++i) {
+			writer.sample(name, labels[i], (workers[i]->metrics().*member).get());
+		}
+		};
+	counter("http_connections_opened_total", "Connections taken by worker.", &WorkerMetrics::connectionsOpened);
+	counter("http_connections_closed_total", "Connections closed by worker.", &WorkerMetrics::connectionsClosed);
+	counter("http_read_bytes_total", "Bytes read from sockets.", &WorkerMetrics::bytesRead);
+	counter("http_written_bytes_total", "Bytes written to sockets.", &WorkerMetrics::bytesWritten);
+	counter("http_read_eagain_total", "Reads finding socket empty.", &WorkerMetrics::readEagain);
+	counter("http_write_blocked_total", "Writes stopped by full socket buffer, continued on EPOLLOUT.", &WorkerMetrics::writeBlocked);
+	counter("http_parse_errors_total", "Requests that failed to parse.", &WorkerMetrics::parseErrors);
+	counter("http_timeouts_total", "Connections timed out.", &WorkerMetrics::timeouts);
+	counter("http_overloaded_total", "Requests answered with 503 because worker's queue was too long.", &WorkerMetrics::overloaded);
+	writer.family("http_responses_total", "counter", "Responses by status class.");
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const auto& responses = workers[i]->metrics().responses;
+		for (size_t cls = 0; cls < responses.size(); ++cls) {
+			auto code = MetricsWriter::label("code", (cls == 0) ? std::string("other") : std::to_string(cls) + "xx");
+			writer.sample("http_responses_total", labels[i] + "," + code, responses[cls].get());
+		}
+	}
+	writer.family("http_worker_connections", "gauge", "Open connections of worker.");
+	for (size_t i = 0; i < workers.size(); ++i) {
+		const auto& metrics = workers[i]->metrics();
+		writer.sample("http_worker_connections", labels[i], metrics.connectionsOpened.get() - std::min(metrics.connectionsOpened.get(), metrics.connectionsClosed.get()));
+	}
+	writer.family("http_worker_queue_depth", "gauge", "Socket events waiting for worker.");
+	for (size_t i = 0; i < workers.size(); ++i) {
+		writer.sample("http_worker_queue_depth", labels[i], (uint64_t)workers[i]->queueDepth());
+	}
+	// histograms of workers are added together, route is known to all of them
+	writer.family("http_request_duration_seconds", "histogram", "Time from request headers till reply is ready.");
+	auto names = HttpServer::get().routeNames();
+	for (size_t route = 0; route < std::min(names.size(), WorkerMetrics::MaxRoutes); ++route) {
+		LatencySnapshot snapshot;
+		bool recorded = false;
+		for (auto worker : workers) {
+			if (auto histogram = worker->metrics().latency(route); histogram) {
+				snapshot.add(*histogram);
+				recorded = true;
+			}
+		}
+		if (recorded) {
+			writer.histogram("http_request_duration_seconds", MetricsWriter::label("route", names[route]), snapshot);
+		}
+	}
+}
+
 void SocketDataHandler::run() {
+	EventBroker::get().registerWorker(threadIdx, [this](const std::string& topic, const EventBroker::Payload& payload) { postBroadcast(topic, payload); });
 	thread = std::move(std::jthread([this](std::stop_token stop) {
+		std::stop_callback onStop(stop, [this]() { wakeUp(); });
 		while (!stop.stop_requested()) {
-			TaskT task;
-			if (tasksQueue.popWaitFor(task, std::chrono::milliseconds(1000))) {
-				task.first(task.second);
+			uint64_t seq = wakeSeq.load();
+			advanceTimers();
+			bool worked = drainEvents();
+			worked = drainTasks() || worked;
+			if (!worked) {
+				// producer checks this flag after bumping wakeSeq, so either we see new seq or it notifies us
+				sleeping = true;
+				if (wakeSeq.load() == seq && !stop.stop_requested()) {
+					// waking up on the next tick while there are timers
+					if (timers.empty() && zeroCopyRetired.empty() && accessBatch.empty()) {
+						wakeSem.acquire();
+					}
+					else {
+						wakeSem.try_acquire_for(TimerTick);
+					}
+				}
+				sleeping = false;
 			}
 		}
+		flushAccessLog();
 		}));
 }
 
-std::pair<SocketThreadMapper::SockT, size_t> SocketThreadMapper::findThreadIdx(int fd) {
-	std::shared_lock<std::shared_mutex> lck(mtx);
-	if (auto iter = map.find(fd); iter == map.end()) {
-		return { nullptr, 0 };
+// worker's own epoll loop: accepts from listenSock and does all io on this thread
+// runs as a task on worker thread and returns only when stop is requested
+void SocketDataHandler::serve(const inet::SslTcpNonblockingSocket& listenSock) {
+	int epollFd = epoll_create1(0);
+	if (epollFd < 0) {
+		Log.error("Worker {}: error while creating epoll: {}", threadIdx, strerror(errno));
+		return;
 	}
-	else {
-		return iter->second;
+	int evFd = eventfd(0, EFD_NONBLOCK);
+	if (evFd < 0) {
+		Log.error("Worker {}: error while creating eventfd: {}", threadIdx, strerror(errno));
+		close(epollFd);
+		return;
+	}
+	struct epoll_event event, events[MAX_EPOLL_EVENTS];
+	event.events = EPOLLIN | EPOLLET;
+	event.data.fd = listenSock.fd();
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock.fd(), &event) < 0) {
+		Log.error("Worker {}: error on epoll ctl: {}", threadIdx, strerror(errno));
+		close(evFd);
+		close(epollFd);
+		return;
+	}
+	event.data.fd = evFd;
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, evFd, &event);
+	setEpollFd(epollFd);
+	wakeFd = evFd;
+	// tasks could have been pushed before eventfd was set
+	advanceTimers();
+	drainTasks();
+
+	auto stop = thread.get_stop_token();
+	// listening socket is out of epoll while server is over admission limits
+	bool acceptPaused = false;
+	while (!stop.stop_requested()) {
+		// waking up from time to time to check for stop, on every tick while there are timers, and to retry paused accept
+		auto timeout = (timers.empty() && zeroCopyRetired.empty() && accessBatch.empty()) ? std::chrono::milliseconds(1000) : TimerTick;
+		if (acceptPaused) {
+			timeout = std::min(timeout, acceptRetryInterval);
+		}
+		int numEvents = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, (int)timeout.count());
+		if (numEvents < 0) {
+			if (errno == EINTR) continue;
+			Log.error("Worker {}: error on epoll {} waiting: {}", threadIdx, epollFd, strerror(errno));
+			break;
+		}
+		advanceTimers();
+		if (acceptPaused && admission->canAccept()) {
+			// connections waiting in backlog make listening socket ready right away
+			event.events = EPOLLIN | EPOLLET;
+			event.data.fd = listenSock.fd();
+			if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock.fd(), &event) == 0) {
+				Log.info("Worker {}: resuming accept", threadIdx);
+				acceptPaused = false;
+			}
+		}
+		for (int i = 0; i < numEvents; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == listenSock.fd()) {
+				onAccept(epollFd, listenSock);
+				if (admission && !admission->canAccept()) {
+					// the rest stays in backlog until memory or connections are freed
+					Log.warning("Worker {}: server is over limits, pausing accept", threadIdx);
+					epoll_ctl(epollFd, EPOLL_CTL_DEL, listenSock.fd(), NULL);
+					acceptPaused = true;
+				}
+				continue;
+			}
+			else if (fd == evFd) {
+				uint64_t cnt = 0;
+				while (read(evFd, &cnt, sizeof(cnt)) > 0) {
+					;
+				}
+				drainTasks();
+				continue;
+			}
+			auto iter = sockConnection.find(fd);
+			if (iter == sockConnection.end()) {
+				// already closed
+				continue;
+			}
+			auto clientSock = iter->second.sock;
+			if (events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
+				if ((events[i].events & (EPOLLHUP | EPOLLRDHUP)) || !reapZeroCopy(iter->second)) {
+					onError(epollFd, clientSock);
+					continue;
+				}
+				// only zerocopy completions are reported
+				events[i].events |= EPOLLIN | EPOLLOUT;
+			}
+			if (events[i].events & EPOLLIN) {
+				onInputData(epollFd, clientSock);
+			}
+			if ((events[i].events & EPOLLOUT) && checkFd(clientSock)) {
+				// continuing to write response, previously stopped on EAGAIN 
+				onHttpResponse(epollFd, clientSock);
+			}
+		}
+	}
+
+	wakeFd.exchange(-1);
+	// wakeUp() that has already taken the fd must finish writing before it is closed and possibly reused
+	while (wakers.load() > 0) {
+		std::this_thread::yield();
+	}
+	flushAccessLog();
+	for (auto& [fd, connection] : sockConnection) {
+		if (admission) {
+			admission->charge(-(int64_t)connection.charged);
+			admission->release(fd);
+		}
+		close(fd);
+	}
+	assigned = 0;
+	sockConnection.clear();
+	for (const auto& [topic, _] : subscribers) {
+		EventBroker::get().unsubscribe(topic, threadIdx);
+	}
+	subscribers.clear();
+	setEpollFd(-1);
+	close(evFd);
+	close(epollFd);
+}
+
+void SocketDataHandler::onAccept(int epollFd, const inet::SslTcpNonblockingSocket& listenSock) {
+	auto [errOccured, clientFds] = listenSock.acceptAll();
+	if (clientFds.empty() || errOccured) {
+		Log.error("{}", listenSock.strerr());
+	}
+	for (auto& errCliendFdPair : clientFds) {
+		auto& clientSock = errCliendFdPair.second;
+		int fd = clientSock->fd();
+		if (admission && !admission->admit(fd)) {
+			Log.warning("Worker {}: connection {} is over limits, closing it", threadIdx, fd);
+			close(fd);
+			continue;
+		}
+		struct epoll_event event;
+		event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLHUP | EPOLLRDHUP | EPOLLERR;
+		event.data.fd = fd;
+		if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+			Log.error("Failed to add client socket to epoll instance: {}", strerror(errno));
+			if (admission) {
+				admission->release(fd);
+			}
+			close(fd);
+			continue;
+		}
+		onAssigned();
+		workerMetrics->connectionsOpened.add();
+		Log.debug("Worker {} handling client {}", threadIdx, fd);
+		sockConnection[fd].sock = clientSock;
+		sockConnection[fd].plain = isPlainTcp(clientSock.get());
+		updateConnection(sockConnection[fd]);
 	}
 }
-void SocketThreadMapper::addThreadIdx(int fd, SockT sock, size_t threadIdx) {
-	std::unique_lock<std::shared_mutex> lck(mtx);
-	map[fd] = { sock, threadIdx };
+
+bool SocketDataHandler::drainEvents() {
+	bool worked = false;
+	SocketEvent event;
+	while (events->pop(event)) {
+		onEvent(event);
+		worked = true;
+	}
+	return worked;
 }
+
+bool SocketDataHandler::drainTasks() {
+	bool worked = false;
+	TaskT task;
+	while (tasksQueue.popWaitFor(task, std::chrono::milliseconds(0))) {
+		task.first(task.second);
+		worked = true;
+	}
+	return worked;
+}
+
+// must be called after anything has been pushed to this worker
+void SocketDataHandler::wakeUp() {
+	// counted before fd is taken, so serve() doesn't close fd while it is written
+	wakers.fetch_add(1);
+	if (int fd = wakeFd.load(); fd >= 0) {
+		uint64_t one = 1;
+		write(fd, &one, sizeof(one));
+		wakers.fetch_sub(1);
+		return;
+	}
+	wakers.fetch_sub(1);
+	wakeSeq.fetch_add(1);
+	if (sleeping.load()) {
+		wakeSem.release();
+	}
+}
+
+SocketThreadMapper::SocketThreadMapper(size_t maxFds) {
+	if (maxFds == 0) {
+		rlimit lim;
+		maxFds = ((getrlimit(RLIMIT_NOFILE, &lim) == 0) && (lim.rlim_cur != RLIM_INFINITY)) ? lim.rlim_cur : MaxTableSize;
+	}
+	size = std::min(maxFds, MaxTableSize);
+	slots = std::make_unique<Slot[]>(size);
+}
+
+SocketThreadMapper::Entry SocketThreadMapper::unpack(uint64_t state) {
+	return { (state & 1) != 0, (size_t)((state & 0xFFFFFFFF) >> 1), (uint32_t)(state >> 32) };
+}
+
+SocketThreadMapper::Entry SocketThreadMapper::findThreadIdx(int fd) const {
+	if ((fd < 0) || ((size_t)fd >= size)) {
+		return {};
+	}
+	return unpack(slots[fd].state.load(std::memory_order_acquire));
+}
+
+SocketThreadMapper::Entry SocketThreadMapper::addThreadIdx(int fd, SockT sock, size_t threadIdx) {
+	if ((fd < 0) || ((size_t)fd >= size)) {
+		return {};
+	}
+	auto& slot = slots[fd];
+	uint32_t epoch = (uint32_t)(slot.state.load(std::memory_order_acquire) >> 32) + 1;
+	slot.sock = std::move(sock);
+	uint64_t state = ((uint64_t)epoch << 32) | ((uint64_t)threadIdx << 1) | 1;
+	slot.state.store(state, std::memory_order_release);
+	return unpack(state);
+}
+
+// socket is written before state is published, so the one of matching epoch is taken
+SocketThreadMapper::SockT SocketThreadMapper::takeSock(int fd, uint32_t epoch) {
+	if ((fd < 0) || ((size_t)fd >= size)) {
+		return nullptr;
+	}
+	auto& slot = slots[fd];
+	auto entry = unpack(slot.state.load(std::memory_order_acquire));
+	if (!entry.valid || (entry.epoch != epoch)) {
+		return nullptr;
+	}
+	return std::move(slot.sock);
+}
+
 void SocketThreadMapper::removeFd(int fd) {
-	std::unique_lock<std::shared_mutex> lck(mtx);
-	map.erase(fd);
-}
\ No newline at end of file
+	if ((fd < 0) || ((size_t)fd >= size)) {
+		return;
+	}
+	auto& slot = slots[fd];
+	slot.sock.reset();
+	// keeping epoch, so next connection gets a new one
+	slot.state.store(slot.state.load(std::memory_order_relaxed) & ~(uint64_t)1, std::memory_order_release);
+}
@@ -1,19 +1,61 @@
 #pragma once
 #include "Mt/ThreadPool.hpp"
 #include <optional>
-#include <shared_mutex>
+#include <atomic>
 #include <unordered_map>
+#include <deque>
+#include <chrono>
+#include <semaphore>
 #include "Socket.hpp"
+#include "SslTcpNonblockingSocket.hpp"
 #include "Http.hpp"
 #include "HttpServer.hpp"
+#include "SpscRing.hpp"
+#include "RequestParser.hpp"
+#include "EventBroker.hpp"
+#include "TimerWheel.hpp"
+#include "AdmissionControl.hpp"
+#include "BufferPool.hpp"
+#include "AccessLog.hpp"
+#include "Metrics.hpp"
 
 class SocketThreadMapper;
 
+// limits of connection's life, zero disables limit
+struct ConnectionTimeouts {
+	// from the first byte of request till the end of its headers, protects from slowloris
+	std::chrono::milliseconds headerRead{ 10000 };
+	// without any body data while request body is expected
+	std::chrono::milliseconds bodyRead{ 30000 };
+	// keep-alive connection waiting for the next request
+	std::chrono::milliseconds idle{ 60000 };
+	// client doesn't read response, so nothing can be written
+	std::chrono::milliseconds writeStall{ 30000 };
+	// websocket without any frame from client, pongs to application's pings keep it open
+	std::chrono::milliseconds webSocketIdle{ 300000 };
+	// connection is closed after response to so many requests
+	size_t maxRequests = 1000;
+};
+
+// compact socket event passed from dispatcher to worker without any allocations
+struct SocketEvent {
+	enum class Kind : uint8_t {
+		Input,
+		Output,
+		Error
+	};
+	int fd;
+	Kind kind;
+	// epoch of connection at the moment of event, to distinguish it from connection that reused the same fd
+	uint32_t epoch;
+};
+
 class SocketDataHandler {
 public:
 	using TaskT = std::pair<std::packaged_task<std::any(std::any&)>, std::any>;
 	using QueueT = util::mt::SafeQueue<TaskT>;
 	using ThreadPoolT = util::mt::RollingThreadPool<SocketDataHandler>;
+	using EventRingT = SpscRing<SocketEvent, 4096>;
 	SocketDataHandler(QueueT&& tasksQueue, ThreadPoolT* ptp, size_t threadIdx);
 	SocketDataHandler(const SocketDataHandler&) = delete;
 	SocketDataHandler& operator=(const SocketDataHandler&) = delete;
@@ -24,50 +66,303 @@ public:
 	void join();
 	QueueT& queue();
 	void setMapper(SocketThreadMapper* _mapper);
-	void onInputData(int epollFd, std::shared_ptr<inet::ISocket> sock);
-	void onError(int epollFd, std::shared_ptr<inet::ISocket> sock);
-	bool onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock, const util::web::http::HttpResponse& response);
-	bool onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock, std::string&& msg);
-	bool onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock);
+	void setEpollFd(int _epollFd);
+	// must be called before serving
+	void setTimeouts(const ConnectionTimeouts& _timeouts);
+	// in serve mode paused accept is retried every retryInterval
+	void setAdmission(AdmissionControl* _admission, std::chrono::milliseconds retryInterval = AcceptRetryInterval);
+	// shared bodies of at least minSize bytes are sent to plain tcp sockets with MSG_ZEROCOPY, 0 - never
+	void setZeroCopy(size_t minSize);
+	// nullptr - no access log
+	void setAccessLog(AccessLog* _accessLog);
+	// connection is handed over to this worker by dispatcher
+	inline void onAssigned() { assigned.fetch_add(1, std::memory_order_relaxed); }
+	// connections and socket events not handled yet, may be used from any thread
+	inline size_t load() const { return assigned.load(std::memory_order_relaxed) + events->size() + overflowed.load(std::memory_order_relaxed); }
+	// socket events waiting for worker, may be used from any thread
+	inline size_t queueDepth() const { return events->size() + overflowed.load(std::memory_order_relaxed); }
+	inline const WorkerMetrics& metrics() const { return *workerMetrics; }
+	// families of all workers' metrics, samples of every family are grouped
+	static void collectMetrics(MetricsWriter& writer, const std::vector<const SocketDataHandler*>& workers);
+	// fast path for socket events, must be called only from dispatcher thread
+	void pushEvent(SocketEvent event);
+	void onEvent(SocketEvent event);
+	void onInputData(int epollFd, const std::shared_ptr<inet::ISocket>& sock);
+	void onError(int epollFd, const std::shared_ptr<inet::ISocket>& sock);
+	bool onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, const util::web::http::HttpResponse& response);
+	bool onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, std::string&& msg);
+	bool onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock);
 	void run();
+	void serve(const inet::SslTcpNonblockingSocket& listenSock);
+	void wakeUp();
+	// called by EventBroker from publisher's thread, broadcasts are batched until worker takes them
+	void postBroadcast(const std::string& topic, const EventBroker::Payload& payload);
 private:
 
 	struct Connection {
-		// limiting max input buffer size to prevent tons of garbage data sent from user
-		static constexpr size_t MaxIbufSize = 100 * 1024;
+		// limiting size of request line and headers to prevent tons of garbage data sent from user, body limits are per route
+		static constexpr size_t MaxHeaderBlockSize = 100 * 1024;
+		// reading of pipelined requests is paused when so many responses are waiting, and resumed below low water
+		static constexpr size_t OutputQueueHighWater = 32;
+		static constexpr size_t OutputQueueLowWater = 8;
+		// broadcasts waiting while slow consumer reads previous ones
+		static constexpr size_t MaxPendingBroadcasts = 64;
+		// rough estimate of socket buffers and tls state, charged for every connection
+		static constexpr size_t BaseMemory = 16 * 1024;
 
-		inet::InputSocketBuffer ibuf;
-		size_t lastReadOffset = 0;
-		util::web::http::HttpParser<util::web::http::HttpRequest> request;
-		size_t bodyStartPos = 0;
+		// storage is borrowed from worker's pool while there is unhandled input
+		InputBuffer ibuf;
+		RequestParser parser;
+		// filled when headers are received
+		util::web::http::HttpRequest request;
+		// consumer of body for streaming routes
+		std::unique_ptr<BodySink> sink;
+		// sink has asked to stop reading
+		bool bodyPaused = false;
+		// after rejected request nothing is read, connection is closed once response is sent
+		bool closeAfterWrite = false;
+		// route of current request, known after headers
+		const HttpServer::Route* route = nullptr;
+		// captures of route, views into request's url and route pattern
+		RouteParams params;
+		// async handler is running, next requests wait for it
+		bool awaiting = false;
+		// EventBroker topics connection is subscribed to
+		std::vector<std::string> topics;
+		// sse events up to this id are sent by reply's replay, their broadcasts are skipped
+		uint64_t replayedId = 0;
+		// payloads to be sent when queue is empty, topic points to key of subscribers
+		std::deque<std::pair<const std::string*, EventBroker::Payload>> broadcasts;
+		// set after upgrade, everything read then is websocket frames
+		std::unique_ptr<WebSocket> ws;
+		// what connection is waiting for, deadline depends on it
+		enum class Phase : uint8_t {
+			// nothing, e.g. async handler or body producer
+			None,
+			Idle,
+			Header,
+			Body,
+			WriteStall,
+			WebSocket
+		};
+		Phase phase = Phase::None;
+		// ticks
+		uint64_t phaseStart = 0;
+		uint64_t lastRead = 0;
+		uint64_t lastWrite = 0;
+		// rearmed lazily - progress only moves deadline, timer checks it when fired
+		TimerWheel::Timer timer;
+		// socket buffer is full, write-stall timeout applies
+		bool writeBlocked = false;
+		size_t requests = 0;
+		// reply to this request gets "Connection: close"
+		bool lastRequest = false;
+		// memory charged to admission control
+		size_t charged = 0;
+		// microseconds since epoch when headers of request being answered were received, 0 - none
+		uint64_t requestStart = 0;
+		// of request being answered, kept apart from request, which is reset before async reply comes
+		size_t requestRouteId = 0;
+		util::web::http::Method requestMethod = util::web::http::Method::GET;
+		// filled only while access log is written
+		std::string requestUrl;
+		// resolved with the first access record
+		PeerAddress peer;
 
+		// plain tcp sockets are written directly with sendmsg/sendfile, ssl ones through obuf
+		bool plain = false;
+		// head of current reply to plain socket - shared status line and headers, outSent counts bytes of both
+		std::string_view statusLine;
+		std::string out;
+		size_t outSent = 0;
+		// ssl only
 		inet::OutputSocketBuffer obuf;
+		// sent after head
+		ReplyBody body;
+		// 1 - SO_ZEROCOPY is enabled, -1 - socket doesn't support it
+		int8_t zeroCopy = 0;
+		// id of the next zerocopy send, kernel counts them per socket
+		uint32_t zeroCopyNext = 0;
+		// buffers of zerocopy sends not completed by kernel yet, by send id
+		std::deque<std::pair<uint32_t, std::shared_ptr<const std::string>>> zeroCopyHeld;
+		// pipelined responses waiting for the current one, in order of requests
+		std::deque<Reply> queue;
+		bool readPaused = false;
+		std::shared_ptr<inet::ISocket> sock;
+		uint32_t epoch = 0;
+
+		inline size_t pendingHead() const { return statusLine.size() + out.size() - outSent; }
+		inline bool writing() const { return !obuf.empty() || (pendingHead() > 0) || !std::holds_alternative<std::monostate>(body); }
 	};
 
-	bool checkInputBufData(std::string_view sv);
-	bool __onHttpResponse(int epollFd, std::shared_ptr<inet::ISocket> clientSock, Connection& connection);
-	void onCloseClient(int epollFd, std::shared_ptr<inet::ISocket> sock);
-	void onHttpRequest(int epollFd, std::shared_ptr<inet::ISocket> clientSock, const util::web::http::HttpRequest& request);
-	bool checkFd(std::shared_ptr<inet::ISocket> sock);
+	// limiting bytes per sendfile call
+	static constexpr size_t MaxSendfileChunk = 1024 * 1024;
+	// chunk size for bodies sent through ssl
+	static constexpr size_t FileChunkSize = 64 * 1024;
+	// free space ensured in input buffer before every recv
+	static constexpr size_t MinReadSpace = 4 * 1024;
+	// input is parsed after every such read, so limits are checked before buffer grows further
+	static constexpr size_t MaxReadChunk = 64 * 1024;
+	// connection having more is read further by a task, after other connections of worker
+	static constexpr size_t MaxReadPerEvent = 1024 * 1024;
+	// limits of one gathering write to plain socket
+	static constexpr size_t MaxGatherPieces = 64;
+	static constexpr size_t MaxGatherBytes = 256 * 1024;
+	// small replies and broadcasts to ssl socket are joined into one write up to this size
+	static constexpr size_t CoalesceSize = 16 * 1024;
+	// access records are passed to log by such batches, or once a second
+	static constexpr size_t AccessBatchSize = 256;
+	static constexpr std::chrono::milliseconds AccessFlushInterval{ 1000 };
+	// buffers of closed connection may still be read by kernel while the rest of data goes out
+	static constexpr std::chrono::milliseconds ZeroCopyLinger{ 10000 };
+
+	static constexpr int MAX_EPOLL_EVENTS = 100;
+	// timeouts are checked with such precision
+	static constexpr std::chrono::milliseconds TimerTick{ 250 };
+	static constexpr std::chrono::milliseconds AcceptRetryInterval{ 100 };
+
+	bool __onHttpResponse(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection);
+	void enqueue(Connection& connection, Reply&& reply);
+	// reply to request, counted in metrics and goes to access log
+	void enqueueResponse(Connection& connection, Reply&& reply);
+	void logAccess(Connection& connection, const Reply& reply, uint64_t now);
+	void flushAccessLog();
+	void startReply(Connection& connection, Reply&& reply);
+	bool nextOutput(Connection& connection);
+	bool gatherable(const Connection& connection) const;
+	bool zeroCopyFor(const Connection& connection, size_t size) const;
+	void consumeOutput(Connection& connection, size_t nbytes);
+	bool reapZeroCopy(Connection& connection);
+	void retireZeroCopy(Connection& connection);
+	bool onRequestHeaders(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection);
+	void subscribe(Connection& connection, const std::string& topic);
+	void unsubscribeAll(Connection& connection);
+	void deliverBroadcasts();
+	void queueBroadcast(Connection& connection, const std::string* topic, const EventBroker::Payload& payload);
+	void onAsyncReply(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Reply&& reply);
+	void rejectRequest(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, size_t status);
+	void upgradeWebSocket(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection);
+	void onWebSocketData(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection);
+	void readInput(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock);
+	bool parseInput(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection);
+	ssize_t readSocket(const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, size_t limit, bool& more);
+	size_t readLimit(const Connection& connection) const;
+	// called after io, when connection's state may have changed
+	void updateConnection(Connection& connection);
+	void updateTimer(Connection& connection);
+	void chargeMemory(Connection& connection);
+	// too many socket events are waiting, requests are answered with 503
+	bool overloaded() const;
+	Connection::Phase currentPhase(Connection& connection) const;
+	uint64_t deadline(const Connection& connection) const;
+	void advanceTimers();
+	void onTimer(int fd);
+	uint64_t ticks(std::chrono::milliseconds timeout) const;
+	enum class SendResult {
+		// connection is closed
+		Error,
+		// socket buffer is full
+		Blocked,
+		// something has been sent or moved to obuf
+		Progress,
+		// body has nothing to send yet - producer will resume sending
+		Waiting
+	};
+	SendResult writeGather(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection);
+	SendResult sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, FileBody& body);
+	SendResult sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, SharedBody& body);
+	SendResult sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, ChainBody& body);
+	SendResult sendBody(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, Connection& connection, StreamBody& body);
+	static bool isPlainTcp(const inet::ISocket* sock);
+	void onCloseClient(int epollFd, const std::shared_ptr<inet::ISocket>& sock);
+	void onHttpRequest(int epollFd, const std::shared_ptr<inet::ISocket>& clientSock, const util::web::http::HttpRequest& request, std::string_view body);
+	bool checkFd(const std::shared_ptr<inet::ISocket>& sock);
+	void onAccept(int epollFd, const inet::SslTcpNonblockingSocket& listenSock);
+	bool drainEvents();
+	bool drainTasks();
 	QueueT tasksQueue;
+	// socket events go here, while tasksQueue is used for arbitrary closures
+	std::unique_ptr<EventRingT> events;
+	// events sent by slow path after ring has been full and not handled yet
+	std::atomic<size_t> overflowed = 0;
 	ThreadPoolT* threadPool = nullptr;
 	size_t threadIdx;
 	std::jthread thread;
+	// ssl sockets of this worker decrypt into it, data is moved to connection's ibuf right away, so idle connections keep no buffer
+	inet::InputSocketBuffer sslInput;
+	// must outlive connections, their timers are linked into it
+	TimerWheel timers;
+	// current tick, taken once per loop iteration
+	uint64_t nowTick = 0;
+	ConnectionTimeouts timeouts;
+	size_t zeroCopyMinSize = 0;
+	// buffers of closed connections with zerocopy sends, released at tick
+	std::deque<std::pair<uint64_t, std::shared_ptr<const std::string>>> zeroCopyRetired;
+	// own aligned allocation, so it shares cache lines with nothing written by other threads
+	std::unique_ptr<WorkerMetrics> workerMetrics;
+	AccessLog* accessLog = nullptr;
+	std::vector<AccessRecord> accessBatch;
+	// batch is flushed at this tick even if it is not full
+	uint64_t accessFlushTick = 0;
 	std::unordered_map<int, Connection> sockConnection;
-	//int epollFd;
 	std::mutex mtx;
 	SocketThreadMapper* mapper = nullptr;
+	AdmissionControl* admission = nullptr;
+	std::chrono::milliseconds acceptRetryInterval = AcceptRetryInterval;
+	// epoll connections of this worker are in - dispatcher's one, or own in serve mode
+	int epollFd = -1;
+	// eventfd to wake up own epoll loop when tasks are pushed (serve mode only)
+	std::atomic<int> wakeFd = -1;
+	// wakeUp() calls that may be using wakeFd
+	std::atomic<int> wakers = 0;
+	// bumped on every push, checked before going to sleep
+	std::atomic<uint64_t> wakeSeq = 0;
+	std::atomic<bool> sleeping = false;
+	// worker sleeps on it, with timeout while any timer is active
+	std::counting_semaphore<> wakeSem{ 0 };
+	// connections of this worker, read by dispatcher
+	alignas(64) std::atomic<size_t> assigned = 0;
 	std::function<std::function<void(size_t, std::variant<util::web::http::HttpResponse, std::string>)>(int, std::shared_ptr<inet::ISocket>)> onResponseFromApiCb;
+	// subscribed connections by topic, touched only by worker's thread
+	std::unordered_map<std::string, std::vector<std::shared_ptr<inet::ISocket>>> subscribers;
+	// broadcasts posted by publishers, taken by one task
+	std::mutex inboxMtx;
+	std::vector<std::pair<std::string, EventBroker::Payload>> inbox;
+	bool inboxScheduled = false;
 
 };
 
+// maps client fd to worker thread which handles it
+// flat table indexed by fd, so lookups are wait-free and don't touch socket's refcount
 class SocketThreadMapper {
 public:
 	using SockT = std::shared_ptr<inet::ISocket>;
-	std::pair<SockT, size_t> findThreadIdx(int fd);
-	void addThreadIdx(int fd, SockT sock, size_t threadIdx);
+	struct Entry {
+		bool valid = false;
+		size_t threadIdx = 0;
+		// generation of slot, changes every time fd gets reused
+		uint32_t epoch = 0;
+	};
+	// maxFds == 0 - table size is taken from RLIMIT_NOFILE
+	SocketThreadMapper(size_t maxFds = 0);
+	Entry findThreadIdx(int fd) const;
+	// returns invalid entry if fd doesn't fit into table
+	Entry addThreadIdx(int fd, SockT sock, size_t threadIdx);
+	// hands socket over to worker, may be called only by thread which owns fd
+	// nullptr if slot doesn't hold connection of this epoch anymore
+	SockT takeSock(int fd, uint32_t epoch);
+	// must be called before fd is closed, otherwise it may remove the next connection with the same fd
 	void removeFd(int fd);
+	inline size_t capacity() const { return size; }
 private:
-	std::shared_mutex mtx;
-	std::unordered_map<int, std::pair<SockT, size_t>> map;
-};
+	static constexpr size_t MaxTableSize = 1 << 20;
+	struct Slot {
+		// epoch << 32 | threadIdx << 1 | occupied
+		std::atomic<uint64_t> state = 0;
+		// written by dispatcher before publishing state, then taken by worker
+		SockT sock;
+	};
+	static Entry unpack(uint64_t state);
+	std::unique_ptr<Slot[]> slots;
+	size_t size = 0;
+};
\ No newline at end of file
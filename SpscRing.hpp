@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <type_traits>
+
+// bounded lock-free single producer / single consumer ring
+// push() may be called only from one thread and pop() only from another one
+template<typename T, size_t Capacity>
+class SpscRing {
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "capacity must be power of 2");
+	static_assert(std::is_trivially_copyable_v<T>, "ring is meant for plain records");
+public:
+	SpscRing() = default;
+	SpscRing(const SpscRing&) = delete;
+	SpscRing& operator=(const SpscRing&) = delete;
+
+	// returns false if ring is full
+	bool push(const T& val) {
+		size_t tail = _tail.load(std::memory_order_relaxed);
+		if (tail - headCache == Capacity) {
+			headCache = _head.load(std::memory_order_acquire);
+			if (tail - headCache == Capacity) {
+				return false;
+			}
+		}
+		buf[tail & Mask] = val;
+		_tail.store(tail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// returns false if ring is empty
+	bool pop(T& val) {
+		size_t head = _head.load(std::memory_order_relaxed);
+		if (head == tailCache) {
+			tailCache = _tail.load(std::memory_order_acquire);
+			if (head == tailCache) {
+				return false;
+			}
+		}
+		val = buf[head & Mask];
+		_head.store(head + 1, std::memory_order_release);
+		return true;
+	}
+
+	// approximate, may be used from any thread
+	size_t size() const {
+		return _tail.load(std::memory_order_relaxed) - _head.load(std::memory_order_relaxed);
+	}
+
+	static constexpr size_t capacity() { return Capacity; }
+
+private:
+	static constexpr size_t Mask = Capacity - 1;
+	static constexpr size_t CacheLine = 64;
+
+	// consumer side
+	alignas(CacheLine) std::atomic<size_t> _head = 0;
+	size_t tailCache = 0;
+	// producer side
+	alignas(CacheLine) std::atomic<size_t> _tail = 0;
+	size_t headCache = 0;
+
+	alignas(CacheLine) T buf[Capacity];
+};
@@ -0,0 +1,89 @@
+#include "SseChannel.hpp"
+#include <charconv>
+
+SseChannel::SseChannel(std::string topic, size_t historySize)
+	: _topic{ std::move(topic) }
+{
+	history.resize(historySize);
+}
+
+uint64_t SseChannel::publish(std::string_view data, std::string_view event) {
+	EventBroker::Payload payload;
+	uint64_t id = 0;
+	{
+		std::lock_guard<std::mutex> lck(mtx);
+		id = nextId++;
+		payload = std::make_shared<const std::string>(encode(id, event, data));
+		if (!history.empty()) {
+			history[pos] = { id, payload };
+			pos = (pos + 1) % history.size();
+		}
+	}
+	EventBroker::get().publish(_topic, std::move(payload));
+	return id;
+}
+
+bool SseChannel::replay(uint64_t lastId, ChainBody& body, uint64_t& lastReplayed) const {
+	std::lock_guard<std::mutex> lck(mtx);
+	if (lastId >= nextId) {
+		// id from the future (given before restart or forged) - nothing to replay and nothing to skip
+		lastReplayed = 0;
+		return true;
+	}
+	lastReplayed = lastId;
+	if (lastId + 1 == nextId) {
+		return true;
+	}
+	// oldest event is at pos, unless ring is not filled yet
+	bool complete = false;
+	for (size_t i = 0; i < history.size(); ++i) {
+		const auto& [id, payload] = history[(pos + i) % history.size()];
+		if (!payload) {
+			continue;
+		}
+		if (id == lastId + 1) {
+			complete = true;
+		}
+		if (id > lastId) {
+			body.append(std::string(*payload));
+			lastReplayed = id;
+		}
+	}
+	return complete;
+}
+
+uint64_t SseChannel::idOf(std::string_view encoded) {
+	if (!encoded.starts_with("id: ")) {
+		return 0;
+	}
+	encoded.remove_prefix(4);
+	uint64_t id = 0;
+	auto [ptr, ec] = std::from_chars(encoded.data(), encoded.data() + encoded.size(), id);
+	return ((ec == std::errc()) && (ptr != encoded.data() + encoded.size()) && (*ptr == '\n')) ? id : 0;
+}
+
+// multiline data is split into several "data:" fields
+std::string SseChannel::encode(uint64_t id, std::string_view event, std::string_view data) {
+	std::string res;
+	res.reserve(data.size() + event.size() + 32);
+	res += "id: ";
+	res += std::to_string(id);
+	res += '\n';
+	if (!event.empty()) {
+		res += "event: ";
+		res += event;
+		res += '\n';
+	}
+	while (true) {
+		size_t nl = data.find('\n');
+		res += "data: ";
+		res += data.substr(0, nl);
+		res += '\n';
+		if (nl == std::string_view::npos) {
+			break;
+		}
+		data.remove_prefix(nl + 1);
+	}
+	res += '\n';
+	return res;
+}
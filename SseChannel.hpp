@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <chrono>
+#include "EventBroker.hpp"
+#include "Reply.hpp"
+
+// server-sent events stream published to EventBroker topic
+// events are numbered, encoded once and kept in ring buffer, so reconnecting clients get what they missed by Last-Event-ID
+class SseChannel {
+public:
+	SseChannel(std::string topic, size_t historySize = DefaultHistorySize);
+	// returns id of event, may be called from any thread
+	uint64_t publish(std::string_view data, std::string_view event = {});
+	// appends events newer than lastId to body, false if some of them are not in history anymore
+	// lastReplayed is set to id of the last appended event, or to lastId if there are none
+	// for lastId this channel has never given lastReplayed is 0, so no broadcast is skipped
+	bool replay(uint64_t lastId, ChainBody& body, uint64_t& lastReplayed) const;
+	inline const std::string& topic() const { return _topic; }
+	static std::string encode(uint64_t id, std::string_view event, std::string_view data);
+	// id of encoded event, 0 for anything else (e.g. heartbeat)
+	static uint64_t idOf(std::string_view encoded);
+	static constexpr size_t DefaultHistorySize = 256;
+	// every sse connection is subscribed to it, heartbeat is one publish for all of them
+	static constexpr std::string_view HeartbeatTopic = "sse:heartbeat";
+	static constexpr std::chrono::seconds HeartbeatInterval{ 15 };
+private:
+	std::string _topic;
+	mutable std::mutex mtx;
+	std::vector<std::pair<uint64_t, EventBroker::Payload>> history;
+	// next position in history to be overwritten
+	size_t pos = 0;
+	uint64_t nextId = 1;
+};
@@ -6,6 +6,12 @@
 
 using namespace inet::tcp;
 
+#ifdef __GLIBC_PREREQ
+#if __GLIBC_PREREQ(2, 35)
+#define HAVE_EPOLL_PWAIT2 1
+#endif
+#endif
+
 AddrInfo::AddrInfo(std::string_view ipv4, uint16_t port) 
 	: _sAddr{ipv4.data(), ipv4.size()}, _port{port}
 {
@@ -16,14 +22,14 @@ AddrInfo::AddrInfo(std::string_view ipv4, uint16_t port)
 	_addr.sin_port = htons(port);
 }
 
-TcpServer::Options::Options(bool _nonBlock) 
-	: nonBlock{_nonBlock}
+TcpServer::Options::Options(bool _nonBlock, BatchPolicy _batchPolicy, DispatchMode _dispatchMode) 
+	: nonBlock{_nonBlock}, batchPolicy{_batchPolicy}, dispatchMode{_dispatchMode}
 {
 	;
 }
 
 TcpServer::TcpServer(std::string_view ipv4, uint16_t port, Options&& _opts)
-	: serverFd{ socket(AF_INET, SOCK_STREAM | (_opts.nonBlock ? SOCK_NONBLOCK : 0), 0) }, serverSock{std::shared_ptr<ISocket>(new SocketT(serverFd)), 0}, addrInfo(ipv4, port), opts{std::move(_opts)}, socketMapper{}, threadPool{}
+	: serverFd{ socket(AF_INET, SOCK_STREAM | (_opts.nonBlock ? SOCK_NONBLOCK : 0), 0) }, serverSock{std::shared_ptr<ISocket>(new SocketT(serverFd)), 0}, addrInfo(ipv4, port), opts{std::move(_opts)}, socketMapper{}, admission{}, threadPool{}
 {
 	if (init() < 0) {
 		throw std::runtime_error("Server init error");
@@ -33,68 +39,121 @@ TcpServer::TcpServer(std::string_view ipv4, uint16_t port, Options&& _opts)
 	}
 }
 
+TcpServer::~TcpServer() {
+	Metrics::get().detach(this);
+}
+
 int TcpServer::init() {
 	Log.debug("Server creating socket");
 	if (serverFd < 0) {
-		Log.error(std::format("Error while creating socket: {}", strerror(errno)));
+		Log.error("Error while creating socket: {}", strerror(errno));
 		return -1;
 	}
+	if (opts.maxEpollEvents == 0) {
+		Log.error("Options::maxEpollEvents must not be zero");
+		return -1;
+	}
+	admission.setLimits(opts.limits);
+	if (!opts.accessLogPath.empty()) {
+		accessLog = std::make_unique<AccessLog>(opts.accessLogPath, opts.accessLogSegmentSize);
+	}
 	for (size_t i = 0; i < threadPool.size(); ++i) {
-		threadPool.getThreadObj(i).setMapper(&socketMapper);
+		threadPool.getThreadObj(i).setTimeouts(opts.timeouts);
+		threadPool.getThreadObj(i).setAdmission(&admission, opts.acceptRetryInterval);
+		threadPool.getThreadObj(i).setZeroCopy(opts.zeroCopyMinSize);
+		threadPool.getThreadObj(i).setAccessLog(accessLog.get());
 	}
+	if (opts.dispatchMode == DispatchMode::Dispatcher) {
+		// in ReusePort mode every worker tracks only its own connections
+		for (size_t i = 0; i < threadPool.size(); ++i) {
+			threadPool.getThreadObj(i).setMapper(&socketMapper);
+		}
+	}
+	Metrics::get().attach(this, [this](MetricsWriter& writer) { collectMetrics(writer); });
 	return 0;
 }
 
-int TcpServer::run() {
+void TcpServer::collectMetrics(MetricsWriter& writer) {
+	std::vector<const SocketDataHandler*> workers;
+	for (size_t i = 0; i < threadPool.size(); ++i) {
+		workers.push_back(&threadPool.getThreadObj(i));
+	}
+	SocketDataHandler::collectMetrics(writer, workers);
+	writer.family("http_admitted_connections", "gauge", "Connections counted by admission control.");
+	writer.sample("http_admitted_connections", {}, (uint64_t)admission.connections());
+	writer.family("http_buffered_bytes", "gauge", "Estimated memory of connection buffers.");
+	writer.sample("http_buffered_bytes", {}, (uint64_t)std::max<int64_t>(admission.memoryUsed(), 0));
+}
+
+int TcpServer::setupListeningSocket(int fd, bool reusePort) {
 	int opt = 1;
-	serverSock.init();
-	if (setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
-		Log.error(std::format("Error while setting SO_REUSEADDR to socket {}: {}", serverFd, strerror(errno)));
-		serverClose();
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0) {
+		Log.error("Error while setting SO_REUSEADDR to socket {}: {}", fd, strerror(errno));
 		return -1;
 	}
-
-	if (!opts.nonBlock) {
-		Log.warning("WARNING: only non-blocking operations are now permitted, opts.nonBlocking option has no effect for now");
+	if (reusePort && setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+		Log.error("Error while setting SO_REUSEPORT to socket {}: {}", fd, strerror(errno));
+		return -1;
 	}
 
 	//if (opts.nonBlock) {
-		if (fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL, 0) | O_NONBLOCK) < 0) {
-			Log.error(std::format("Error while setting O_NONBLOCK to socket {}: {}", serverFd, strerror(errno)));
-			serverClose();
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK) < 0) {
+			Log.error("Error while setting O_NONBLOCK to socket {}: {}", fd, strerror(errno));
 			return -1;
 		}
 	//}
 
-	Log.debug(std::format("Server binding socket {} on ip {} and port {}", serverFd, addrInfo.sAddr(), addrInfo.port()));
+	Log.debug("Server binding socket {} on ip {} and port {}", fd, addrInfo.sAddr(), addrInfo.port());
 	const auto& addr = addrInfo.sockAddr();
-	if (bind(serverFd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
-		Log.error(std::format("Error while binding socket {}: {}", serverFd, strerror(errno)));
-		serverClose();
+	if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+		Log.error("Error while binding socket {}: {}", fd, strerror(errno));
 		return -1;
 	}
 
-	Log.debug(std::format("Server listening socket {}", serverFd));
-	if (listen(serverFd, MAX_LISTENING_CLIENTS) < 0) {
-		Log.error(std::format("Error while listening socket {}: {}", serverFd, strerror(errno)));
+	Log.debug("Server listening socket {}", fd);
+	if (listen(fd, MAX_LISTENING_CLIENTS) < 0) {
+		Log.error("Error while listening socket {}: {}", fd, strerror(errno));
+		return -1;
+	}
+	return 0;
+}
+
+int TcpServer::run() {
+	serverSock.init();
+
+	if (!opts.nonBlock) {
+		Log.warning("WARNING: only non-blocking operations are now permitted, opts.nonBlocking option has no effect for now");
+	}
+
+	bool reusePort = opts.dispatchMode == DispatchMode::ReusePort;
+	if (setupListeningSocket(serverFd, reusePort) < 0) {
 		serverClose();
 		return -1;
 	}
 
+	if (reusePort) {
+		return runReusePort();
+	}
+
 	Log.debug("Server creating epoll");
 	epollFd = epoll_create1(0);
 	if (epollFd < 0) {
-		Log.error(std::format("Error while creating epoll: {}", strerror(errno)));
+		Log.error("Error while creating epoll: {}", strerror(errno));
 		serverClose();
 		return -1;
 	}
 
+	for (size_t i = 0; i < threadPool.size(); ++i) {
+		threadPool.getThreadObj(i).setEpollFd(epollFd);
+	}
+
 	Log.debug("Server epoll_ctl");
-	struct epoll_event event, events[MAX_EPOLL_EVENTS];
+	struct epoll_event event;
+	std::vector<epoll_event> events(std::min<size_t>(MAX_EPOLL_EVENTS, opts.maxEpollEvents));
 	event.events = EPOLLIN | EPOLLET | EPOLLOUT | EPOLLHUP | EPOLLRDHUP | EPOLLERR ;
 	event.data.fd = serverFd;
 	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverFd, &event) < 0) {
-		Log.error(std::format("Error on epoll ctl", strerror(errno)));
+		Log.error("Error on epoll ctl: {}", strerror(errno));
 		serverClose();
 		return -1;
 	}
@@ -105,76 +164,85 @@ int TcpServer::run() {
 	//uint32_t len = sizeof(ss);
 	//int err = getsockopt(serverFd, SOL_SOCKET, SO_RCVBUF, (char*)&ss, &len);
 
+	size_t lastBatchSize = 0;
 	while (true) {
-		int numEvents = epoll_wait(epollFd, events, MAX_EPOLL_EVENTS, -1);
+		// while paused, waking up to check whether connections or memory have been freed
+		int numEvents = collectEvents(events, lastBatchSize, acceptPaused ? std::chrono::microseconds(opts.acceptRetryInterval) : std::chrono::microseconds(-1));
 		if (numEvents < 0) {
-			Log.error(std::format("Error on epoll {} waiting: {}", epollFd, strerror(errno)));
+			Log.error("Error on epoll {} waiting: {}", epollFd, strerror(errno));
 			serverClose();
 			return -1;
 		}
-		//Log.debug(std::format("Recv {} events", numEvents));
+		if (acceptPaused && admission.canAccept()) {
+			resumeAccept();
+		}
+		//Log.debug("Recv {} events", numEvents);
+		lastBatchSize = numEvents;
 		for (int i = 0; i < numEvents; ++i) {
 			if (events[i].data.fd == serverFd) {
 				// handle new connections
 				auto [errOccured, clientFds] = serverSock.acceptAll();
 				if (clientFds.empty() || errOccured) {
-					Log.error(serverSock.strerr());
+					Log.error("{}", serverSock.strerr());
 				}
-				for (auto errCliendFdPair : clientFds) {
+				for (auto& errCliendFdPair : clientFds) {
 					auto& clientFd = errCliendFdPair.second;
 					int fd = clientFd->fd();
+					if (!admission.admit(fd)) {
+						Log.warning("Client {} is over connection limits, closing connection", fd);
+						close(fd);
+						continue;
+					}
+					// registering before epoll_ctl, so there are no events for unknown fds
+					size_t threadIdx = pickWorker();
+					if (!socketMapper.addThreadIdx(fd, clientFd, threadIdx).valid) {
+						Log.error("Client fd {} exceeds connection table size {}, closing connection", fd, socketMapper.capacity());
+						admission.release(fd);
+						close(fd);
+						continue;
+					}
 					event.events = EPOLLIN | EPOLLOUT | EPOLLET | EPOLLHUP | EPOLLRDHUP | EPOLLERR;
 					event.data.fd = fd;
 					if (epoll_ctl(epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
-						Log.error(std::format("Failed to add client socket to epoll instance", strerror(errno)));
+						Log.error("Failed to add client socket to epoll instance: {}", strerror(errno));
+						socketMapper.removeFd(fd);
+						admission.release(fd);
 						close(fd);
 						break;
 					}
-					Log.debug(std::format("Handling client {}", fd));
-
-					size_t threadIdx = threadPool.getIdx();
-					socketMapper.addThreadIdx(fd, clientFd, threadIdx);
+					threadPool.getThreadObj(threadIdx).onAssigned();
+					Log.debug("Handling client {}", fd);
+				}
+				if (!admission.canAccept()) {
+					pauseAccept();
 				}
 			}
 			else {
-				std::shared_ptr<ISocket> clientSock = nullptr;
-				size_t threadIdx = 0;
-				if (auto [sock, idx] = socketMapper.findThreadIdx(events[i].data.fd); sock != nullptr) {
-					threadIdx = idx;
-					clientSock = sock;
-					//Log.debug(std::format("Got existing idx {} for fd {}", threadIdx, clientFd));
-				}
-				else {
-					int fd = events[i].data.fd;
-					Log.error(std::format("Unknown fd {}, closing connection", fd));
-					epoll_ctl(epollFd, EPOLL_CTL_DEL,fd, NULL);
-					close(fd);
+				int fd = events[i].data.fd;
+				auto entry = socketMapper.findThreadIdx(fd);
+				if (!entry.valid) {
+					// worker has already removed it and is closing it, fd must not be touched here
+					Log.debug("Event for closed fd {}, skipping", fd);
 					continue;
 				}
-				auto& threadCtx = threadPool.getThreadObj(threadIdx);
+				SocketEvent::Kind kind;
 				if (events[i].events & (EPOLLHUP | EPOLLRDHUP | EPOLLERR)) {
-					threadPool.pushTask(threadIdx, std::function([&threadCtx](int epollFd, std::shared_ptr<inet::ISocket> clientSock) { threadCtx.onError(epollFd, clientSock); return 0; }), std::move(epollFd), std::move(clientSock));
-					//threadCtx.onError(epollFd, clientSock);
-
-					//Log.error(std::format("Client connection closed {}", clientSock.fd()));
-					//epoll_ctl(epollFd, EPOLL_CTL_DEL, clientFd, NULL);
-					//close(clientFd);
-					continue;
+					kind = SocketEvent::Kind::Error;
 				}
 				else if (events[i].events & EPOLLIN) {
-					threadPool.pushTask(threadIdx, std::function([&threadCtx](int epollFd, std::shared_ptr<inet::ISocket> clientSock) { threadCtx.onInputData(epollFd, clientSock); return 0; }), std::move(epollFd), std::move(clientSock));
-					//Log.debug(std::format("Queue size is {} for idx {}", threadCtx.queue().size(), threadIdx));
-					//threadCtx.onInputData(epollFd, clientSock);
+					kind = SocketEvent::Kind::Input;
 				}
 				else if (events[i].events & EPOLLOUT) {
 					// continuing to write response, previously stopped on EAGAIN 
-					threadPool.pushTask(threadIdx, std::function([&threadCtx](int epollFd, std::shared_ptr<inet::ISocket> clientSock) { threadCtx.onHttpResponse(epollFd, clientSock); return 0; }), std::move(epollFd), std::move(clientSock));
+					kind = SocketEvent::Kind::Output;
 				}
+				else {
+					continue;
+				}
+				threadPool.getThreadObj(entry.threadIdx).pushEvent({ fd, kind, entry.epoch });
 				continue;
 			}
 		}
-		// cooldown sleep to reduce number of small events
-		std::this_thread::sleep_for(std::chrono::milliseconds(10));
 	}
 
 
@@ -182,8 +250,165 @@ int TcpServer::run() {
 	return 0;
 }
 
+// waits for events and places them to events starting from offset
+// negative timeout means infinite waiting, zero - just polling
+int TcpServer::waitEvents(std::vector<epoll_event>& events, size_t offset, std::chrono::microseconds timeout) {
+	int maxEvents = (int)(events.size() - offset);
+	int res = 0;
+	if (timeout.count() <= 0) {
+		res = epoll_wait(epollFd, events.data() + offset, maxEvents, timeout.count() < 0 ? -1 : 0);
+	}
+	else {
+		bool waited = false;
+#ifdef HAVE_EPOLL_PWAIT2
+		if (!noPwait2) {
+			timespec ts{ (time_t)(timeout.count() / 1000000), (long)(timeout.count() % 1000000) * 1000 };
+			res = epoll_pwait2(epollFd, events.data() + offset, maxEvents, &ts, NULL);
+			waited = (res >= 0) || (errno != ENOSYS);
+			if (!waited) {
+				// kernel older than 5.11, remembered so the failing call isn't repeated
+				Log.warning("epoll_pwait2 is not supported by kernel, waiting with millisecond precision");
+				noPwait2 = true;
+			}
+		}
+#endif
+		if (!waited) {
+			// no sub-millisecond waiting available, rounding up
+			res = epoll_wait(epollFd, events.data() + offset, maxEvents, (int)((timeout.count() + 999) / 1000));
+		}
+	}
+	if (res < 0 && errno == EINTR) {
+		return 0;
+	}
+	return res;
+}
+
+// returns number of collected events or -1 on error, 0 only if nothing has come during maxWait
+int TcpServer::collectEvents(std::vector<epoll_event>& events, size_t lastBatchSize, std::chrono::microseconds maxWait) {
+	using Clock = std::chrono::steady_clock;
+	bool smallBatch = lastBatchSize < opts.smallBatchSize;
+	int res = 0;
+	size_t numEvents = 0;
+
+	if (opts.batchPolicy == BatchPolicy::BusyPoll && smallBatch) {
+		// load is low - spinning for a while to catch next event without sleeping in kernel
+		auto deadline = Clock::now() + opts.busyPollTimeout;
+		do {
+			res = waitEvents(events, 0, std::chrono::microseconds(0));
+		} while (res == 0 && Clock::now() < deadline);
+		if (res < 0) return -1;
+		numEvents = res;
+	}
+
+	while (numEvents == 0) {
+		if (res = waitEvents(events, 0, maxWait); res < 0) return -1;
+		numEvents = res;
+		if (maxWait.count() >= 0) {
+			break;
+		}
+	}
+
+	// nothing has come during maxWait - caller is waiting for timeout, not for events
+	if (numEvents > 0 && opts.batchPolicy == BatchPolicy::Adaptive && numEvents < std::min(opts.smallBatchSize, events.size()) && opts.coalesceTimeout.count() > 0) {
+		// small batch - giving a chance for more events to come and handling them together
+		if (res = waitEvents(events, numEvents, opts.coalesceTimeout); res < 0) return -1;
+		numEvents += res;
+	}
+
+	// buffer is full - there may be more ready events, growing buffer and draining them without blocking
+	while (numEvents == events.size() && events.size() < opts.maxEpollEvents) {
+		events.resize(std::min(events.size() * 2, opts.maxEpollEvents));
+		if (res = waitEvents(events, numEvents, std::chrono::microseconds(0)); res <= 0) break;
+		numEvents += res;
+	}
+
+	// load has dropped - giving memory back
+	if ((events.size() > MAX_EPOLL_EVENTS) && (numEvents < events.size() / 4)) {
+		events.resize(std::max<size_t>(events.size() / 2, MAX_EPOLL_EVENTS));
+	}
+
+	return (int)numEvents;
+}
+
+// power of two choices - less loaded of two random workers, cheap and doesn't send everything to one idle worker
+size_t TcpServer::pickWorker() {
+	size_t count = threadPool.size();
+	if (count < 2) {
+		return 0;
+	}
+	pickSeed ^= pickSeed << 13;
+	pickSeed ^= pickSeed >> 7;
+	pickSeed ^= pickSeed << 17;
+	size_t first = pickSeed % count;
+	size_t second = (pickSeed >> 32) % (count - 1);
+	if (second >= first) {
+		++second;
+	}
+	return (threadPool.getThreadObj(second).load() < threadPool.getThreadObj(first).load()) ? second : first;
+}
+
+// connections wait in backlog, and are accepted once limits allow it
+void TcpServer::pauseAccept() {
+	if (acceptPaused) {
+		return;
+	}
+	Log.warning("Server is over limits ({} connections, {} bytes buffered), pausing accept", admission.connections(), admission.memoryUsed());
+	epoll_ctl(epollFd, EPOLL_CTL_DEL, serverFd, NULL);
+	acceptPaused = true;
+}
+
+void TcpServer::resumeAccept() {
+	struct epoll_event event;
+	event.events = EPOLLIN | EPOLLET | EPOLLOUT | EPOLLHUP | EPOLLRDHUP | EPOLLERR;
+	event.data.fd = serverFd;
+	if (epoll_ctl(epollFd, EPOLL_CTL_ADD, serverFd, &event) < 0) {
+		Log.error("Error on resuming accept: {}", strerror(errno));
+		return;
+	}
+	Log.info("Resuming accept");
+	acceptPaused = false;
+}
+
+int TcpServer::runReusePort() {
+	Log.debug("Server starting {} workers with own epoll loops", threadPool.size());
+	for (size_t i = 0; i < threadPool.size(); ++i) {
+		const SslSocketT* listenSock = &serverSock;
+		if (i > 0) {
+			int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+			if (fd < 0) {
+				Log.error("Error while creating socket: {}", strerror(errno));
+				serverClose();
+				return -1;
+			}
+			auto sock = std::make_shared<SslSocketT>(std::shared_ptr<ISocket>(new SocketT(fd)), 0);
+			reusePortSocks.push_back(sock);
+			sock->init();
+			if (setupListeningSocket(fd, true) < 0) {
+				serverClose();
+				return -1;
+			}
+			listenSock = sock.get();
+		}
+		auto& threadCtx = threadPool.getThreadObj(i);
+		threadPool.pushTask(i, std::function([&threadCtx, listenSock]() { threadCtx.serve(*listenSock); return 0; }));
+		threadCtx.wakeUp();
+	}
+
+	for (size_t i = 0; i < threadPool.size(); ++i) {
+		threadPool.getThreadObj(i).join();
+	}
+	serverClose();
+	return 0;
+}
+
 void TcpServer::serverClose() {
-	Log.debug(std::format("Closing server socket {}", serverFd));
+	Log.debug("Closing server socket {}", serverFd);
+	// workers may be gone after it, e.g. when constructor throws
+	Metrics::get().detach(this);
 	if (serverFd >= 0) close(serverFd);
 	if (epollFd >= 0) close(epollFd);
+	for (auto& sock : reusePortSocks) {
+		close(sock->fd());
+	}
+	reusePortSocks.clear();
 }
\ No newline at end of file
@@ -9,6 +9,8 @@
 #include <string_view>
 #include <source_location>
 #include <thread>
+#include <chrono>
+#include <vector>
 #include "Socket.hpp"
 #include "TcpNonblockingSocket.hpp"
 #include "SslTcpNonblockingSocket.hpp"
@@ -37,15 +39,60 @@ namespace inet::tcp {
 		using SocketT = TcpNonblockingSocket;
 		using SslSocketT = SslTcpNonblockingSocket;
 
+		// how acceptor loop waits for and drains epoll events
+		enum class BatchPolicy {
+			// block in epoll_wait until something happens
+			Blocking,
+			// block, but after a small batch linger for up to coalesceTimeout to gather more events
+			// trades up to coalesceTimeout of latency for fewer wakeups, so it is worth it only under steady load
+			Adaptive,
+			// after a small batch spin with zero-timeout polls for up to busyPollTimeout before blocking
+			BusyPoll
+		};
+
+		// who owns epoll and does socket io
+		enum class DispatchMode {
+			// single acceptor thread owns epoll and passes events to workers
+			Dispatcher,
+			// every worker has its own SO_REUSEPORT listening socket and epoll, kernel spreads connections between them
+			ReusePort
+		};
+
 		struct Options {
-			Options(bool _nonBlock);
+			Options(bool _nonBlock, BatchPolicy _batchPolicy = BatchPolicy::Blocking, DispatchMode _dispatchMode = DispatchMode::Dispatcher);
 			bool nonBlock;
+			BatchPolicy batchPolicy;
+			DispatchMode dispatchMode;
+			// batch with less events than this is considered small
+			size_t smallBatchSize = 4;
+			// upper bound for events buffer, it grows while epoll keeps filling it completely
+			size_t maxEpollEvents = 4096;
+			std::chrono::microseconds coalesceTimeout{ 50 };
+			std::chrono::microseconds busyPollTimeout{ 50 };
+			ConnectionTimeouts timeouts;
+			AdmissionLimits limits;
+			// while accepting is paused, acceptor checks limits this often
+			std::chrono::milliseconds acceptRetryInterval{ 100 };
+			// responses to plain tcp clients with shared bodies of at least this size are sent with MSG_ZEROCOPY, 0 - off
+			size_t zeroCopyMinSize = 0;
+			// binary access log, empty - no access log
+			std::string accessLogPath;
+			size_t accessLogSegmentSize = AccessLog::DefaultSegmentSize;
 		};
 
 		TcpServer(std::string_view ipv4, uint16_t port, Options&& opts);
+		~TcpServer();
 	private:
+		void collectMetrics(MetricsWriter& writer);
 		int init();
 		int run();
+		int runReusePort();
+		int setupListeningSocket(int fd, bool reusePort);
+		int waitEvents(std::vector<epoll_event>& events, size_t offset, std::chrono::microseconds timeout);
+		int collectEvents(std::vector<epoll_event>& events, size_t lastBatchSize, std::chrono::microseconds maxWait);
+		size_t pickWorker();
+		void pauseAccept();
+		void resumeAccept();
 		void serverClose();
 		static constexpr int MAX_LISTENING_CLIENTS = 128;
 		static constexpr int MAX_EPOLL_EVENTS = 100;
@@ -56,7 +103,19 @@ namespace inet::tcp {
 		AddrInfo addrInfo;
 		Options opts;
 
+		// listening sockets of workers except the first one, which uses serverSock (ReusePort mode only)
+		std::vector<std::shared_ptr<SslSocketT>> reusePortSocks;
+
 		SocketThreadMapper socketMapper;
+		AdmissionControl admission;
+		// created by init() if enabled, outlives workers
+		std::unique_ptr<AccessLog> accessLog;
+		// listening socket is removed from epoll while server is over limits
+		bool acceptPaused = false;
+		// epoll_pwait2 has returned ENOSYS, epoll_wait is used since then
+		bool noPwait2 = false;
+		// state of xorshift for picking workers
+		uint64_t pickSeed = 0x9E3779B97F4A7C15ull;
 		util::mt::RollingThreadPool<SocketDataHandler> threadPool;
 	};
 
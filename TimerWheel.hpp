@@ -0,0 +1,154 @@
+#pragma once
+#include <cstdint>
+#include <cstddef>
+
+// hierarchical timing wheel with intrusive timers, not thread-safe
+// schedule() and cancel() are O(1), advance() costs O(1) per tick plus moving timers down from upper levels when lower one wraps
+// time is measured in abstract ticks, owner decides how long tick is
+class TimerWheel {
+	struct Link {
+		Link* prev = nullptr;
+		Link* next = nullptr;
+	};
+public:
+	// embedded into owner's object, unlinks itself when destroyed
+	class Timer : private Link {
+	public:
+		Timer() = default;
+		// copy is never linked, assigned timer is cancelled
+		Timer(const Timer&) {}
+		Timer& operator=(const Timer&) { cancel(); return *this; }
+		~Timer() { cancel(); }
+		inline bool active() const { return prev != nullptr; }
+		// valid while active
+		inline uint64_t expiry() const { return _expiry; }
+		void cancel() {
+			if (!prev) {
+				return;
+			}
+			prev->next = next;
+			next->prev = prev;
+			prev = next = nullptr;
+			--wheel->_size;
+		}
+		// set by owner to recognize timer on expiration
+		int key = -1;
+	private:
+		friend class TimerWheel;
+		TimerWheel* wheel = nullptr;
+		uint64_t _expiry = 0;
+	};
+
+	TimerWheel() {
+		for (auto& level : slots) {
+			for (auto& head : level) {
+				head.prev = head.next = &head;
+			}
+		}
+	}
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+	// timer fires at the first advance() reaching expiry, already scheduled timer is moved
+	// expiry farther than wheel's range is clamped, so timer fires early and owner should check its own deadline
+	void schedule(Timer& timer, uint64_t expiry) {
+		timer.cancel();
+		timer.wheel = this;
+		timer._expiry = (expiry < current) ? current : expiry;
+		place(timer);
+		++_size;
+	}
+
+	// fires all timers expiring up to tick inclusive, onExpire(Timer&) gets already unlinked timer and may schedule it again
+	template<typename F>
+	void advance(uint64_t tick, F&& onExpire) {
+		if (_size == 0) {
+			// nothing to move or fire, so ticks may be skipped
+			current = (tick + 1 > current) ? tick + 1 : current;
+			return;
+		}
+		while (current <= tick) {
+			size_t idx = current & SlotMask;
+			// lower level wrapped - timers of the next range go down
+			for (size_t level = 1; (idx == 0) && (level < Levels); ++level) {
+				idx = (current >> (level * SlotBits)) & SlotMask;
+				cascade(slots[level][idx]);
+			}
+			Link expired;
+			take(slots[0][current & SlotMask], expired);
+			++current;
+			while (expired.next != &expired) {
+				auto timer = static_cast<Timer*>(expired.next);
+				unlink(*timer);
+				--_size;
+				onExpire(*timer);
+			}
+		}
+	}
+
+	inline size_t size() const { return _size; }
+	inline bool empty() const { return _size == 0; }
+	// next tick to be processed
+	inline uint64_t now() const { return current; }
+
+	static constexpr size_t Levels = 4;
+	static constexpr size_t SlotBits = 6;
+	static constexpr size_t SlotsCount = size_t(1) << SlotBits;
+	static constexpr uint64_t Range = uint64_t(1) << (Levels * SlotBits);
+private:
+	static constexpr uint64_t SlotMask = SlotsCount - 1;
+
+	// slot is chosen by distance from current tick, and indexed by expiry bits of that level
+	void place(Timer& timer) {
+		uint64_t delta = timer._expiry - current;
+		if (delta >= Range) {
+			timer._expiry = current + Range - 1;
+			delta = Range - 1;
+		}
+		size_t level = 0;
+		while ((level + 1 < Levels) && (delta >= (uint64_t(1) << ((level + 1) * SlotBits)))) {
+			++level;
+		}
+		link(slots[level][(timer._expiry >> (level * SlotBits)) & SlotMask], timer);
+	}
+
+	void cascade(Link& head) {
+		Link moving;
+		take(head, moving);
+		while (moving.next != &moving) {
+			auto timer = static_cast<Timer*>(moving.next);
+			unlink(*timer);
+			place(*timer);
+		}
+	}
+
+	// moves whole list of head to empty list
+	static void take(Link& head, Link& to) {
+		if (head.next == &head) {
+			to.prev = to.next = &to;
+			return;
+		}
+		to.next = head.next;
+		to.prev = head.prev;
+		to.next->prev = &to;
+		to.prev->next = &to;
+		head.prev = head.next = &head;
+	}
+
+	static void link(Link& head, Link& node) {
+		node.prev = head.prev;
+		node.next = &head;
+		head.prev->next = &node;
+		head.prev = &node;
+	}
+
+	static void unlink(Link& node) {
+		node.prev->next = node.next;
+		node.next->prev = node.prev;
+		node.prev = node.next = nullptr;
+	}
+
+	Link slots[Levels][SlotsCount];
+	uint64_t current = 0;
+	size_t _size = 0;
+};
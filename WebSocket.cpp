@@ -0,0 +1,243 @@
+#include "WebSocket.hpp"
+#include <string.h>
+#include <openssl/sha.h>
+#include <openssl/evp.h>
+
+// appended to client's key before hashing, see RFC 6455 section 4.2.2
+static constexpr std::string_view AcceptGuid = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+WebSocket::WebSocket(std::unique_ptr<WebSocketHandler> handler, size_t _maxMessageSize, SendFn _send, SubscribeFn subscribe)
+	: _handler{ std::move(handler) }, maxMessageSize{ _maxMessageSize }, send{ std::move(_send) }, _subscribe{ std::move(subscribe) }
+{
+	;
+}
+
+void WebSocket::open() {
+	_handler->onOpen(*this);
+}
+
+bool WebSocket::onData(char* data, size_t size, size_t& consumed) {
+	consumed = 0;
+	while (!_closing && (size - consumed >= 2)) {
+		auto p = (const uint8_t*)data + consumed;
+		size_t avail = size - consumed;
+		bool fin = (p[0] & 0x80) != 0;
+		auto opcode = (Opcode)(p[0] & 0x0F);
+		if ((p[0] & 0x70) || !(p[1] & 0x80)) {
+			// no extensions are negotiated, so reserved bits must be clear, and client frames must be masked
+			return fail(CloseProtocolError);
+		}
+		uint64_t length = p[1] & 0x7F;
+		size_t headerSize = 2;
+		if (length == 126) {
+			headerSize = 4;
+			if (avail < headerSize) break;
+			length = ((uint64_t)p[2] << 8) | p[3];
+		}
+		else if (length == 127) {
+			headerSize = 10;
+			if (avail < headerSize) break;
+			length = 0;
+			for (int i = 2; i < 10; ++i) {
+				length = (length << 8) | p[i];
+			}
+		}
+		if (((uint8_t)opcode & 0x08) && (!fin || (length > MaxControlPayload))) {
+			return fail(CloseProtocolError);
+		}
+		// checked before payload is received, so too big message is rejected right away
+		if (!((uint8_t)opcode & 0x08) && (length > maxMessageSize - message.size())) {
+			return fail(CloseTooBig);
+		}
+		// masking key
+		headerSize += 4;
+		if ((avail < headerSize) || (avail - headerSize < length)) {
+			break;
+		}
+		char* payload = data + consumed + headerSize;
+		unmask(payload, length, p + headerSize - 4);
+		consumed += headerSize + length;
+		if (!onFrame(opcode, fin, std::string_view(payload, length))) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool WebSocket::onFrame(Opcode opcode, bool fin, std::string_view payload) {
+	switch (opcode) {
+	case Opcode::Text:
+	case Opcode::Binary:
+		if (messageOpcode != Opcode::Continuation) {
+			// previous message is not finished
+			return fail(CloseProtocolError);
+		}
+		if (fin) {
+			// not fragmented - handler gets it right from input buffer
+			_handler->onMessage(*this, payload, opcode == Opcode::Binary);
+			return true;
+		}
+		messageOpcode = opcode;
+		message.assign(payload);
+		return true;
+	case Opcode::Continuation:
+		if (messageOpcode == Opcode::Continuation) {
+			return fail(CloseProtocolError);
+		}
+		message.append(payload);
+		if (fin) {
+			bool binary = (messageOpcode == Opcode::Binary);
+			messageOpcode = Opcode::Continuation;
+			auto complete = std::move(message);
+			message.clear();
+			_handler->onMessage(*this, complete, binary);
+		}
+		return true;
+	case Opcode::Ping:
+		if (!_closing) {
+			send(frame(Opcode::Pong, payload));
+		}
+		return true;
+	case Opcode::Pong:
+		return true;
+	case Opcode::Close: {
+		if (payload.size() == 1) {
+			return fail(CloseProtocolError);
+		}
+		uint16_t code = (payload.size() >= 2) ? (((uint8_t)payload[0] << 8) | (uint8_t)payload[1]) : CloseNoStatus;
+		// echoing status code back completes handshake
+		_closing = true;
+		send(frame(Opcode::Close, payload.substr(0, 2)));
+		notifyClose(code);
+		return true;
+	}
+	default:
+		return fail(CloseProtocolError);
+	}
+}
+
+bool WebSocket::fail(uint16_t code) {
+	close(code);
+	return false;
+}
+
+void WebSocket::notifyClose(uint16_t code) {
+	if (!closed) {
+		closed = true;
+		_handler->onClose(*this, code);
+	}
+}
+
+void WebSocket::disconnected() {
+	_closing = true;
+	notifyClose(CloseAbnormal);
+}
+
+void WebSocket::sendText(std::string_view message) {
+	if (!_closing) {
+		send(frame(Opcode::Text, message));
+	}
+}
+
+void WebSocket::sendBinary(std::string_view message) {
+	if (!_closing) {
+		send(frame(Opcode::Binary, message));
+	}
+}
+
+void WebSocket::ping(std::string_view payload) {
+	if (!_closing) {
+		send(frame(Opcode::Ping, payload.substr(0, MaxControlPayload)));
+	}
+}
+
+void WebSocket::close(uint16_t code, std::string_view reason) {
+	if (_closing) {
+		return;
+	}
+	_closing = true;
+	std::string payload;
+	payload += (char)(code >> 8);
+	payload += (char)(code & 0xFF);
+	payload += reason.substr(0, MaxControlPayload - 2);
+	send(frame(Opcode::Close, payload));
+	notifyClose(code);
+}
+
+void WebSocket::subscribe(const std::string& topic) {
+	if (!_closing) {
+		_subscribe(topic);
+	}
+}
+
+// Connection header is a list of tokens, e.g. "keep-alive, Upgrade"
+bool WebSocket::isUpgrade(std::string_view upgrade, std::string_view connection) {
+	if ((upgrade.size() != 9) || (strncasecmp(upgrade.data(), "websocket", 9) != 0)) {
+		return false;
+	}
+	while (!connection.empty()) {
+		size_t comma = connection.find(',');
+		auto token = connection.substr(0, comma);
+		while (!token.empty() && (token.front() == ' ')) token.remove_prefix(1);
+		while (!token.empty() && (token.back() == ' ')) token.remove_suffix(1);
+		if ((token.size() == 7) && (strncasecmp(token.data(), "upgrade", 7) == 0)) {
+			return true;
+		}
+		connection = (comma == std::string_view::npos) ? std::string_view() : connection.substr(comma + 1);
+	}
+	return false;
+}
+
+std::string WebSocket::acceptKey(std::string_view key) {
+	std::string s(key);
+	s += AcceptGuid;
+	unsigned char digest[SHA_DIGEST_LENGTH];
+	SHA1((const unsigned char*)s.data(), s.size(), digest);
+	// 20 bytes are 28 base64 characters, EVP_EncodeBlock adds terminating zero
+	char encoded[4 * ((SHA_DIGEST_LENGTH + 2) / 3) + 1];
+	int len = EVP_EncodeBlock((unsigned char*)encoded, digest, SHA_DIGEST_LENGTH);
+	return std::string(encoded, len);
+}
+
+std::string WebSocket::frame(Opcode opcode, std::string_view payload) {
+	std::string res;
+	size_t size = payload.size();
+	res.reserve(size + 10);
+	res += (char)(0x80 | (uint8_t)opcode);
+	if (size < 126) {
+		res += (char)size;
+	}
+	else if (size <= 0xFFFF) {
+		res += (char)126;
+		res += (char)(size >> 8);
+		res += (char)(size & 0xFF);
+	}
+	else {
+		res += (char)127;
+		for (int shift = 56; shift >= 0; shift -= 8) {
+			res += (char)(((uint64_t)size >> shift) & 0xFF);
+		}
+	}
+	res += payload;
+	return res;
+}
+
+void WebSocket::unmask(char* data, size_t size, const uint8_t key[4]) {
+	// key repeated twice, byte i of payload is xored with byte i % 8 of it
+	uint8_t key8[8];
+	for (int i = 0; i < 8; ++i) {
+		key8[i] = key[i % 4];
+	}
+	uint64_t mask;
+	memcpy(&mask, key8, sizeof(mask));
+	size_t i = 0;
+	for (; i + sizeof(mask) <= size; i += sizeof(mask)) {
+		uint64_t word;
+		memcpy(&word, data + i, sizeof(word));
+		word ^= mask;
+		memcpy(data + i, &word, sizeof(word));
+	}
+	for (; i < size; ++i) {
+		data[i] ^= key8[i % 8];
+	}
+}
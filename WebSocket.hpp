@@ -0,0 +1,89 @@
+#pragma once
+#include <string>
+#include <string_view>
+#include <memory>
+#include <functional>
+#include <cstdint>
+
+class WebSocket;
+
+// application side of websocket connection, one instance per connection
+// callbacks are called on socket worker's thread, fragmented messages are already joined
+class WebSocketHandler {
+public:
+	virtual ~WebSocketHandler() = default;
+	virtual void onOpen(WebSocket&) {}
+	// text messages are passed as is, without utf-8 validation
+	virtual void onMessage(WebSocket& ws, std::string_view message, bool binary) = 0;
+	// called once, code is 1006 if connection is lost without close frame
+	virtual void onClose(WebSocket&, uint16_t) {}
+};
+
+// server side of RFC 6455 connection: frame parsing, reassembly of fragments, ping/pong and close handshake
+// frames are read from and written to connection's buffers by socket worker, so plain tcp and ssl sockets work the same way
+// no extensions are negotiated, so permessage-deflate offered by client is declined
+class WebSocket {
+public:
+	enum class Opcode : uint8_t {
+		Continuation = 0x0,
+		Text = 0x1,
+		Binary = 0x2,
+		Close = 0x8,
+		Ping = 0x9,
+		Pong = 0xA
+	};
+	// status codes of close frame
+	static constexpr uint16_t CloseNormal = 1000;
+	static constexpr uint16_t CloseGoingAway = 1001;
+	static constexpr uint16_t CloseProtocolError = 1002;
+	static constexpr uint16_t CloseNoStatus = 1005;
+	static constexpr uint16_t CloseAbnormal = 1006;
+	static constexpr uint16_t CloseTooBig = 1009;
+	// takes encoded frame
+	using SendFn = std::function<void(std::string&& frame)>;
+	using SubscribeFn = std::function<void(const std::string& topic)>;
+	WebSocket(std::unique_ptr<WebSocketHandler> handler, size_t maxMessageSize, SendFn send, SubscribeFn subscribe);
+	void open();
+	// handles all complete frames in data and returns number of bytes taken in consumed, frames are unmasked in place
+	// false - peer has violated protocol, close frame is already sent
+	bool onData(char* data, size_t size, size_t& consumed);
+	// connection is gone without close handshake
+	void disconnected();
+	void sendText(std::string_view message);
+	void sendBinary(std::string_view message);
+	void ping(std::string_view payload = {});
+	// starts close handshake, nothing is sent or received after it
+	void close(uint16_t code = CloseNormal, std::string_view reason = {});
+	// payloads published to topic are sent to this connection as text messages
+	void subscribe(const std::string& topic);
+	// close frame is sent, connection is closed once it is written
+	inline bool closing() const { return _closing; }
+	inline WebSocketHandler& handler() { return *_handler; }
+	// whether request headers ask for websocket upgrade
+	static bool isUpgrade(std::string_view upgrade, std::string_view connection);
+	// value of Sec-WebSocket-Accept for client's Sec-WebSocket-Key
+	static std::string acceptKey(std::string_view key);
+	// server frames are not masked, so one encoded frame may be sent to many clients
+	static std::string frame(Opcode opcode, std::string_view payload);
+	// xor with 4-byte key, 8 bytes at a time
+	static void unmask(char* data, size_t size, const uint8_t key[4]);
+	static constexpr std::string_view Version = "13";
+	// control frames can't be fragmented or longer
+	static constexpr size_t MaxControlPayload = 125;
+private:
+	bool onFrame(Opcode opcode, bool fin, std::string_view payload);
+	bool fail(uint16_t code);
+	void notifyClose(uint16_t code);
+
+	std::unique_ptr<WebSocketHandler> _handler;
+	size_t maxMessageSize;
+	SendFn send;
+	SubscribeFn _subscribe;
+	// fragments of message being received
+	std::string message;
+	// opcode of first fragment, Continuation - no fragmented message in progress
+	Opcode messageOpcode = Opcode::Continuation;
+	bool _closing = false;
+	// onClose is called
+	bool closed = false;
+};
@@ -0,0 +1,127 @@
+// converts binary access log written by AccessLog to text lines or json lines
+// standalone tool, not a part of server's shared items:
+//   g++ -std=c++20 -I.. AccessLogDump.cpp -o access_log_dump
+// usage: access_log_dump [--json] file...
+#include "AccessLog.hpp"
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <errno.h>
+#include <ctime>
+#include <cstdio>
+#include <string>
+#include <string_view>
+#include <algorithm>
+#include <iterator>
+
+static std::string formatTime(uint64_t micros) {
+	time_t t = (time_t)(micros / 1000000);
+	struct tm tm;
+	localtime_r(&t, &tm);
+	char buf[64];
+	size_t len = strftime(buf, sizeof(buf), "%Y-%m-%dT%H:%M:%S", &tm);
+	snprintf(buf + len, sizeof(buf) - len, ".%06u", (unsigned)(micros % 1000000));
+	return buf;
+}
+
+static std::string formatAddr(const AccessRecord& record) {
+	char buf[INET6_ADDRSTRLEN] = "-";
+	if ((record.family == AF_INET) || (record.family == AF_INET6)) {
+		inet_ntop(record.family, record.addr, buf, sizeof(buf));
+	}
+	return buf;
+}
+
+static std::string_view field(const char* data, size_t capacity) {
+	return std::string_view(data, strnlen(data, capacity));
+}
+
+static std::string jsonEscape(std::string_view s) {
+	std::string res;
+	for (char c : s) {
+		switch (c) {
+		case '"': res += "\\\""; break;
+		case '\\': res += "\\\\"; break;
+		default:
+			// url bytes are not validated as utf-8, so everything outside of ascii is escaped as well
+			if (((unsigned char)c < 0x20) || ((unsigned char)c >= 0x7f)) {
+				char buf[8];
+				snprintf(buf, sizeof(buf), "\\u%04x", (unsigned char)c);
+				res += buf;
+			}
+			else {
+				res += c;
+			}
+		}
+	}
+	return res;
+}
+
+static void printText(const AccessRecord& record) {
+	auto method = field(record.method, sizeof(record.method));
+	auto url = field(record.url, std::min<size_t>(record.urlSize, AccessRecord::UrlCapacity));
+	printf("%s %s:%u %.*s %.*s%s %u %llu %.3fms w%u\n",
+		formatTime(record.time).c_str(), formatAddr(record).c_str(), record.port,
+		(int)(method.empty() ? 1 : method.size()), method.empty() ? "-" : method.data(),
+		(int)(url.empty() ? 1 : url.size()), url.empty() ? "-" : url.data(), (record.urlSize > AccessRecord::UrlCapacity) ? "..." : "",
+		record.status, (unsigned long long)record.bytes, record.latency / 1000.0, record.worker);
+}
+
+static void printJson(const AccessRecord& record) {
+	auto url = field(record.url, std::min<size_t>(record.urlSize, AccessRecord::UrlCapacity));
+	printf("{\"time\":\"%s\",\"addr\":\"%s\",\"port\":%u,\"method\":\"%s\",\"url\":\"%s\",\"urlTruncated\":%s,\"status\":%u,\"bytes\":%llu,\"latencyUs\":%u,\"worker\":%u}\n",
+		formatTime(record.time).c_str(), formatAddr(record).c_str(), record.port,
+		jsonEscape(field(record.method, sizeof(record.method))).c_str(), jsonEscape(url).c_str(), (record.urlSize > AccessRecord::UrlCapacity) ? "true" : "false",
+		record.status, (unsigned long long)record.bytes, record.latency, record.worker);
+}
+
+// false - file is not an access log
+static bool dump(const char* path, bool json) {
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		fprintf(stderr, "%s: %s\n", path, strerror(errno));
+		return false;
+	}
+	AccessLogHeader header;
+	if ((fread(&header, sizeof(header), 1, f) != 1) || (memcmp(header.magic, AccessLogHeader::Magic, sizeof(header.magic)) != 0) ||
+		(header.version != AccessLogHeader::Version) || (header.recordSize != sizeof(AccessRecord))) {
+		fprintf(stderr, "%s: not an access log of version %u\n", path, AccessLogHeader::Version);
+		fclose(f);
+		return false;
+	}
+	AccessRecord records[256];
+	size_t n;
+	while ((n = fread(records, sizeof(AccessRecord), std::size(records), f)) > 0) {
+		for (size_t i = 0; i < n; ++i) {
+			if (records[i].time == 0) {
+				// preallocated tail of file being written, or of crashed process
+				fclose(f);
+				return true;
+			}
+			json ? printJson(records[i]) : printText(records[i]);
+		}
+	}
+	fclose(f);
+	return true;
+}
+
+int main(int argc, char** argv) {
+	bool json = false;
+	int files = 0;
+	int rc = 0;
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "--json") == 0) {
+			json = true;
+			continue;
+		}
+		++files;
+		if (!dump(argv[i], json)) {
+			rc = 1;
+		}
+	}
+	if (files == 0) {
+		fprintf(stderr, "usage: %s [--json] file...\n", argv[0]);
+		return 2;
+	}
+	return rc;
+}
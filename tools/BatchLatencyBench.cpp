@@ -0,0 +1,220 @@
+// compares event latency of acceptor loop with old 10 ms cooldown sleep and with every TcpServer::Options::BatchPolicy
+// one thread sends timestamped messages over socket pairs at fixed rate, loop waits for them the same way as
+// TcpServer::collectEvents does and records how long every message has been waiting
+// standalone tool, not a part of server's shared items:
+//   g++ -std=c++20 -O2 -pthread [-DHAVE_EPOLL_PWAIT2] BatchLatencyBench.cpp -o batch_latency_bench
+// usage: batch_latency_bench [messages per second] [seconds per mode] [connections]
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+using Clock = std::chrono::steady_clock;
+
+enum class Mode {
+	// epoll_wait, then sleep_for(10ms) - the loop before batching policies
+	Sleep,
+	Blocking,
+	Adaptive,
+	BusyPoll
+};
+
+static const char* modeName(Mode mode) {
+	switch (mode) {
+	case Mode::Sleep: return "sleep 10ms (old)";
+	case Mode::Blocking: return "Blocking";
+	case Mode::Adaptive: return "Adaptive";
+	case Mode::BusyPoll: return "BusyPoll";
+	}
+	return "";
+}
+
+// defaults of TcpServer::Options
+static constexpr size_t SmallBatchSize = 4;
+static constexpr size_t MaxEpollEvents = 4096;
+static constexpr size_t InitialEpollEvents = 100;
+static constexpr std::chrono::microseconds CoalesceTimeout{ 50 };
+static constexpr std::chrono::microseconds BusyPollTimeout{ 50 };
+
+static uint64_t nowNanos() {
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now().time_since_epoch()).count();
+}
+
+// the same as TcpServer::waitEvents
+static int waitEvents(int epollFd, std::vector<epoll_event>& events, size_t offset, std::chrono::microseconds timeout) {
+	int maxEvents = (int)(events.size() - offset);
+	int res = 0;
+	if (timeout.count() <= 0) {
+		res = epoll_wait(epollFd, events.data() + offset, maxEvents, timeout.count() < 0 ? -1 : 0);
+	}
+	else {
+#ifdef HAVE_EPOLL_PWAIT2
+		timespec ts{ (time_t)(timeout.count() / 1000000), (long)(timeout.count() % 1000000) * 1000 };
+		res = epoll_pwait2(epollFd, events.data() + offset, maxEvents, &ts, NULL);
+#else
+		res = epoll_wait(epollFd, events.data() + offset, maxEvents, (int)((timeout.count() + 999) / 1000));
+#endif
+	}
+	if (res < 0 && errno == EINTR) {
+		res = 0;
+	}
+	return res;
+}
+
+// the same as TcpServer::collectEvents with infinite maxWait
+static int collectEvents(Mode mode, int epollFd, std::vector<epoll_event>& events, size_t lastBatchSize) {
+	bool smallBatch = lastBatchSize < SmallBatchSize;
+	int res = 0;
+	size_t numEvents = 0;
+	if (mode == Mode::BusyPoll && smallBatch) {
+		auto deadline = Clock::now() + BusyPollTimeout;
+		do {
+			res = waitEvents(epollFd, events, 0, std::chrono::microseconds(0));
+		} while (res == 0 && Clock::now() < deadline);
+		if (res < 0) return -1;
+		numEvents = res;
+	}
+	while (numEvents == 0) {
+		if (res = waitEvents(epollFd, events, 0, std::chrono::microseconds(-1)); res < 0) return -1;
+		numEvents = res;
+	}
+	if (mode == Mode::Adaptive && numEvents < std::min(SmallBatchSize, events.size())) {
+		if (res = waitEvents(epollFd, events, numEvents, CoalesceTimeout); res < 0) return -1;
+		numEvents += res;
+	}
+	while (numEvents == events.size() && events.size() < MaxEpollEvents) {
+		events.resize(std::min(events.size() * 2, MaxEpollEvents));
+		if (res = waitEvents(epollFd, events, numEvents, std::chrono::microseconds(0)); res <= 0) break;
+		numEvents += res;
+	}
+	return (int)numEvents;
+}
+
+struct Result {
+	double p50 = 0;
+	double p99 = 0;
+	double max = 0;
+	size_t messages = 0;
+	size_t wakeups = 0;
+};
+
+static Result run(Mode mode, size_t rate, double seconds, size_t connections) {
+	int epollFd = epoll_create1(0);
+	std::vector<int> readers, writers;
+	for (size_t i = 0; i < connections; ++i) {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, fds) < 0) {
+			perror("socketpair");
+			exit(1);
+		}
+		readers.push_back(fds[0]);
+		writers.push_back(fds[1]);
+		epoll_event event{};
+		event.events = EPOLLIN | EPOLLET;
+		event.data.fd = fds[0];
+		epoll_ctl(epollFd, EPOLL_CTL_ADD, fds[0], &event);
+	}
+	int stopFds[2];
+	socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, stopFds);
+	epoll_event stopEvent{};
+	stopEvent.events = EPOLLIN;
+	stopEvent.data.fd = stopFds[0];
+	epoll_ctl(epollFd, EPOLL_CTL_ADD, stopFds[0], &stopEvent);
+
+	size_t total = (size_t)(rate * seconds);
+	std::thread sender([&writers, &stopFds, rate, total]() {
+		auto interval = std::chrono::nanoseconds(1000000000 / rate);
+		auto next = Clock::now();
+		uint64_t seed = 88172645463325252ull;
+		for (size_t i = 0; i < total; ++i) {
+			next += interval;
+			std::this_thread::sleep_until(next);
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			uint64_t stamp = nowNanos();
+			write(writers[seed % writers.size()], &stamp, sizeof(stamp));
+		}
+		char one = 1;
+		write(stopFds[1], &one, 1);
+		});
+
+	std::vector<uint64_t> latencies;
+	latencies.reserve(total);
+	std::vector<epoll_event> events(InitialEpollEvents);
+	size_t lastBatchSize = 0;
+	Result result;
+	bool stop = false;
+	while (!stop) {
+		int numEvents = (mode == Mode::Sleep) ? waitEvents(epollFd, events, 0, std::chrono::microseconds(-1)) : collectEvents(mode, epollFd, events, lastBatchSize);
+		if (numEvents < 0) {
+			perror("epoll");
+			exit(1);
+		}
+		++result.wakeups;
+		lastBatchSize = numEvents;
+		for (int i = 0; i < numEvents; ++i) {
+			int fd = events[i].data.fd;
+			if (fd == stopFds[0]) {
+				stop = true;
+				continue;
+			}
+			uint64_t stamps[64];
+			ssize_t n;
+			while ((n = read(fd, stamps, sizeof(stamps))) > 0) {
+				uint64_t now = nowNanos();
+				for (size_t k = 0; k < (size_t)n / sizeof(uint64_t); ++k) {
+					latencies.push_back(now - stamps[k]);
+				}
+			}
+		}
+		if (mode == Mode::Sleep) {
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+	}
+	sender.join();
+	for (size_t i = 0; i < connections; ++i) {
+		close(readers[i]);
+		close(writers[i]);
+	}
+	close(stopFds[0]);
+	close(stopFds[1]);
+	close(epollFd);
+
+	std::sort(latencies.begin(), latencies.end());
+	result.messages = latencies.size();
+	if (!latencies.empty()) {
+		auto at = [&latencies](double q) { return latencies[std::min(latencies.size() - 1, (size_t)(q * latencies.size()))] / 1000.0; };
+		result.p50 = at(0.5);
+		result.p99 = at(0.99);
+		result.max = latencies.back() / 1000.0;
+	}
+	return result;
+}
+
+int main(int argc, char** argv) {
+	size_t rate = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 5000;
+	double seconds = (argc > 2) ? strtod(argv[2], nullptr) : 2.0;
+	size_t connections = (argc > 3) ? strtoull(argv[3], nullptr, 10) : 64;
+	if ((rate == 0) || (seconds <= 0) || (connections == 0)) {
+		fprintf(stderr, "usage: %s [messages per second] [seconds per mode] [connections]\n", argv[0]);
+		return 1;
+	}
+	printf("%zu messages/s over %zu connections, %.1f s per mode\n", rate, connections, seconds);
+	printf("%-18s %10s %10s %10s %10s\n", "mode", "p50 us", "p99 us", "max us", "wakeups");
+	for (auto mode : { Mode::Sleep, Mode::Blocking, Mode::Adaptive, Mode::BusyPoll }) {
+		auto res = run(mode, rate, seconds, connections);
+		printf("%-18s %10.1f %10.1f %10.1f %10zu\n", modeName(mode), res.p50, res.p99, res.max, res.wakeups);
+	}
+	return 0;
+}
@@ -0,0 +1,154 @@
+// measures socket events per second one worker takes from the dispatcher:
+// - typed path: SocketEvent pushed into SpscRing, worker sleeping on wake sequence
+// - task path used before: std::function wrapped into packaged_task<std::any(std::any&)> with std::any arguments,
+//   queued under mutex and popped with popWaitFor, the way RollingThreadPool::pushTask and SafeQueue do it
+// standalone tool, not a part of server's shared items:
+//   g++ -std=c++20 -O2 -pthread -I.. SpscRingBench.cpp -o spsc_ring_bench
+// usage: spsc_ring_bench [events]
+#include "SpscRing.hpp"
+#include <any>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <tuple>
+
+// the same layout as SocketEvent
+struct Event {
+	int fd;
+	uint8_t kind;
+	uint32_t epoch;
+};
+
+// stands for inet::ISocket, which was passed by shared_ptr with every event
+struct Socket {
+	int fd = 0;
+};
+
+// sink for handled events, so handlers are not optimized out
+static std::atomic<uint64_t> handled = 0;
+
+static void onInputData(int epollFd, const std::shared_ptr<Socket>& sock) {
+	handled.fetch_add((uint64_t)(epollFd + sock->fd), std::memory_order_relaxed);
+}
+
+class TypedWorker {
+public:
+	void push(const Event& event) {
+		while (!ring->push(event)) {
+			std::this_thread::yield();
+		}
+		wakeSeq.fetch_add(1);
+		if (sleeping.load()) {
+			wakeSeq.notify_one();
+		}
+	}
+	void run(size_t events, const std::shared_ptr<Socket>& sock) {
+		Event event;
+		for (size_t i = 0; i < events; ) {
+			uint64_t seq = wakeSeq.load();
+			bool worked = false;
+			while (ring->pop(event)) {
+				onInputData(event.fd, sock);
+				worked = true;
+				++i;
+			}
+			if (!worked) {
+				sleeping = true;
+				if (wakeSeq.load() == seq) {
+					wakeSeq.wait(seq);
+				}
+				sleeping = false;
+			}
+		}
+	}
+private:
+	std::unique_ptr<SpscRing<Event, 4096>> ring = std::make_unique<SpscRing<Event, 4096>>();
+	std::atomic<uint64_t> wakeSeq = 0;
+	std::atomic<bool> sleeping = false;
+};
+
+class TaskWorker {
+public:
+	using TaskT = std::pair<std::packaged_task<std::any(std::any&)>, std::any>;
+	template<typename R, typename... Args, typename... Vals>
+	void pushTask(std::function<R(Args...)> fn, Vals&&... vals) {
+		std::packaged_task<std::any(std::any&)> task([fn = std::move(fn)](std::any& args) {
+			return std::any(std::apply(fn, std::any_cast<std::tuple<Args...>&>(args)));
+			});
+		std::any args = std::tuple<Args...>(std::forward<Vals>(vals)...);
+		{
+			std::lock_guard<std::mutex> lck(mtx);
+			queue.emplace_back(std::move(task), std::move(args));
+		}
+		cv.notify_one();
+	}
+	void run(size_t events) {
+		for (size_t i = 0; i < events; ) {
+			TaskT task;
+			{
+				std::unique_lock<std::mutex> lck(mtx);
+				if (!cv.wait_for(lck, std::chrono::milliseconds(1000), [this]() { return !queue.empty(); })) {
+					continue;
+				}
+				task = std::move(queue.front());
+				queue.pop_front();
+			}
+			task.first(task.second);
+			++i;
+		}
+	}
+private:
+	std::mutex mtx;
+	std::condition_variable cv;
+	std::deque<TaskT> queue;
+};
+
+static double seconds(std::chrono::steady_clock::time_point start) {
+	return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+static double runTyped(size_t events) {
+	TypedWorker worker;
+	auto sock = std::make_shared<Socket>();
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&worker, &sock, events]() { worker.run(events, sock); });
+	for (size_t i = 0; i < events; ++i) {
+		worker.push({ 3, 0, (uint32_t)i });
+	}
+	consumer.join();
+	return events / seconds(start);
+}
+
+static double runTasks(size_t events) {
+	TaskWorker worker;
+	auto sock = std::make_shared<Socket>();
+	auto start = std::chrono::steady_clock::now();
+	std::thread consumer([&worker, events]() { worker.run(events); });
+	for (size_t i = 0; i < events; ++i) {
+		// the socket was copied out of the mapper for every event
+		std::shared_ptr<Socket> clientSock = sock;
+		int epollFd = 3;
+		worker.pushTask(std::function([](int epollFd, std::shared_ptr<Socket> clientSock) { onInputData(epollFd, clientSock); return 0; }), std::move(epollFd), std::move(clientSock));
+	}
+	consumer.join();
+	return events / seconds(start);
+}
+
+int main(int argc, char** argv) {
+	size_t events = (argc > 1) ? strtoull(argv[1], nullptr, 10) : 2000000;
+	double typed = runTyped(events);
+	double tasks = runTasks(events);
+	printf("typed ring:          %.2f M events/s per worker\n", typed / 1e6);
+	printf("packaged_task + any: %.2f M events/s per worker\n", tasks / 1e6);
+	printf("speedup:             %.1fx\n", typed / tasks);
+	return 0;
+}